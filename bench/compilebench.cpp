@@ -0,0 +1,250 @@
+// Compile throughput benchmark: generates programs of a few shapes and times each phase of compilation
+// Run with make bench, see PrintUsage for options
+
+#include "../src/compileerror.hpp"
+#include "../src/tokenizer.hpp"
+#include "../src/parser.hpp"
+#include "../src/analyzer.hpp"
+#include "../src/generator.hpp"
+#include "../src/parallel.hpp"
+#include "../src/arena.hpp"
+#include "../src/json.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <charconv>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/core.h>
+#include <fmt/os.h>
+
+// What the generated program is made of, counts are multiplied by -scale
+struct Shape {
+    const char* name;
+    const char* description;
+    size_t numProcedures;
+    size_t nestingDepth;   // Ifs and loops around the innermost statements
+    size_t numOperands;    // In the long expression of each procedure
+    size_t numLiterals;    // String and float literals each, per procedure
+};
+
+static constexpr std::array SHAPES{
+    Shape{ "wide", "many small procedures", 20000, 1, 4, 1 },
+    Shape{ "deep", "deeply nested ifs and loops", 500, 48, 4, 1 },
+    Shape{ "long", "long expressions", 2000, 1, 256, 1 },
+    Shape{ "literals", "huge literal pools", 2000, 1, 4, 64 },
+};
+
+static constexpr std::array PHASES{ "tokenize", "parse", "verify", "emit" };
+
+static void AppendExpression(std::string& out, size_t numOperands, size_t seed) {
+    // Groups of four keep the tree from becoming one long chain
+    static constexpr std::array OPERATORS{ " + ", " - ", " * ", " + " };
+    for (size_t i = 0; i < numOperands; ++i) {
+        if (i > 0)
+            out += OPERATORS[(seed + i) % OPERATORS.size()];
+        if (i % 4 == 0)
+            out += '(';
+        if (i % 3 == 0)
+            out += fmt::format("x % {}", (seed + i) % 97 + 1);
+        else if (i % 3 == 1)
+            out += "a";
+        else
+            out += fmt::format("{}", (seed * 31 + i) % 1000);
+        if (i % 4 == 3 || i + 1 == numOperands)
+            out += ')';
+    }
+}
+
+// Every procedure calls the one before it, so verification resolves calls and codegen links them
+static std::string GenerateProgram(const Shape& shape, double scale) {
+    size_t numProcedures = std::max<size_t>(1, static_cast<size_t>(static_cast<double>(shape.numProcedures) * scale));
+    std::string out;
+    out += fmt::format("? Generated by compilebench, shape {} ({})\n\n", shape.name, shape.description);
+    for (size_t i = 0; i < numProcedures; ++i) {
+        out += fmt::format("proc p{}(let i64 a, let f64 b) -> i64 {{\n", i);
+        out += "    mut i64 x = a;\n";
+        out += "    mut f64 y = b;\n";
+        std::string indent = "    ";
+        for (size_t d = 0; d < shape.nestingDepth; ++d) {
+            if (d % 2 == 0)
+                out += fmt::format("{}if (x < {}) {{\n", indent, (i + d) % 50 + 1);
+            else
+                out += fmt::format("{}for (mut i64 j{} = 0; j{} < 3; j{} = j{} + 1) {{\n", indent, d, d, d, d);
+            indent += "    ";
+        }
+        out += indent + "x = x + ";
+        AppendExpression(out, shape.numOperands, i);
+        out += ";\n";
+        for (size_t k = 0; k < shape.numLiterals; ++k) {
+            out += fmt::format("{}puts(\"p{} literal {}\\n\");\n", indent, i, k);
+            out += fmt::format("{}y = y + {}.{};\n", indent, k, i % 1000);
+        }
+        for (size_t d = shape.nestingDepth; d > 0; --d) {
+            indent.resize(indent.size() - 4);
+            out += indent + "}\n";
+        }
+        if (i > 0)
+            out += fmt::format("    return x + ftoi(y) + p{}(x, y);\n", i - 1);
+        else
+            out += "    return x + ftoi(y);\n";
+        out += "}\n\n";
+    }
+    return out;
+}
+
+struct Measurement {
+    std::array<double, PHASES.size()> seconds; // Best of the runs
+    size_t numLines, numTokens;
+};
+
+static Measurement Measure(const std::string& source, size_t numRuns) {
+    Measurement result{};
+    result.seconds.fill(1e300);
+    result.numLines = static_cast<size_t>(std::count(source.begin(), source.end(), '\n'));
+    fmt::ostream sink = fmt::output_file("/dev/null");
+
+    for (size_t run = 0; run < numRuns; ++run) {
+        // Like a compilation, every run allocates from a fresh arena
+        Arena arena{source.size() * 64};
+        ArenaScope arenaScope{&arena};
+        std::vector<File> files{ File{.filename="generated.trash", .source=source, .lineStarts={}} };
+
+        std::array<double, PHASES.size()> seconds{};
+        auto start = std::chrono::steady_clock::now();
+        auto Lap = [&](size_t phase) {
+            auto now = std::chrono::steady_clock::now();
+            seconds[phase] = std::chrono::duration<double>(now - start).count();
+            start = now;
+        };
+        TokenList tokens = TokenizeEntireSource(files);
+        Lap(0);
+        AST ast = ParseEntireProgram(tokens);
+        Lap(1);
+        std::vector<Procedure> procedures = VerifyAST(tokens, ast, false, nullptr, {});
+        Lap(2);
+        EmitInstructions(sink, Target::X86_64_ELF, procedures);
+        sink.flush();
+        Lap(3);
+
+        result.numTokens = tokens.size();
+        for (size_t phase = 0; phase < PHASES.size(); ++phase)
+            result.seconds[phase] = std::min(result.seconds[phase], seconds[phase]);
+    }
+    return result;
+}
+
+static void PrintUsage() {
+    fmt::print(stderr,
+        "Usage: compilebench [options]\n"
+        "-shape <name>    Only runs one shape (wide, deep, long or literals).\n"
+        "-scale <x>       Multiplies the number of procedures of every shape (defaults to 1).\n"
+        "-runs <n>        Times each phase this many times and keeps the best (defaults to 5).\n"
+        "-j <n>           The maximum number of worker threads (defaults to all hardware threads).\n"
+        "-dump <dir>      Writes the generated programs to <dir>/<shape>.trash, for use with trashc.\n"
+        "-save <file>     Writes the throughput of every phase, to compare later runs against.\n"
+        "-compare <file>  Fails if any phase is slower than in the saved file by more than the tolerance.\n"
+        "-tolerance <p>   Percent a phase may be slower before it counts as a regression (defaults to 15).\n"
+        "-h               Displays this information\n"
+    );
+}
+
+template<typename T>
+static T ParseNumber(const std::string& arg) {
+    T value{};
+    auto [ptr, err] = std::from_chars(arg.data(), arg.data() + arg.size(), value);
+    if (err != std::errc{} || ptr != arg.data() + arg.size()) {
+        PrintUsage();
+        exit(1);
+    }
+    return value;
+}
+
+int main(int argc, char** argv) {
+    std::string onlyShape, dumpDir, saveFn, compareFn;
+    double scale = 1, tolerance = 15;
+    size_t numRuns = 5;
+
+    std::vector<std::string> args(argv + 1, argv + argc);
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        if (arg == "-h") {
+            PrintUsage();
+            return 0;
+        }
+        if (i + 1 == args.size()) {
+            PrintUsage();
+            return 1;
+        }
+        const std::string& value = args[++i];
+        if (arg == "-shape") onlyShape = value;
+        else if (arg == "-scale") scale = ParseNumber<double>(value);
+        else if (arg == "-runs") numRuns = std::max<size_t>(1, ParseNumber<size_t>(value));
+        else if (arg == "-j") MaxWorkerThreads() = ParseNumber<size_t>(value);
+        else if (arg == "-dump") dumpDir = value;
+        else if (arg == "-save") saveFn = value;
+        else if (arg == "-compare") compareFn = value;
+        else if (arg == "-tolerance") tolerance = ParseNumber<double>(value);
+        else {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    std::optional<Json> baseline;
+    if (!compareFn.empty()) {
+        std::ifstream file{compareFn};
+        std::stringstream text;
+        text << file.rdbuf();
+        baseline = Json::Parse(text.str());
+        if (!file || !baseline) {
+            fmt::print(stderr, "Error: Could not read results from \"{}\".\n", compareFn);
+            return 1;
+        }
+    }
+
+    // Throughput is in lines per second, so shapes of different sizes compare
+    Json results = Json::Object();
+    bool isRegressed = false;
+    fmt::print("{:<9} {:<9} {:>10} {:>14} {:>14}\n", "shape", "phase", "ms", "lines/s", "tokens/s");
+    for (const Shape& shape : SHAPES) {
+        if (!onlyShape.empty() && onlyShape != shape.name)
+            continue;
+        std::string source = GenerateProgram(shape, scale);
+        if (!dumpDir.empty())
+            std::ofstream{fmt::format("{}/{}.trash", dumpDir, shape.name)} << source;
+
+        Measurement measurement = Measure(source, numRuns);
+        Json& shapeResults = results.Set(shape.name, Json::Object());
+        for (size_t phase = 0; phase < PHASES.size(); ++phase) {
+            double seconds = measurement.seconds[phase];
+            double linesPerSecond = static_cast<double>(measurement.numLines) / seconds;
+            fmt::print("{:<9} {:<9} {:>10.2f} {:>14.0f} {:>14.0f}", shape.name, PHASES[phase], seconds * 1e3,
+                linesPerSecond, static_cast<double>(measurement.numTokens) / seconds);
+            shapeResults.Set(PHASES[phase], linesPerSecond);
+
+            double expected = baseline ? (*baseline)[shape.name][PHASES[phase]].AsNumber() : 0;
+            if (expected > 0) {
+                double change = (linesPerSecond / expected - 1) * 100;
+                bool isRegression = change < -tolerance;
+                isRegressed = isRegressed || isRegression;
+                fmt::print(" {:>+7.1f}%{}", change, isRegression ? " REGRESSION" : "");
+            }
+            fmt::print("\n");
+        }
+    }
+
+    if (!saveFn.empty()) {
+        std::ofstream file{saveFn};
+        file << results.Dump() << '\n';
+        if (!file) {
+            fmt::print(stderr, "Error: Could not write results to \"{}\".\n", saveFn);
+            return 1;
+        }
+    }
+    return isRegressed ? 1 : 0;
+}
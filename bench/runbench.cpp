@@ -0,0 +1,294 @@
+// Runtime benchmark: runs each kernel through the interpreter and as native code (NASM), checks both print the same
+// and reports their times, instructions retired and the speedup as JSON
+// Run with make runbench, see PrintUsage for options
+
+#include "../src/compileerror.hpp"
+#include "../src/parser.hpp"
+#include "../src/analyzer.hpp"
+#include "../src/interpreter.hpp"
+#include "../src/generator.hpp"
+#include "../src/arena.hpp"
+#include "../src/json.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <fmt/core.h>
+#include <fmt/os.h>
+
+namespace fs = std::filesystem;
+
+// Calls entry, which kernels declare public, the emitted code has no entry point of its own.
+// Exits right away, the emitted code doesn't keep callee saved registers for main.
+static constexpr const char* NATIVE_DRIVER =
+    "#include <stdlib.h>\n"
+    "extern long entry(void);\n"
+    "int main(void) { entry(); exit(0); }\n";
+
+struct Run {
+    double seconds;
+    std::optional<uint64_t> instructions; // Nothing if perf events are unavailable
+};
+
+static std::string ReadFile(const fs::path& path) {
+    std::ifstream file{path, std::ios::binary};
+    std::stringstream text;
+    text << file.rdbuf();
+    return text.str();
+}
+
+// Counts the user space instructions of a process (0 is this one), -1 if perf events are unavailable
+static int OpenInstructionCounter(pid_t pid, bool enableOnExec) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.enable_on_exec = enableOnExec;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0));
+}
+
+static std::optional<uint64_t> CloseInstructionCounter(int fd) {
+    if (fd < 0)
+        return std::nullopt;
+    uint64_t count;
+    bool isRead = read(fd, &count, sizeof(count)) == sizeof(count);
+    close(fd);
+    return isRead ? std::optional{count} : std::nullopt;
+}
+
+static double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The interpreter prints to stdout, which points at outFn for the run
+static Run Interpret(const std::vector<Procedure>& procedures, const fs::path& outFn) {
+    fflush(stdout);
+    int savedStdout = dup(STDOUT_FILENO);
+    int outFd = open(outFn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    dup2(outFd, STDOUT_FILENO);
+    close(outFd);
+
+    int counter = OpenInstructionCounter(0, false);
+    if (counter >= 0)
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    auto start = std::chrono::steady_clock::now();
+    InterpretInstructions(procedures);
+    fflush(stdout);
+    double seconds = SecondsSince(start);
+    if (counter >= 0)
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+    return { seconds, CloseInstructionCounter(counter) };
+}
+
+// Nothing if the program could not be started or failed
+static std::optional<Run> RunNative(const fs::path& binFn, const fs::path& outFn) {
+    // The child waits until the counter is attached, the counter starts with exec
+    int ready[2];
+    if (pipe(ready) != 0)
+        return std::nullopt;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(ready[1]);
+        char go;
+        if (read(ready[0], &go, 1) != 1)
+            _exit(127);
+        int outFd = open(outFn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(outFd, STDOUT_FILENO);
+        execl(binFn.c_str(), binFn.c_str(), nullptr);
+        _exit(127);
+    }
+    close(ready[0]);
+    if (pid < 0) {
+        close(ready[1]);
+        return std::nullopt;
+    }
+
+    int counter = OpenInstructionCounter(pid, true);
+    auto start = std::chrono::steady_clock::now();
+    bool isStarted = write(ready[1], "x", 1) == 1;
+    close(ready[1]);
+    int status;
+    waitpid(pid, &status, 0);
+    double seconds = SecondsSince(start);
+    std::optional<uint64_t> instructions = CloseInstructionCounter(counter);
+    if (!isStarted || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return std::nullopt;
+    return Run{ seconds, instructions };
+}
+
+static Json ToJson(const std::optional<Run>& run) {
+    if (!run)
+        return nullptr;
+    Json json = Json::Object();
+    json.Set("seconds", run->seconds);
+    json.Set("instructions", run->instructions ? Json{*run->instructions} : Json{nullptr});
+    return json;
+}
+
+static void KeepFaster(std::optional<Run>& best, const std::optional<Run>& run) {
+    if (run && (!best || run->seconds < best->seconds))
+        best = run;
+}
+
+static void PrintUsage() {
+    fmt::print(stderr,
+        "Usage: runbench [options] [kernels]\n"
+        "Kernels are .trash files, or directories of them (defaults to bench/kernels).\n"
+        "Each must start with \"proc public entry() -> i64\", the interpreter starts there and native code calls it.\n"
+        "-runs <n>        Runs each kernel this many times on each backend and keeps the fastest (defaults to 3).\n"
+        "-work <dir>      Where the assembly, binaries and outputs go (defaults to a temporary directory).\n"
+        "-o <file>        Writes the report to the file instead of stdout.\n"
+        "-h               Displays this information\n"
+    );
+}
+
+int main(int argc, char** argv) {
+    size_t numRuns = 3;
+    fs::path workDir = fs::temp_directory_path() / "trash-runbench";
+    std::string reportFn;
+    std::vector<fs::path> kernels;
+
+    std::vector<std::string> args(argv + 1, argv + argc);
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        if (arg == "-h") {
+            PrintUsage();
+            return 0;
+        }
+        if (arg == "-runs" || arg == "-work" || arg == "-o") {
+            if (i + 1 == args.size()) {
+                PrintUsage();
+                return 1;
+            }
+            const std::string& value = args[++i];
+            if (arg == "-runs") {
+                auto [ptr, err] = std::from_chars(value.data(), value.data() + value.size(), numRuns);
+                if (err != std::errc{} || ptr != value.data() + value.size() || numRuns == 0) {
+                    PrintUsage();
+                    return 1;
+                }
+            }
+            else if (arg == "-work") workDir = value;
+            else reportFn = value;
+        }
+        else if (fs::is_directory(arg)) {
+            std::vector<fs::path> found;
+            for (const auto& entry : fs::directory_iterator{arg}) {
+                if (entry.path().extension() == ".trash")
+                    found.push_back(entry.path());
+            }
+            std::ranges::sort(found);
+            kernels.insert(kernels.end(), found.begin(), found.end());
+        }
+        else {
+            kernels.emplace_back(arg);
+        }
+    }
+    if (kernels.empty()) {
+        for (const auto& entry : fs::directory_iterator{"bench/kernels"})
+            kernels.push_back(entry.path());
+        std::ranges::sort(kernels);
+    }
+    fs::create_directories(workDir);
+
+    bool canAssemble = std::system("command -v nasm >/dev/null 2>&1") == 0;
+    if (!canAssemble)
+        fmt::print(stderr, "nasm was not found, native code is not run\n");
+    fs::path driverFn = workDir / "driver.c";
+    std::ofstream{driverFn} << NATIVE_DRIVER;
+
+    Json report = Json::Array();
+    bool isFailed = false;
+    fmt::print(stderr, "{:<12} {:>12} {:>12} {:>9}  {}\n", "kernel", "interpret s", "native s", "speedup", "output");
+    for (const fs::path& kernel : kernels) {
+        std::string name = kernel.stem().string();
+        std::string source = ReadFile(kernel);
+        std::string filename = kernel.string();
+
+        // A compile error exits, like trashc does
+        Arena arena{source.size() * 64};
+        ArenaScope arenaScope{&arena};
+        std::vector<File> files{ File{.filename=filename, .source=source, .lineStarts={}} };
+        TokenList tokens;
+        AST ast = ParseEntireSource(files, tokens);
+        std::vector<Procedure> procedures = VerifyAST(tokens, ast, false, nullptr, {});
+
+        fs::path interpretedOutFn = workDir / (name + ".interpreted.txt");
+        std::optional<Run> interpreted;
+        for (size_t run = 0; run < numRuns; ++run)
+            KeepFaster(interpreted, Interpret(procedures, interpretedOutFn));
+
+        std::optional<Run> native;
+        bool isBuilt = false;
+        fs::path nativeOutFn = workDir / (name + ".native.txt");
+        if (canAssemble) {
+            fs::path asmFn = workDir / (name + ".asm");
+            fs::path objFn = workDir / (name + ".o");
+            fs::path binFn = workDir / name;
+            {
+                fmt::ostream asmFile = fmt::output_file(asmFn.string());
+                EmitInstructions(asmFile, Target::X86_64_ELF, procedures);
+            }
+            std::string build = fmt::format("nasm -f elf64 '{}' -o '{}' && cc -no-pie '{}' '{}' -o '{}'",
+                asmFn.string(), objFn.string(), driverFn.string(), objFn.string(), binFn.string());
+            isBuilt = std::system(build.c_str()) == 0;
+            for (size_t run = 0; isBuilt && run < numRuns; ++run)
+                KeepFaster(native, RunNative(binFn, nativeOutFn));
+        }
+
+        Json result = Json::Object();
+        result.Set("kernel", name);
+        result.Set("interpreter", ToJson(interpreted));
+        result.Set("native", ToJson(native));
+        std::string verdict = "not compared";
+        if (native) {
+            bool isSame = ReadFile(interpretedOutFn) == ReadFile(nativeOutFn);
+            result.Set("outputsMatch", isSame);
+            result.Set("speedup", interpreted->seconds / native->seconds);
+            verdict = isSame ? "same" : "DIFFERENT";
+            isFailed = isFailed || !isSame;
+        }
+        else if (canAssemble) {
+            verdict = isBuilt ? "NATIVE FAILED" : "BUILD FAILED";
+            isFailed = true;
+        }
+        report.Push(std::move(result));
+
+        fmt::print(stderr, "{:<12} {:>12.3f} {:>12} {:>9}  {}\n", name, interpreted->seconds,
+            native ? fmt::format("{:.3f}", native->seconds) : "-",
+            native ? fmt::format("{:.1f}x", interpreted->seconds / native->seconds) : "-", verdict);
+    }
+
+    if (reportFn.empty()) {
+        fmt::print("{}\n", report.Dump());
+    }
+    else {
+        std::ofstream file{reportFn};
+        file << report.Dump() << '\n';
+        if (!file) {
+            fmt::print(stderr, "Error: Could not write report to \"{}\".\n", reportFn);
+            return 1;
+        }
+    }
+    return isFailed ? 1 : 0;
+}
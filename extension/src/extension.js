@@ -0,0 +1,19 @@
+const vscode = require('vscode');
+const { LanguageClient } = require('vscode-languageclient/node');
+
+let client;
+
+function activate(context) {
+	const command = vscode.workspace.getConfiguration('trash').get('serverPath');
+	const server = { command, args: ['-lsp'] };
+	client = new LanguageClient('trash', 'Trash', { run: server, debug: server }, {
+		documentSelector: [{ scheme: 'file', language: 'trash' }],
+	});
+	client.start();
+}
+
+function deactivate() {
+	return client ? client.stop() : undefined;
+}
+
+module.exports = { activate, deactivate };
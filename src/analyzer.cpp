@@ -1,25 +1,136 @@
 #include "analyzer.hpp"
 #include "compileerror.hpp"
 #include "parser.hpp"
+#include "parallel.hpp"
+#include "cache.hpp"
+#include "timereport.hpp"
 
 #include <cassert>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <type_traits>
 
 void Analyzer::AddInstruction(Instruction ins) {
     if (keepGenerating)
         instructions.push_back(ins);
 }
 
-void Analyzer::AssertIdentUnusedInCurrentScope(const std::unordered_map<std::string_view, ASTIndex>& symbolTable, const Token& ident) {
-    if (procedureDefns.contains(ident.text)) {
+// Constant folding: an expression is emitted in post order and only a constant one ends in a literal push,
+// so an operator whose operands are the trailing pushes is evaluated now and replaced by its value.
+// Values are computed the way the interpreter computes them at run time,
+// anything that would fault (division by zero) or is not defined is left to run time.
+
+static Instruction::Literal MakeLiteral(TypeKind kind, uint64_t bits) {
+    Instruction::Literal lit{.kind=kind, .i64=0};
+    if (kind == TypeKind::U8)
+        lit.u8 = static_cast<uint8_t>(bits);
+    else
+        lit.i64 = bits;
+    return lit;
+}
+
+static Instruction::Literal MakeLiteral(int64_t value) { return MakeLiteral(TypeKind::I64, static_cast<uint64_t>(value)); }
+static Instruction::Literal MakeLiteral(uint8_t value) { return MakeLiteral(TypeKind::U8, value); }
+static Instruction::Literal MakeLiteral(bool value) { return MakeLiteral(TypeKind::U8, value); }
+static Instruction::Literal MakeLiteral(double value) { return {.kind=TypeKind::F64, .f64=value}; }
+
+template<typename T>
+static T LiteralValue(const Instruction::Literal& lit) {
+    if constexpr (std::is_same_v<T, double>) return lit.f64;
+    else if constexpr (std::is_same_v<T, uint8_t>) return lit.u8;
+    else return static_cast<int64_t>(lit.i64);
+}
+
+template<typename T>
+static std::optional<Instruction::Literal> FoldUnaryOp(ASTKind op, T x) {
+    if (op == ASTKind::NOT_UNARYOP_EXPR) {
+        if constexpr (std::is_same_v<T, double>) return std::nullopt;
+        else return MakeLiteral(static_cast<T>(!x));
+    }
+    if constexpr (std::is_same_v<T, int64_t>) return MakeLiteral(static_cast<int64_t>(0 - static_cast<uint64_t>(x)));
+    else return MakeLiteral(static_cast<T>(-x));
+}
+
+template<typename T>
+static std::optional<Instruction::Literal> FoldBinaryOp(ASTKind op, T y, T x) {
+    switch (op) {
+        case ASTKind::EQ_BINARYOP_EXPR: return MakeLiteral(y == x);
+        case ASTKind::NE_BINARYOP_EXPR: return MakeLiteral(y != x);
+        case ASTKind::GE_BINARYOP_EXPR: return MakeLiteral(y >= x);
+        case ASTKind::GT_BINARYOP_EXPR: return MakeLiteral(y > x);
+        case ASTKind::LE_BINARYOP_EXPR: return MakeLiteral(y <= x);
+        case ASTKind::LT_BINARYOP_EXPR: return MakeLiteral(y < x);
+        case ASTKind::AND_BINARYOP_EXPR: return MakeLiteral(y && x);
+        case ASTKind::OR_BINARYOP_EXPR: return MakeLiteral(y || x);
+        default: break;
+    }
+    if constexpr (std::is_same_v<T, double>) {
+        if (op == ASTKind::ADD_BINARYOP_EXPR) return MakeLiteral(y + x);
+        if (op == ASTKind::SUB_BINARYOP_EXPR) return MakeLiteral(y - x);
+        if (op == ASTKind::MUL_BINARYOP_EXPR) return MakeLiteral(y * x);
+        if (op == ASTKind::DIV_BINARYOP_EXPR) return MakeLiteral(y / x);
+        return std::nullopt;
+    }
+    else {
+        // Integers wrap around, like they do in both backends
+        using Unsigned = std::make_unsigned_t<T>;
+        auto Wrap = [](auto value) { return static_cast<T>(static_cast<Unsigned>(value)); };
+        if (op == ASTKind::ADD_BINARYOP_EXPR) return MakeLiteral(Wrap(static_cast<Unsigned>(y) + static_cast<Unsigned>(x)));
+        if (op == ASTKind::SUB_BINARYOP_EXPR) return MakeLiteral(Wrap(static_cast<Unsigned>(y) - static_cast<Unsigned>(x)));
+        if (op == ASTKind::MUL_BINARYOP_EXPR) return MakeLiteral(Wrap(static_cast<Unsigned>(y) * static_cast<Unsigned>(x)));
+        if (x == 0 || (std::is_signed_v<T> && y == std::numeric_limits<T>::min() && x == static_cast<T>(-1)))
+            return std::nullopt;
+        if (op == ASTKind::DIV_BINARYOP_EXPR) return MakeLiteral(static_cast<T>(y / x));
+        if (op == ASTKind::MOD_BINARYOP_EXPR) return MakeLiteral(static_cast<T>(y % x));
+        return std::nullopt;
+    }
+}
+
+// Only builtins without side effects
+static std::optional<Instruction::Literal> FoldBuiltinCall(size_t address, const Instruction::Literal& arg) {
+    if (address == BUILTIN_sqrt) return MakeLiteral(std::sqrt(arg.f64));
+    if (address == BUILTIN_itof) return MakeLiteral(static_cast<double>(LiteralValue<int64_t>(arg)));
+    if (address == BUILTIN_itoc) return MakeLiteral(static_cast<uint8_t>(arg.i64 & 0xFF));
+    if (address == BUILTIN_ctoi) return MakeLiteral(static_cast<int64_t>(arg.u8));
+    if (address == BUILTIN_ftoi) {
+        // Out of range conversions are undefined
+        if (!(arg.f64 >= -0x1p63 && arg.f64 < 0x1p63))
+            return std::nullopt;
+        return MakeLiteral(static_cast<int64_t>(arg.f64));
+    }
+    return std::nullopt;
+}
+
+// The value pushed by the instruction fromEnd before the last one, if it's a number
+std::optional<Instruction::Literal> Analyzer::TrailingConstant(size_t fromEnd) const {
+    if (!keepGenerating || instructions.size() <= fromEnd)
+        return std::nullopt;
+    const Instruction& ins = instructions[instructions.size() - 1 - fromEnd];
+    if (ins.opcode != Instruction::Opcode::PUSH || ins.lit.kind == TypeKind::STR)
+        return std::nullopt;
+    return ins.lit;
+}
+
+void Analyzer::ReplaceTrailingInstructions(size_t count, Instruction::Literal value) {
+    instructions.resize(instructions.size() - count);
+    AddInstruction(Instruction{.opcode=Instruction::Opcode::PUSH, .lit=value});
+}
+
+void Analyzer::AssertIdentUnusedInCurrentScope(TokenIndex identIdx) {
+    const Token& ident = tokens[identIdx];
+    SymbolId id = tokens.Symbol(identIdx);
+    if (procedureDefns[id].isDefined) {
         // Variable name same as procedure name, not allowed
         CompileErrorAt(ident, "Local variable '{}' shadows procedure", ident.text);
     }
-    else if (symbolTable.contains(ident.text)) {
+    else if (symbols.Lookup(id) != nullptr) {
         CompileErrorAt(ident, "Redefinition of variable '{}'", ident.text);
     }
 }
 
-void Analyzer::VerifyDefinition(ASTIndex defnIdx, std::unordered_map<std::string_view, ASTIndex>& symbolTable) {
+void Analyzer::VerifyDefinition(ASTIndex defnIdx) {
     const ASTNode& stmt = ast.tree[defnIdx];
     const ASTNode::ASTDefinition& defn = stmt.defn;
     const Token& token = tokens[stmt.tokenIdx];
@@ -28,7 +139,8 @@ void Analyzer::VerifyDefinition(ASTIndex defnIdx, std::unordered_map<std::string
 
     bool hasInitExpr = defn.initExpr != AST_NULL;
     bool isScalar = defn.arraySize == AST_NULL;
-    size_t offset = symbolTable.size();
+    size_t offset = symbols.NumVisible();
+    std::optional<Instruction::Literal> constant;
 
     if (!isScalar) {
         bool oldKeepGenerating = keepGenerating;
@@ -36,7 +148,7 @@ void Analyzer::VerifyDefinition(ASTIndex defnIdx, std::unordered_map<std::string
             // Don't allocate on stack if the array is initialied (elsewhere)
             keepGenerating = false;
         }
-        Type arrSize = VerifyExpression(defn.arraySize, symbolTable);
+        Type arrSize = VerifyExpression(defn.arraySize);
         assert(arrSize.isScalar);
         if (arrSize.kind != TypeKind::I64) {
             CompileErrorAt(asgnToken, "Size of array '{}' has non-integer type (got {})",
@@ -45,52 +157,60 @@ void Analyzer::VerifyDefinition(ASTIndex defnIdx, std::unordered_map<std::string
 
         if (!hasInitExpr) {
             // Scale by the width of the array type (replace with a left shift when implemented)
-            if (defn.type == TypeKind::I64 || defn.type == TypeKind::F64) {
+            if (stmt.type == TypeKind::I64 || stmt.type == TypeKind::F64) {
                 AddInstruction(Instruction{.opcode=Instruction::Opcode::PUSH, .lit={.kind=TypeKind::I64,.i64=8}});
                 AddInstruction(Instruction{.opcode=Instruction::Opcode::BINARY_OP, .op={.kind=TypeKind::I64,.op_kind=ASTKind::MUL_BINARYOP_EXPR}});
             }
 
             AddInstruction(Instruction{.opcode=Instruction::Opcode::ALLOCA, .access={.varAddr=offset}});
+            // Allocating moves the stack pointer until the procedure returns
+            isInlinable = isInlinable && !keepGenerating;
         }
         keepGenerating = oldKeepGenerating;
     }
 
     if (hasInitExpr) {
-        Type rhsType = VerifyExpression(defn.initExpr, symbolTable);
-        if (defn.type != rhsType.kind) {
+        Type rhsType = VerifyExpression(defn.initExpr);
+        if (stmt.type != rhsType.kind) {
             CompileErrorAt(asgnToken, "Incompatible types when initializing '{}' to type {}{} (expected {}{})",
                            ident,
                            TypeKindName(rhsType.kind),
                            rhsType.isScalar ? "" : "[]",
-                           TypeKindName(defn.type),
+                           TypeKindName(stmt.type),
                            isScalar ? "" : "[]");
         }
         size_t typeWidth = !isScalar ? 8 :
-            defn.type == TypeKind::U8 ? 1 : 8;
+            stmt.type == TypeKind::U8 ? 1 : 8;
+        // A constant let is substituted wherever it's loaded. It's still stored, inline asm may read its slot,
+        // the store goes with the other dead stores otherwise (see DeadCodeEliminator).
+        if (stmt.flags.isConst && isScalar)
+            constant = TrailingConstant(0);
         AddInstruction(Instruction{.opcode=Instruction::Opcode::STORE_FAST, .access={.varAddr=offset,.accessSize=typeWidth}});
     }
 
 
-    AssertIdentUnusedInCurrentScope(symbolTable, token);
+    AssertIdentUnusedInCurrentScope(stmt.tokenIdx);
 
-    stackAddrs.back()[ident] = offset;
-    symbolTable[ident] = defnIdx;
+    symbols.Bind(tokens.Symbol(stmt.tokenIdx), { .defn = defnIdx, .stackAddr = offset,
+        .isConstant = constant.has_value(), .value = constant.value_or(Instruction::Literal{}) });
 
     if (maxNumVariables < offset + 1)
         maxNumVariables = offset + 1;
 }
 
-Type Analyzer::VerifyLValue(ASTIndex lvalIdx, std::unordered_map<std::string_view, ASTIndex>& symbolTable, bool isLoading) {
+Type Analyzer::VerifyLValue(ASTIndex lvalIdx, bool isLoading) {
     const ASTNode& expr = ast.tree[lvalIdx];
     const Token& token = tokens[expr.tokenIdx];
 
-    if (!symbolTable.contains(token.text)) {
+    const ScopedSymbolTable::Binding* binding = symbols.Lookup(tokens.Symbol(expr.tokenIdx));
+    if (binding == nullptr) {
         CompileErrorAt(token, "Use of undefined identifier '{}'", token.text);
     }
-    const ASTNode::ASTDefinition& defn = ast.tree[symbolTable[token.text]].defn;
+    const ASTNode& defnNode = ast.tree[binding->defn];
+    const ASTNode::ASTDefinition& defn = defnNode.defn;
     bool isScalar = defn.arraySize == AST_NULL;
     bool hasSubscript = expr.lvalue.subscript != AST_NULL;
-    size_t typeWidth = defn.type == TypeKind::U8 ? 1 : 8;
+    size_t typeWidth = defnNode.type == TypeKind::U8 ? 1 : 8;
 
     // FIXME: Non-scalar expressions are entirely disallowed
     // Maybe change this when strings need to work correctly
@@ -99,27 +219,30 @@ Type Analyzer::VerifyLValue(ASTIndex lvalIdx, std::unordered_map<std::string_vie
             CompileErrorAt(token, "Cannot subscript scalar variable '{}'", token.text);
         }
 
-        if (isLoading) {
-            AddInstruction(Instruction{.opcode=Instruction::Opcode::LOAD_FAST, .access={.varAddr=stackAddrs.back().at(token.text),.accessSize=typeWidth}});
+        if (isLoading && binding->isConstant) {
+            AddInstruction(Instruction{.opcode=Instruction::Opcode::PUSH, .lit=binding->value});
+        }
+        else if (isLoading) {
+            AddInstruction(Instruction{.opcode=Instruction::Opcode::LOAD_FAST, .access={.varAddr=binding->stackAddr,.accessSize=typeWidth}});
         }
         else {
-            AddInstruction(Instruction{.opcode=Instruction::Opcode::STORE_FAST, .access={.varAddr=stackAddrs.back().at(token.text),.accessSize=typeWidth}});
+            AddInstruction(Instruction{.opcode=Instruction::Opcode::STORE_FAST, .access={.varAddr=binding->stackAddr,.accessSize=typeWidth}});
         }
     }
     else {
         if (!hasSubscript) {
             if (isLoading) {
-                AddInstruction(Instruction{.opcode=Instruction::Opcode::LOAD_FAST, .access={.varAddr=stackAddrs.back().at(token.text),.accessSize=8}});
+                AddInstruction(Instruction{.opcode=Instruction::Opcode::LOAD_FAST, .access={.varAddr=binding->stackAddr,.accessSize=8}});
             }
             else {
-                AddInstruction(Instruction{.opcode=Instruction::Opcode::STORE_FAST, .access={.varAddr=stackAddrs.back().at(token.text),.accessSize=8}});
+                AddInstruction(Instruction{.opcode=Instruction::Opcode::STORE_FAST, .access={.varAddr=binding->stackAddr,.accessSize=8}});
             }
         }
         else {
             // Push (i * w + a) where a is the array (pointer) and i is the subscript
-            AddInstruction(Instruction{.opcode=Instruction::Opcode::LOAD_FAST, .access={.varAddr=stackAddrs.back().at(token.text),.accessSize=8}});
+            AddInstruction(Instruction{.opcode=Instruction::Opcode::LOAD_FAST, .access={.varAddr=binding->stackAddr,.accessSize=8}});
 
-            Type subType = VerifyExpression(expr.lvalue.subscript, symbolTable);
+            Type subType = VerifyExpression(expr.lvalue.subscript);
             if (!subType.isScalar || subType.kind != TypeKind::I64) {
                 CompileErrorAt(tokens[ast.tree[expr.lvalue.subscript].tokenIdx],
                     "Cannot subscript with non-scalar integral variable '{}'",
@@ -127,7 +250,7 @@ Type Analyzer::VerifyLValue(ASTIndex lvalIdx, std::unordered_map<std::string_vie
             }
 
             // Scale by the width of the array type (replace with a left shift when implemented)
-            if (defn.type == TypeKind::I64 || defn.type == TypeKind::F64) {
+            if (defnNode.type == TypeKind::I64 || defnNode.type == TypeKind::F64) {
                 AddInstruction(Instruction{.opcode=Instruction::Opcode::PUSH, .lit={.kind=TypeKind::I64,.i64=8}});
                 AddInstruction(Instruction{.opcode=Instruction::Opcode::BINARY_OP, .op={.kind=TypeKind::I64,.op_kind=ASTKind::MUL_BINARYOP_EXPR}});
             }
@@ -143,7 +266,7 @@ Type Analyzer::VerifyLValue(ASTIndex lvalIdx, std::unordered_map<std::string_vie
         }
     }
 
-    return { defn.type, isScalar || hasSubscript };
+    return { defnNode.type, isScalar || hasSubscript };
 }
 
 
@@ -168,10 +291,10 @@ Type Analyzer::VerifyLValue(ASTIndex lvalIdx, std::unordered_map<std::string_vie
 //                  ; [] ... z            jmp TOP
 
 
-Type Analyzer::VerifyCall(ASTIndex callIdx, std::unordered_map<std::string_view, ASTIndex>& symbolTable) {
+Type Analyzer::VerifyCall(ASTIndex callIdx) {
     const Token& callTok = tokens[ast.tree[callIdx].tokenIdx];
     const ASTNode::ASTCall& call = ast.tree[callIdx].call;
-    const auto& args = ast.lists[call.args];
+    std::span<const ASTIndex> args = ast.GetList(call.args);
     size_t numArgs = args.size();
 
 
@@ -179,11 +302,12 @@ Type Analyzer::VerifyCall(ASTIndex callIdx, std::unordered_map<std::string_view,
     size_t saveAddrIdx = instructions.size();
     AddInstruction(Instruction{.opcode=Instruction::Opcode::SAVE});
 
-    if (!procedureDefns.contains(callTok.text)) {
+    SymbolId callee = tokens.Symbol(ast.tree[callIdx].tokenIdx);
+    const ProcedureDefn& defn = procedureDefns[callee];
+    if (!defn.isDefined) {
         CompileErrorAt(callTok, "Call to undefined procedure '{}'", callTok.text);
     }
 
-    const ProcedureDefn& defn = procedureDefns.at(callTok.text);
     size_t numParams = defn.paramTypes.size();
     if (numArgs != numParams) {
         if (numParams == 1) {
@@ -195,9 +319,9 @@ Type Analyzer::VerifyCall(ASTIndex callIdx, std::unordered_map<std::string_view,
     }
 
     for (size_t argIdx{}; argIdx < numArgs; ++argIdx) {
-        const ASTNode::ASTDefinition& param = ast.tree[defn.paramTypes[argIdx]].defn;
-        Type argType = VerifyExpression(args[argIdx], symbolTable);
-        bool isScalar = param.arraySize == AST_NULL;
+        const ASTNode& param = ast.tree[defn.paramTypes[argIdx]];
+        Type argType = VerifyExpression(args[argIdx]);
+        bool isScalar = param.defn.arraySize == AST_NULL;
         if (param.type != argType.kind || isScalar != argType.isScalar) {
             const Token& argTok = tokens[ast.tree[args[argIdx]].tokenIdx];
             CompileErrorAt(argTok, "Incompatible type {}{} for argument {} of '{}' (expected {}{})",
@@ -212,9 +336,24 @@ Type Analyzer::VerifyCall(ASTIndex callIdx, std::unordered_map<std::string_view,
         // TODO: For types that are passed by reference (for now, only arrays), check constness
     }
 
-    // Defer resolving this address until all procedures have been generated
-    unresolvedCalls.emplace_back(instructions.size(), callTok.text);
-    AddInstruction(Instruction{.opcode=Instruction::Opcode::JMP});
+    // A pure builtin of a constant is evaluated now, so there is no call (and no frame) at all
+    if (numArgs == 1 && IS_BUILTIN(defn.instructionNum) && instructions.size() == saveAddrIdx + 2) {
+        if (std::optional<Instruction::Literal> arg = TrailingConstant(0)) {
+            if (std::optional<Instruction::Literal> result = FoldBuiltinCall(defn.instructionNum, *arg)) {
+                ReplaceTrailingInstructions(2, *result);
+                return defn.returnType;
+            }
+        }
+    }
+
+    if (defn.isImported) {
+        AddInstruction(Instruction{.opcode=Instruction::Opcode::CALL_IMPORTED, .str={callTok.text.data(), callTok.text.size()}});
+    }
+    else {
+        // Defer resolving this address until all procedures have been generated
+        unresolvedCalls.emplace_back(instructions.size(), callee);
+        AddInstruction(Instruction{.opcode=Instruction::Opcode::JMP});
+    }
 
     // Set the return address to be the next instruction
     instructions[saveAddrIdx].jmpAddr = instructions.size();
@@ -222,12 +361,19 @@ Type Analyzer::VerifyCall(ASTIndex callIdx, std::unordered_map<std::string_view,
     return defn.returnType;
 }
 
-Type Analyzer::VerifyExpression(ASTIndex exprIdx, std::unordered_map<std::string_view, ASTIndex>& symbolTable) {
-    assert(exprIdx != AST_NULL);
+static bool IsUnaryOp(ASTKind kind) {
+    return kind == ASTKind::NEG_UNARYOP_EXPR || kind == ASTKind::NOT_UNARYOP_EXPR;
+}
+
+static bool IsBinaryOp(ASTKind kind) {
+    return kind >= ASTKind::EQ_BINARYOP_EXPR && kind <= ASTKind::MOD_BINARYOP_EXPR;
+}
+
+Type Analyzer::VerifyOperand(ASTIndex exprIdx) {
     const ASTNode& expr = ast.tree[exprIdx];
     switch (expr.kind) {
         case ASTKind::LVALUE_EXPR:
-            return VerifyLValue(exprIdx, symbolTable, true);
+            return VerifyLValue(exprIdx, true);
         case ASTKind::INTEGER_LITERAL_EXPR:
             AddInstruction(Instruction{.opcode=Instruction::Opcode::PUSH, .lit={.kind=TypeKind::I64,.i64=expr.literal.i64}});
             return { TypeKind::I64, true };
@@ -238,38 +384,52 @@ Type Analyzer::VerifyExpression(ASTIndex exprIdx, std::unordered_map<std::string
             AddInstruction(Instruction{.opcode=Instruction::Opcode::PUSH, .lit={.kind=TypeKind::U8,.u8=expr.literal.u8}});
             return { TypeKind::U8, true };
         case ASTKind::STRING_LITERAL_EXPR:
-            AddInstruction(Instruction{.opcode=Instruction::Opcode::PUSH, .lit={.kind=TypeKind::STR,.str=expr.literal.str}});
+            AddInstruction(Instruction{.opcode=Instruction::Opcode::PUSH, .lit={.kind=TypeKind::STR,.str=ast.strings[expr.literal.str]}});
             return { TypeKind::STR, true }; // TODO: Assign string literal to u8[]
         case ASTKind::CALL_EXPR: {
-            return VerifyCall(exprIdx, symbolTable);
+            return VerifyCall(exprIdx);
         }
         default: break;
     }
 
-    // Otherwise, expect a binary or unary operator
+    assert(0 && "Unreachable");
+    return { TypeKind::NONE, 0 };
+}
+
+Type Analyzer::VerifyUnaryOp(ASTIndex exprIdx, Type exprType) {
+    const ASTNode& expr = ast.tree[exprIdx];
     const Token& token = tokens[expr.tokenIdx];
-    if (expr.kind == ASTKind::NEG_UNARYOP_EXPR ||
-        expr.kind == ASTKind::NOT_UNARYOP_EXPR)
-    {
-        Type exprType = VerifyExpression(expr.unaryOp.expr, symbolTable);
-        if (!exprType.isScalar) {
-            CompileErrorAt(token, "Could not apply unary operator to non-scalar type");
-        }
-        if (expr.kind == ASTKind::NEG_UNARYOP_EXPR) {
-            if (!(exprType.kind == TypeKind::I64 || exprType.kind == TypeKind::U8 || exprType.kind == TypeKind::F64)) {
-                CompileErrorAt(token, "Cannot negate non-numeric type {}", TypeKindName(exprType.kind));
-            }
+    if (!exprType.isScalar) {
+        CompileErrorAt(token, "Could not apply unary operator to non-scalar type");
+    }
+    if (expr.kind == ASTKind::NEG_UNARYOP_EXPR) {
+        if (!(exprType.kind == TypeKind::I64 || exprType.kind == TypeKind::U8 || exprType.kind == TypeKind::F64)) {
+            CompileErrorAt(token, "Cannot negate non-numeric type {}", TypeKindName(exprType.kind));
         }
-        else {
-            if (!(exprType.kind == TypeKind::I64 || exprType.kind == TypeKind::U8)) {
-                CompileErrorAt(token, "Cannot complement of non-integral type {}", TypeKindName(exprType.kind));
-            }
+    }
+    else {
+        if (!(exprType.kind == TypeKind::I64 || exprType.kind == TypeKind::U8)) {
+            CompileErrorAt(token, "Cannot complement of non-integral type {}", TypeKindName(exprType.kind));
         }
+    }
 
-        AddInstruction(Instruction{.opcode=Instruction::Opcode::UNARY_OP, .op={.kind=exprType.kind,.op_kind=expr.kind}});
-        return exprType;
+    if (std::optional<Instruction::Literal> x = TrailingConstant(0)) {
+        std::optional<Instruction::Literal> result =
+            exprType.kind == TypeKind::I64 ? FoldUnaryOp(expr.kind, LiteralValue<int64_t>(*x)) :
+            exprType.kind == TypeKind::F64 ? FoldUnaryOp(expr.kind, LiteralValue<double>(*x)) :
+            FoldUnaryOp(expr.kind, LiteralValue<uint8_t>(*x));
+        if (result) {
+            ReplaceTrailingInstructions(1, *result);
+            return exprType;
+        }
     }
+    AddInstruction(Instruction{.opcode=Instruction::Opcode::UNARY_OP, .op={.kind=exprType.kind,.op_kind=expr.kind}});
+    return exprType;
+}
 
+Type Analyzer::VerifyBinaryOp(ASTIndex exprIdx, Type lhsExprType, Type rhsExprType) {
+    const ASTNode& expr = ast.tree[exprIdx];
+    const Token& token = tokens[expr.tokenIdx];
     bool isLogical =
         expr.kind == ASTKind::EQ_BINARYOP_EXPR ||
         expr.kind == ASTKind::NE_BINARYOP_EXPR || 
@@ -280,94 +440,141 @@ Type Analyzer::VerifyExpression(ASTIndex exprIdx, std::unordered_map<std::string
         expr.kind == ASTKind::AND_BINARYOP_EXPR || 
         expr.kind == ASTKind::OR_BINARYOP_EXPR;
 
-    bool isArithmetic =
-        expr.kind == ASTKind::ADD_BINARYOP_EXPR || 
-        expr.kind == ASTKind::SUB_BINARYOP_EXPR || 
-        expr.kind == ASTKind::MUL_BINARYOP_EXPR || 
-        expr.kind == ASTKind::DIV_BINARYOP_EXPR || 
-        expr.kind == ASTKind::MOD_BINARYOP_EXPR;
-
-    if (isLogical || isArithmetic) {
-        Type lhsExprType = VerifyExpression(expr.binaryOp.left, symbolTable);
-        Type rhsExprType = VerifyExpression(expr.binaryOp.right, symbolTable);
-        if (!lhsExprType.isScalar || !rhsExprType.isScalar) {
-            // assert(0 && "Unreachable");
-            CompileErrorAt(token, "Could not apply binary operator {} to non scalar type '{}[]'",
-                token.text,
-                TypeKindName(lhsExprType.isScalar ? rhsExprType.kind : lhsExprType.kind));
-        }
-        if (lhsExprType.kind != rhsExprType.kind) {
+    if (!lhsExprType.isScalar || !rhsExprType.isScalar) {
+        // assert(0 && "Unreachable");
+        CompileErrorAt(token, "Could not apply binary operator {} to non scalar type '{}[]'",
+            token.text,
+            TypeKindName(lhsExprType.isScalar ? rhsExprType.kind : lhsExprType.kind));
+    }
+    if (lhsExprType.kind != rhsExprType.kind) {
+        CompileErrorAt(token, "Invalid operands to binary operator ('{}' {} '{}')",
+            TypeKindName(lhsExprType.kind), token.text, TypeKindName(rhsExprType.kind));
+    }
+
+    if (isLogical) {
+        if (!(lhsExprType.kind == TypeKind::U8 || lhsExprType.kind == TypeKind::I64 || lhsExprType.kind == TypeKind::F64)) {
             CompileErrorAt(token, "Invalid operands to binary operator ('{}' {} '{}')",
                 TypeKindName(lhsExprType.kind), token.text, TypeKindName(rhsExprType.kind));
         }
+    }
 
-        if (isLogical) {
-            if (!(lhsExprType.kind == TypeKind::U8 || lhsExprType.kind == TypeKind::I64 || lhsExprType.kind == TypeKind::F64)) {
-                CompileErrorAt(token, "Invalid operands to binary operator ('{}' {} '{}')",
-                    TypeKindName(lhsExprType.kind), token.text, TypeKindName(rhsExprType.kind));
-            }
+    // Both operands are constant when the right one is, and the left one ends right before it
+    std::optional<Instruction::Literal> x = TrailingConstant(0);
+    std::optional<Instruction::Literal> y = x ? TrailingConstant(1) : std::nullopt;
+    if (y) {
+        std::optional<Instruction::Literal> result =
+            lhsExprType.kind == TypeKind::I64 ? FoldBinaryOp(expr.kind, LiteralValue<int64_t>(*y), LiteralValue<int64_t>(*x)) :
+            lhsExprType.kind == TypeKind::F64 ? FoldBinaryOp(expr.kind, LiteralValue<double>(*y), LiteralValue<double>(*x)) :
+            FoldBinaryOp(expr.kind, LiteralValue<uint8_t>(*y), LiteralValue<uint8_t>(*x));
+        if (result) {
+            ReplaceTrailingInstructions(2, *result);
+            return { isLogical ? TypeKind::U8 : lhsExprType.kind, true };
+        }
+    }
 
-            AddInstruction(Instruction{.opcode=Instruction::Opcode::BINARY_OP, .op={.kind=lhsExprType.kind,.op_kind=expr.kind}});
-            return { TypeKind::U8, true };
+    if (isLogical) {
+
+        AddInstruction(Instruction{.opcode=Instruction::Opcode::BINARY_OP, .op={.kind=lhsExprType.kind,.op_kind=expr.kind}});
+        return { TypeKind::U8, true };
+    }
+    else {
+        // TODO: Disallow invalid binary operations (ex. str + int)
+
+        AddInstruction(Instruction{.opcode=Instruction::Opcode::BINARY_OP, .op={.kind=lhsExprType.kind,.op_kind=expr.kind}});
+        return lhsExprType;
+    }
+}
+
+// Operators are verified in post order from an explicit work list,
+// so the native stack doesn't grow with the length of an operator chain.
+// Only calls and subscripts come back here for their own expressions.
+Type Analyzer::VerifyExpression(ASTIndex rootIdx) {
+    assert(rootIdx != AST_NULL);
+    const size_t workBase = exprWork.size();
+    [[maybe_unused]] const size_t typesBase = exprTypes.size();
+    exprWork.push_back({ rootIdx, false });
+
+    while (exprWork.size() > workBase) {
+        auto [exprIdx, operandsDone] = exprWork.back();
+        exprWork.pop_back();
+        const ASTNode& expr = ast.tree[exprIdx];
+        if (IsUnaryOp(expr.kind)) {
+            if (!operandsDone) {
+                exprWork.push_back({ exprIdx, true });
+                exprWork.push_back({ expr.unaryOp.expr, false });
+                continue;
+            }
+            exprTypes.back() = VerifyUnaryOp(exprIdx, exprTypes.back());
+        }
+        else if (IsBinaryOp(expr.kind)) {
+            if (!operandsDone) {
+                exprWork.push_back({ exprIdx, true });
+                exprWork.push_back({ expr.binaryOp.right, false });
+                exprWork.push_back({ expr.binaryOp.left, false });
+                continue;
+            }
+            Type rhsExprType = exprTypes.back();
+            exprTypes.pop_back();
+            exprTypes.back() = VerifyBinaryOp(exprIdx, exprTypes.back(), rhsExprType);
         }
         else {
-            // TODO: Disallow invalid binary operations (ex. str + int)
-
-            AddInstruction(Instruction{.opcode=Instruction::Opcode::BINARY_OP, .op={.kind=lhsExprType.kind,.op_kind=expr.kind}});
-            return lhsExprType;
+            Type operandType = VerifyOperand(exprIdx);
+            exprTypes.push_back(operandType);
         }
     }
 
-    assert(0 && "Unreachable");
-    return { TypeKind::NONE, 0 };
+    assert(exprTypes.size() == typesBase + 1);
+    Type exprType = exprTypes.back();
+    exprTypes.pop_back();
+    return exprType;
 }
 
-void Analyzer::VerifyStatement(ASTIndex stmtIdx, std::unordered_map<std::string_view, ASTIndex>& symbolTable) {
+void Analyzer::VerifyStatement(ASTIndex stmtIdx) {
     const ASTNode& stmt = ast.tree[stmtIdx];
     switch (stmt.kind) {
         case ASTKind::IF_STATEMENT: {
             ++blockDepth;
-            stackAddrs.push_back(stackAddrs.back());
-            std::unordered_map<std::string_view, ASTIndex> innerScope = symbolTable;
-            Type condType = VerifyExpression(stmt.ifstmt.cond, innerScope);
+            symbols.PushScope();
+            Type condType = VerifyExpression(stmt.ifstmt.cond);
             
             size_t ifJmpIdx = instructions.size();
             AddInstruction(Instruction{.opcode=Instruction::Opcode::JMP_Z});
             instructions[ifJmpIdx].jmp.accessSize = condType.kind == TypeKind::U8 ? 1 : 8;
-            VerifyStatements(stmt.ifstmt.body, innerScope);
+            VerifyStatements(stmt.ifstmt.body);
 
             // If there is an else block, jump one more to skip the fi jump
-            bool hasElse = stmt.ifstmt.elsestmt != AST_EMPTY;
+            bool hasElse = stmt.flags.hasElse;
             instructions[ifJmpIdx].jmp.jmpAddr = instructions.size() + hasElse;
 
             if (hasElse) {
                 size_t fiJmpIdx = instructions.size();
                 AddInstruction(Instruction{.opcode=Instruction::Opcode::JMP});
-                VerifyStatements(stmt.ifstmt.elsestmt, innerScope);
+                VerifyStatements(stmt.ifstmt.ElseBody());
                 instructions[fiJmpIdx].jmpAddr = instructions.size();
             }
 
             --blockDepth;
-            stackAddrs.pop_back();
+            symbols.PopScope();
         } break;
 
         case ASTKind::FOR_STATEMENT: {
             ++blockDepth;
             ++loopDepth;
-            stackAddrs.push_back(stackAddrs.back());
+            symbols.PushScope();
             breakAddrs.emplace_back();
             continueAddrs.emplace_back();
 
-            std::unordered_map<std::string_view, ASTIndex> innerScope = symbolTable;
-            if (stmt.forstmt.init != AST_NULL)
-                VerifyDefinition(stmt.forstmt.init, innerScope);
+            std::span<const ASTIndex> clauses = ast.GetList(stmt.forstmt.clauses);
+            ASTIndex init = clauses[0], cond = clauses[1], incr = clauses[2];
+            if (init != AST_NULL)
+                VerifyDefinition(init);
 
             size_t cmpAddr = instructions.size();
 
-            bool hasCondition = stmt.forstmt.cond != AST_NULL;
+            bool hasCondition = cond != AST_NULL;
             Type condType;
             if (hasCondition) {
-                condType = VerifyExpression(stmt.forstmt.cond, innerScope);
+                condType = VerifyExpression(cond);
             }
             size_t whileJmpIdx = instructions.size();
 
@@ -376,15 +583,15 @@ void Analyzer::VerifyStatement(ASTIndex stmtIdx, std::unordered_map<std::string_
                 instructions[whileJmpIdx].jmp.accessSize = condType.kind == TypeKind::U8 ? 1 : 8;
             }
 
-            VerifyStatements(stmt.forstmt.body, innerScope);
+            VerifyStatements(stmt.forstmt.body);
 
 
             for (size_t continueAddr : continueAddrs.back()) {
                 instructions[continueAddr].jmpAddr = instructions.size();
             }
 
-            if (stmt.forstmt.incr != AST_NULL)
-                VerifyStatement(stmt.forstmt.incr, innerScope);
+            if (incr != AST_NULL)
+                VerifyStatement(incr);
 
             AddInstruction(Instruction{.opcode=Instruction::Opcode::JMP, .jmpAddr=cmpAddr});
             if (hasCondition) {
@@ -397,20 +604,19 @@ void Analyzer::VerifyStatement(ASTIndex stmtIdx, std::unordered_map<std::string_
 
             --blockDepth;
             --loopDepth;
-            stackAddrs.pop_back();
+            symbols.PopScope();
             breakAddrs.pop_back();
             continueAddrs.pop_back();
         } break;
 
         case ASTKind::DEFINITION: {
-            VerifyDefinition(stmtIdx, symbolTable);
+            VerifyDefinition(stmtIdx);
         } break;
 
         case ASTKind::RETURN_STATEMENT: {
-            // TODO: Stop generating instructions for current block after returning
             bool hasReturnValue = stmt.ret.expr != AST_NULL;
             Type retType = hasReturnValue ?
-                VerifyExpression(stmt.ret.expr, symbolTable) :
+                VerifyExpression(stmt.ret.expr) :
                 Type{ TypeKind::NONE, true };
             if (!(retType.isScalar == currProc->returnType.isScalar && retType.kind == currProc->returnType.kind)) {
                 CompileErrorAt(tokens[ast.tree[stmtIdx].tokenIdx],
@@ -450,70 +656,69 @@ void Analyzer::VerifyStatement(ASTIndex stmtIdx, std::unordered_map<std::string_
         case ASTKind::ASSIGN: {
             const ASTNode::ASTAssign& asgn = stmt.asgn;
             const Token& lhsTok = tokens[ast.tree[asgn.lvalue].tokenIdx];
-            if (!symbolTable.contains(lhsTok.text)) {
+            const ScopedSymbolTable::Binding* binding = symbols.Lookup(tokens.Symbol(ast.tree[asgn.lvalue].tokenIdx));
+            if (binding == nullptr) {
                 CompileErrorAt(tokens[stmt.tokenIdx], "Assignment to undefined identifier {}", lhsTok.text);
             }
-            const ASTNode::ASTDefinition& defn = ast.tree[symbolTable[lhsTok.text]].defn;
-            if (defn.isConst) {
+            const ASTNode& defnNode = ast.tree[binding->defn];
+            const ASTNode::ASTDefinition& defn = defnNode.defn;
+            if (defnNode.flags.isConst) {
                 CompileErrorAt(tokens[stmt.tokenIdx], "Assignment of read-only variable {}", lhsTok.text);
             }
 
             bool isScalar = defn.arraySize == AST_NULL;
             bool hasSubscript = ast.tree[stmt.asgn.lvalue].lvalue.subscript != AST_NULL;
-            Type rhsType = VerifyExpression(stmt.asgn.rvalue, symbolTable);
+            Type rhsType = VerifyExpression(stmt.asgn.rvalue);
             // assert(rhsType.isScalar);
             bool isRvalueScalar = isScalar || hasSubscript;
-            if (isRvalueScalar != rhsType.isScalar || defn.type != rhsType.kind) {
+            if (isRvalueScalar != rhsType.isScalar || defnNode.type != rhsType.kind) {
                 CompileErrorAt(tokens[stmt.tokenIdx], "Incompatible types when assigning '{}' to type {}{} (expected {}{})",
                                lhsTok.text,
                                TypeKindName(rhsType.kind),
                                rhsType.isScalar ? "" : "[]",
-                               TypeKindName(defn.type),
+                               TypeKindName(defnNode.type),
                                isRvalueScalar ? "" : "[]");
             }
             if (isScalar && hasSubscript) {
                 CompileErrorAt(tokens[stmt.tokenIdx], "Cannot subscript scalar variable '{}'", lhsTok.text);
             }
 
-            VerifyLValue(asgn.lvalue, symbolTable, false);
+            VerifyLValue(asgn.lvalue, false);
         } break;
 
         case ASTKind::ASM_STATEMENT: {
-            for (ASTIndex stmtIdx : ast.lists[stmt.asm_.strings]) {
-                AddInstruction(Instruction{.opcode=Instruction::Opcode::INLINE, .str=ast.tree[stmtIdx].literal.str});
+            isInlinable = false;
+            for (ASTIndex stmtIdx : ast.GetList(stmt.asm_.strings)) {
+                AddInstruction(Instruction{.opcode=Instruction::Opcode::INLINE, .str=ast.strings[ast.tree[stmtIdx].literal.str]});
             }
         } break;
 
         default: {
-            // Treat everything else as expression
-            VerifyExpression(stmtIdx, symbolTable);
+            // Treat everything else as expression, its value stays on the stack until returning
+            if (VerifyExpression(stmtIdx).kind != TypeKind::NONE)
+                isInlinable = false;
         } break;
     }
 }
 
 
-void Analyzer::VerifyStatements(ASTList list, std::unordered_map<std::string_view, ASTIndex>& symbolTable) {
+void Analyzer::VerifyStatements(ASTList list) {
     if (list != AST_EMPTY) {
-        for (ASTIndex stmtIdx : ast.lists[list]) {
-            VerifyStatement(stmtIdx, symbolTable);
+        for (ASTIndex stmtIdx : ast.GetList(list)) {
+            VerifyStatement(stmtIdx);
         }
     }
 }
 
-void Analyzer::VerifyProcedure(ASTIndex procIdx) {
+void Analyzer::VerifyProcedureBody(ASTIndex procIdx) {
     const ASTNode proc = ast.tree[procIdx];
     const ASTNode::ASTProcedure& procedure = proc.procedure;
     const Token& token = tokens[proc.tokenIdx];
 
     ASTList params = procedure.params;
-    std::unordered_map<std::string_view, ASTIndex> symbolTable; // TODO: use more efficient structure
-    // When entering and leaving lexical scopes, the entire table needs to be copied
-    // This is probably not a good idea, but I can't really think of anything better right now
-    // Maybe some sort of linked structure (constant insert/remove)?
 
-    ProcedureDefn& procDefn = procedureDefns.at(token.text);
+    const ProcedureDefn& procDefn = procedureDefns[tokens.Symbol(proc.tokenIdx)];
     currProc = &procDefn;
-    procDefn.instructionNum = instructions.size();
 
     // if (!hasEntry && token.text == "entry") {
     //     hasEntry = true;
@@ -523,20 +728,20 @@ void Analyzer::VerifyProcedure(ASTIndex procIdx) {
 
     returnAtTopLevel = false;
     maxNumVariables = 0;
-    stackAddrs.emplace_back();
+    symbols.PushScope();
 
     size_t enterIdx = instructions.size();
     AddInstruction(Instruction{.opcode=Instruction::Opcode::ENTER});
 
     // Don't allocate arrays passed as arguments
     keepGenerating = false;
-    VerifyStatements(params, symbolTable);
+    VerifyStatements(params);
     keepGenerating = true;
 
-    if (!proc.procedure.isExtern) {
-        VerifyStatements(procedure.body, symbolTable);
+    if (!proc.flags.isExtern) {
+        VerifyStatements(procedure.body);
         if (!returnAtTopLevel) {
-            if (procedure.retType != TypeKind::NONE) {
+            if (proc.type != TypeKind::NONE) {
                 CompileErrorAt(token, "Non-void procedure '{}' did not return in all control paths", token.text);
             }
             bool hasReturnValue = procDefn.returnType.kind != TypeKind::NONE;
@@ -544,94 +749,362 @@ void Analyzer::VerifyProcedure(ASTIndex procIdx) {
                 Instruction::Opcode::RETURN_VAL :
                 Instruction::Opcode::RETURN_VOID});
         }
-        procDefn.stackSpace = maxNumVariables - procDefn.paramTypes.size();
-        instructions[enterIdx].frame.numLocals = procDefn.stackSpace;
+        instructions[enterIdx].frame.numLocals = maxNumVariables - procDefn.paramTypes.size();
         instructions[enterIdx].frame.numParams = procDefn.paramTypes.size();
     }
 
-    stackAddrs.pop_back();
+    symbols.PopScope();
 }
 
-void Analyzer::VerifyProgram() {
+Procedure Analyzer::VerifyProcedure(ASTIndex procIdx) {
+    const ASTNode& proc = ast.tree[procIdx];
+    const Token& procName = tokens[proc.tokenIdx];
+    Procedure procedure;
+    procedure.procName = procName.text;
+    procedure.retType = proc.type;
+    procedure.isExtern = proc.flags.isExtern;
+    procedure.isPublic = proc.flags.isPublic;
+    procedure.isInline = proc.flags.isInline;
+
+    isInlinable = !proc.flags.isExtern;
+    if (proc.flags.isExtern) {
+        keepGenerating = false;
+    }
+    VerifyProcedureBody(procIdx);
+    if (proc.flags.isExtern) {
+        AddInstruction(Instruction{.opcode=Instruction::Opcode::CALL, .str={procName.text.data(), procName.text.size()}});
+        keepGenerating = true;
+    }
+    for (ASTIndex parameterIdx : ast.GetList(proc.procedure.params)) {
+        const ASTNode& param = ast.tree[parameterIdx];
+        procedure.params.push_back({ param.type, param.defn.arraySize == AST_NULL });
+    }
 
-    // Builtins
-    ast.tree.push_back({ .defn = { .type = TypeKind::F64 }, .kind = ASTKind::DEFINITION, });
-    ASTIndex f64Param = ast.tree.size() - 1;
-    ast.tree.push_back({ .defn = { .type = TypeKind::I64 }, .kind = ASTKind::DEFINITION, });
-    ASTIndex i64Param = ast.tree.size() - 1;
-    ast.tree.push_back({ .defn = { .type = TypeKind::U8 }, .kind = ASTKind::DEFINITION, });
-    ASTIndex u8Param = ast.tree.size() - 1;
-    ast.tree.push_back({ .defn = { .type = TypeKind::STR }, .kind = ASTKind::DEFINITION, });
-    ASTIndex strParam = ast.tree.size() - 1;
+    procedure.isInlinable = isInlinable;
+    procedure.instructions = std::move(instructions);
+    procedure.calls = std::move(unresolvedCalls);
+    instructions.clear();
+    unresolvedCalls.clear();
+    deadCodeEliminator.Run(procedure);
+    return procedure;
+}
+
+ArenaVector<ImportedProcedure> ModuleInterface(const TokenList& tokens, const AST& ast) {
+    ArenaVector<ImportedProcedure> interface;
+    for (ASTIndex procIdx : ast.GetList(ast.tree[0].program.procedures)) {
+        const ASTNode& proc = ast.tree[procIdx];
+        if (!proc.flags.isPublic)
+            continue;
+        ImportedProcedure& imported = interface.emplace_back();
+        imported.name = tokens[proc.tokenIdx];
+        for (ASTIndex paramIdx : ast.GetList(proc.procedure.params)) {
+            const ASTNode& param = ast.tree[paramIdx];
+            imported.params.push_back({ param.type, param.defn.arraySize == AST_NULL });
+        }
+        imported.returnType = { proc.type, !proc.flags.retIsArray };
+    }
+    return interface;
+}
+
+// Procedures every program can call, their addresses are negative (see IS_BUILTIN)
+struct BuiltinProcedure {
+    std::string_view name;
+    TypeKind paramType; // NONE if it takes no parameter
+    TypeKind returnType;
+    size_t address;
+};
+static constexpr BuiltinProcedure BUILTIN_PROCEDURES[] = {
+    { "sqrt", TypeKind::F64, TypeKind::F64,  BUILTIN_sqrt },
+    { "puti", TypeKind::I64, TypeKind::NONE, BUILTIN_puti },
+    { "putf", TypeKind::F64, TypeKind::NONE, BUILTIN_putf },
+    { "puts", TypeKind::STR, TypeKind::NONE, BUILTIN_puts },
+    { "itof", TypeKind::I64, TypeKind::F64,  BUILTIN_itof },
+    { "ftoi", TypeKind::F64, TypeKind::I64,  BUILTIN_ftoi },
+    { "itoc", TypeKind::I64, TypeKind::U8,   BUILTIN_itoc },
+    { "ctoi", TypeKind::U8,  TypeKind::I64,  BUILTIN_ctoi },
+    { "clock_ns", TypeKind::NONE, TypeKind::I64, BUILTIN_clock_ns }, // Monotonic clock, for programs timing themselves
+    { "rdtsc", TypeKind::NONE, TypeKind::I64, BUILTIN_rdtsc },       // Time stamp counter of the cpu
+};
+
+bool IsBuiltinProcedure(std::string_view name) {
+    return std::ranges::any_of(BUILTIN_PROCEDURES, [&](const BuiltinProcedure& builtin) { return builtin.name == name; });
+}
 
-    procedureDefns["sqrt"] = ProcedureDefn{ .paramTypes = { f64Param }, .returnType = { TypeKind::F64,  true }, .instructionNum=BUILTIN_sqrt };
-    procedureDefns["puti"] = ProcedureDefn{ .paramTypes = { i64Param }, .returnType = { TypeKind::NONE, true }, .instructionNum=BUILTIN_puti };
-    procedureDefns["putf"] = ProcedureDefn{ .paramTypes = { f64Param }, .returnType = { TypeKind::NONE, true }, .instructionNum=BUILTIN_putf };
-    procedureDefns["puts"] = ProcedureDefn{ .paramTypes = { strParam }, .returnType = { TypeKind::NONE, true }, .instructionNum=BUILTIN_puts };
-    procedureDefns["itof"] = ProcedureDefn{ .paramTypes = { i64Param }, .returnType = { TypeKind::F64,  true }, .instructionNum=BUILTIN_itof };
-    procedureDefns["ftoi"] = ProcedureDefn{ .paramTypes = { f64Param }, .returnType = { TypeKind::I64,  true }, .instructionNum=BUILTIN_ftoi };
-    procedureDefns["itoc"] = ProcedureDefn{ .paramTypes = { i64Param }, .returnType = { TypeKind::U8,   true }, .instructionNum=BUILTIN_itoc };
-    procedureDefns["ctoi"] = ProcedureDefn{ .paramTypes = { u8Param },  .returnType = { TypeKind::I64,  true }, .instructionNum=BUILTIN_ctoi };
+// Builtins, imports and the signature of every procedure, so mutual recursion works out of the box
+static ArenaVector<ProcedureDefn> DeclareProcedures(const TokenList& tokens, AST& ast, std::span<const ImportedProcedure> imports) {
+    ArenaVector<ProcedureDefn> procedureDefns(tokens.Symbols().size());
 
-    // Collect all procedure definitions and "forward declare" them.
-    // Mutual recursion should work out of the box
-    const ASTNode& prog = ast.tree[0];
-    const auto& procList = ast.lists[prog.program.procedures];
-    for (ASTIndex procIdx : procList) {
+    // Builtins share one parameter node per type
+    std::array<ASTIndex, static_cast<size_t>(TypeKind::COUNT)> builtinParams{};
+    for (TypeKind type : { TypeKind::F64, TypeKind::I64, TypeKind::U8, TypeKind::STR }) {
+        ast.tree.push_back({ .kind = ASTKind::DEFINITION, .type = type });
+        builtinParams[static_cast<size_t>(type)] = static_cast<ASTIndex>(ast.tree.size() - 1);
+    }
+
+    // Builtins that are never named in the source can't be called, so they don't need a symbol
+    for (const BuiltinProcedure& builtin : BUILTIN_PROCEDURES) {
+        SymbolId id = tokens.Symbols().Find(builtin.name);
+        if (id == SYMBOL_NONE)
+            continue;
+        procedureDefns[id] = ProcedureDefn{ .paramTypes = {},
+            .returnType = { builtin.returnType, true }, .instructionNum = builtin.address, .isDefined = true, .isImported = false };
+        if (builtin.paramType != TypeKind::NONE)
+            procedureDefns[id].paramTypes.push_back(builtinParams[static_cast<size_t>(builtin.paramType)]);
+    }
+
+    // Parameters of imported procedures get nodes here, calls only look at their type and whether they have a size
+    ASTIndex importedArraySize = AST_NULL;
+    for (const ImportedProcedure& imported : imports) {
+        SymbolId id = tokens.Symbols().Find(imported.name.text);
+        if (id == SYMBOL_NONE)
+            continue;
+        if (procedureDefns[id].isDefined) {
+            CompileErrorAt(imported.name, "Procedure '{}' is imported more than once", imported.name.text);
+        }
+
+        ProcedureDefn& defn = procedureDefns[id];
+        defn = ProcedureDefn{ .paramTypes = {}, .returnType = imported.returnType, .instructionNum = 0, .isDefined = true, .isImported = true };
+        for (Type param : imported.params) {
+            if (!param.isScalar && importedArraySize == AST_NULL) {
+                ASTNode& sizeNode = ast.tree.emplace_back();
+                sizeNode.kind = ASTKind::INTEGER_LITERAL_EXPR;
+                sizeNode.type = TypeKind::I64;
+                importedArraySize = static_cast<ASTIndex>(ast.tree.size() - 1);
+            }
+            ASTNode& paramNode = ast.tree.emplace_back();
+            paramNode.kind = ASTKind::DEFINITION;
+            paramNode.type = param.kind;
+            paramNode.defn.arraySize = param.isScalar ? AST_NULL : importedArraySize;
+            defn.paramTypes.push_back(static_cast<ASTIndex>(ast.tree.size() - 1));
+        }
+    }
+
+    for (ASTIndex procIdx : ast.GetList(ast.tree[0].program.procedures)) {
         const ASTNode& proc = ast.tree[procIdx];
         const Token& procName = tokens[proc.tokenIdx];
-        if (procedureDefns.contains(procName.text)) {
+        ProcedureDefn& defn = procedureDefns[tokens.Symbol(proc.tokenIdx)];
+        if (defn.isDefined) {
             CompileErrorAt(procName, "Redefinition of procedure '{}'", procName.text);
         }
 
-        const auto& params = ast.lists[proc.procedure.params];
-        procedureDefns[procName.text] = ProcedureDefn{
-                .paramTypes = params,
-                .returnType = { proc.procedure.retType, !proc.procedure.retIsArray },
+        std::span<const ASTIndex> params = ast.GetList(proc.procedure.params);
+        defn = ProcedureDefn{
+                .paramTypes = { params.begin(), params.end() },
+                .returnType = { proc.type, !proc.flags.retIsArray },
+                .instructionNum = 0,
+                .isDefined = true,
+                .isImported = false,
             };
     }
+    return procedureDefns;
+}
 
-    // size_t entryJmpIdx = instructions.size();
-    // AddInstruction(Instruction{.opcode=Instruction::Opcode::JMP});
-    for (ASTIndex procIdx : procList) {
-        const ASTNode& proc = ast.tree[procIdx];
-        const Token& procName = tokens[proc.tokenIdx];
-        procedures.emplace_back();
-        procedures.back().procInfo = proc.procedure;
-        procedures.back().procName = procName.text;
-        procedures.back().insStartIdx = instructions.size();
-        if (proc.procedure.isExtern) {
-            keepGenerating = false;
+// Places the procedures one after another, turning their relative jumps into absolute ones
+// procList holds the node of each procedure
+static void LinkProcedures(std::vector<Procedure>& procedures, std::span<const ASTIndex> procList,
+    ArenaVector<ProcedureDefn>& procedureDefns, const TokenList& tokens, const AST& ast)
+{
+    size_t insStartIdx = 0;
+    for (size_t i = 0; i < procedures.size(); ++i) {
+        Procedure& proc = procedures[i];
+        proc.insStartIdx = insStartIdx;
+        proc.insEndIdx = insStartIdx + proc.instructions.size();
+        procedureDefns[tokens.Symbol(ast.tree[procList[i]].tokenIdx)].instructionNum = insStartIdx;
+        insStartIdx = proc.insEndIdx;
+    }
+
+    ParallelFor(procedures.size(), [&](size_t i) {
+        Procedure& proc = procedures[i];
+        for (Instruction& ins : proc.instructions) {
+            if (ins.opcode == Instruction::Opcode::JMP || ins.opcode == Instruction::Opcode::SAVE)
+                ins.jmpAddr += proc.insStartIdx;
+            else if (ins.opcode == Instruction::Opcode::JMP_Z)
+                ins.jmp.jmpAddr += proc.insStartIdx;
         }
-        VerifyProcedure(procIdx);
-        if (proc.procedure.isExtern) {
-            AddInstruction(Instruction{.opcode=Instruction::Opcode::CALL, .str={procName.text.data(), procName.text.size()}});
-            keepGenerating = true;
+        for (auto [jumpIdx, callee] : proc.calls) {
+            // fmt::print("resolving call to '{}': {}\n", tokens.Symbols().Name(callee), procedureDefns[callee].instructionNum);
+            proc.instructions[jumpIdx].jmpAddr = procedureDefns[callee].instructionNum;
         }
-        procedures.back().insEndIdx = instructions.size();
-        for (ASTIndex parameterIdx : ast.lists[proc.procedure.params]) {
-            const ASTNode& param = ast.tree[parameterIdx];
-            procedures.back().params.push_back(param.defn);
+    });
+    // if (!hasEntry) {
+    //     CompileErrorAt(tokens.back(), "Missing entrypoint procedure 'entry'");
+    // }
+    // instructions[entryJmpIdx].jmpAddr = entryAddr;
+}
+
+// Index in procList of the procedure each symbol names, UINT32_MAX for every other symbol
+static ArenaVector<uint32_t> ProcedureOfSymbol(const TokenList& tokens, const AST& ast, std::span<const ASTIndex> procList) {
+    ArenaVector<uint32_t> procOfSymbol(tokens.Symbols().size(), UINT32_MAX);
+    for (uint32_t i = 0; i < procList.size(); ++i)
+        procOfSymbol[tokens.Symbol(ast.tree[procList[i]].tokenIdx)] = i;
+    return procOfSymbol;
+}
+
+// Tokens of a procedure run from its name to the next procedure's name (or the end of its file)
+static TokenIndex ProcedureTokensEnd(const TokenList& tokens, const AST& ast, std::span<const ASTIndex> procList, size_t i) {
+    TokenIndex start = ast.tree[procList[i]].tokenIdx;
+    const File* file = tokens[start].file;
+    if (i + 1 < procList.size()) {
+        TokenIndex next = ast.tree[procList[i + 1]].tokenIdx;
+        if (tokens[next].file == file)
+            return next;
+    }
+    TokenIndex end = start;
+    while (end < tokens.size() && tokens[end].file == file)
+        ++end;
+    return end;
+}
+
+// Covers everything verifying the procedure depends on: its own tokens and annotations,
+// and the signature of every procedure its identifiers name (a superset of its callees)
+static uint64_t ProcedureKey(const TokenList& tokens, const AST& ast, const ArenaVector<ProcedureDefn>& procedureDefns,
+    std::span<const ASTIndex> procList, size_t i)
+{
+    const ASTNode& proc = ast.tree[procList[i]];
+    ContentHash hash;
+    hash.Add(ProcedureCache::FORMAT_VERSION);
+    hash.Add(sizeof(Instruction));
+    hash.Add(proc.type);
+    hash.Add(static_cast<bool>(proc.flags.retIsArray));
+    hash.Add(static_cast<bool>(proc.flags.isCdecl));
+    hash.Add(static_cast<bool>(proc.flags.isExtern));
+    hash.Add(static_cast<bool>(proc.flags.isPublic));
+    hash.Add(static_cast<bool>(proc.flags.isInline));
+
+    for (TokenIndex idx = proc.tokenIdx, end = ProcedureTokensEnd(tokens, ast, procList, i); idx < end; ++idx) {
+        hash.Add(tokens.Kind(idx));
+        hash.Add(tokens[idx].text);
+        const ProcedureDefn& defn = procedureDefns[tokens.Symbol(idx)];
+        if (tokens.Kind(idx) != TokenKind::IDENTIFIER || !defn.isDefined)
+            continue;
+        hash.Add(defn.paramTypes.size());
+        for (ASTIndex paramIdx : defn.paramTypes) {
+            hash.Add(ast.tree[paramIdx].type);
+            hash.Add(ast.tree[paramIdx].defn.arraySize == AST_NULL);
         }
+        hash.Add(defn.returnType.kind);
+        hash.Add(defn.returnType.isScalar);
+        hash.Add(IS_BUILTIN(defn.instructionNum) ? defn.instructionNum : 0);
+        hash.Add(defn.isImported);
     }
+    return hash.Digest();
+}
 
-    for (auto [jumpIdx, procName] : unresolvedCalls) {
-        // fmt::print("resolving call to '{}': {}\n", procName, procedureDefns.at(procName).instructionNum);
-        instructions.at(jumpIdx).jmpAddr = procedureDefns.at(procName).instructionNum;
+// Loads procedure i from the cache, or parses (if deferred) and verifies it, storing the result
+static Procedure VerifyOrLoadProcedure(Analyzer& analyzer, ProcedureCache* cache, const TokenList& tokens, AST& ast,
+    const ArenaVector<ProcedureDefn>& procedureDefns, std::span<const ASTIndex> procList, size_t i)
+{
+    ASTIndex procIdx = procList[i];
+    TraceSpan span{"verify", tokens[ast.tree[procIdx].tokenIdx].text};
+    if (cache == nullptr) {
+        ParseDeferredBody(tokens, ast, procIdx);
+        return analyzer.VerifyProcedure(procIdx);
     }
 
-    for (auto& proc : procedures) {
-        for (size_t i = proc.insStartIdx; i < proc.insEndIdx; ++i)
-            proc.instructions.push_back(instructions[i]);
+    uint64_t key = ProcedureKey(tokens, ast, procedureDefns, procList, i);
+    Procedure procedure;
+    if (cache->Load(key, tokens.Symbols(), procedure)) {
+        procedure.procName = tokens[ast.tree[procIdx].tokenIdx].text;
+        return procedure;
     }
-    // if (!hasEntry) {
-    //     CompileErrorAt(tokens.back(), "Missing entrypoint procedure 'entry'");
-    // }
-    // instructions[entryJmpIdx].jmpAddr = entryAddr;
+    ParseDeferredBody(tokens, ast, procIdx);
+    procedure = analyzer.VerifyProcedure(procIdx);
+    cache->Store(key, tokens.Symbols(), procedure);
+    return procedure;
 }
 
-std::vector<Procedure> VerifyAST(const std::vector<Token>& tokens, AST& ast) {
-    Analyzer analyzer{tokens, ast};
-    analyzer.VerifyProgram();
-    return std::move(analyzer.procedures);
+// Verifies the procedures reachable from the first procedure (where the interpreter starts)
+// and public ones (callable from outside), parsing their bodies the first time they are reached.
+// Returns the node of each reached procedure in program order.
+static ArenaVector<ASTIndex> VerifyReachable(std::vector<Procedure>& procedures, const ArenaVector<ProcedureDefn>& procedureDefns,
+    const TokenList& tokens, AST& ast, ProcedureCache* cache)
+{
+    // Parsing appends to the list pool, so the procedure list can't be a span into it
+    std::span<const ASTIndex> allProcs = ast.GetList(ast.tree[0].program.procedures);
+    ArenaVector<ASTIndex> procList{allProcs.begin(), allProcs.end()};
+    constexpr uint32_t NOT_A_PROCEDURE = UINT32_MAX;
+    ArenaVector<uint32_t> procOfSymbol = ProcedureOfSymbol(tokens, ast, procList);
+
+    ArenaVector<bool> isReached(procList.size());
+    ArenaVector<uint32_t> pending;
+    auto Reach = [&](uint32_t i) {
+        if (i == NOT_A_PROCEDURE || isReached[i]) return;
+        isReached[i] = true;
+        pending.push_back(i);
+    };
+    for (uint32_t i = 0; i < procList.size(); ++i) {
+        if (i == 0 || ast.tree[procList[i]].flags.isPublic)
+            Reach(i);
+    }
+
+    // Parsing grows the AST, so this part stays on one thread
+    Analyzer analyzer{tokens, ast, procedureDefns};
+    while (!pending.empty()) {
+        uint32_t i = pending.back();
+        pending.pop_back();
+        procedures[i] = VerifyOrLoadProcedure(analyzer, cache, tokens, ast, procedureDefns, procList, i);
+        for (auto [jumpIdx, callee] : procedures[i].calls)
+            Reach(procOfSymbol[callee]);
+    }
+
+    size_t numReached = 0;
+    for (size_t i = 0; i < procList.size(); ++i) {
+        if (!isReached[i])
+            continue;
+        if (numReached != i) {
+            procedures[numReached] = std::move(procedures[i]);
+            procList[numReached] = procList[i];
+        }
+        ++numReached;
+    }
+    procedures.resize(numReached);
+    procList.resize(numReached);
+    return procList;
+}
+
+void VerifyProcedures(const TokenList& tokens, AST& ast, std::span<const ImportedProcedure> imports) {
+    ArenaVector<ProcedureDefn> procedureDefns = DeclareProcedures(tokens, ast, imports);
+    Analyzer analyzer{tokens, ast, procedureDefns};
+    for (ASTIndex procIdx : ast.GetList(ast.tree[0].program.procedures))
+        analyzer.VerifyProcedure(procIdx);
+}
+
+std::vector<Procedure> VerifyAST(const TokenList& tokens, AST& ast, bool lazy, ProcedureCache* cache,
+    std::span<const ImportedProcedure> imports)
+{
+    ArenaVector<ProcedureDefn> procedureDefns = DeclareProcedures(tokens, ast, imports);
+    std::vector<Procedure> procedures(ast.GetList(ast.tree[0].program.procedures).size());
+
+    if (lazy) {
+        ArenaVector<ASTIndex> procList = VerifyReachable(procedures, procedureDefns, tokens, ast, cache);
+        InlineProcedures(procedures, ProcedureOfSymbol(tokens, ast, procList));
+        LinkProcedures(procedures, procList, procedureDefns, tokens, ast);
+        return procedures;
+    }
+
+    // Each batch shares one analyzer (and its symbol table), a few batches per worker keeps them balanced.
+    // A batch stops at its first error, the one of the earliest batch is reported after all of them are done,
+    // so it is the first error in program order whatever the number of threads.
+    std::span<const ASTIndex> procList = ast.GetList(ast.tree[0].program.procedures);
+    size_t numBatches = std::min(procList.size(), NumWorkerThreads(procList.size()) * 4);
+    std::vector<std::optional<CompileError>> errors(numBatches);
+    ParallelFor(numBatches, [&](size_t batch) {
+        ThrowCompileErrorsScope throwing;
+        Analyzer analyzer{tokens, ast, procedureDefns};
+        try {
+            for (size_t i = batch * procList.size() / numBatches; i < (batch + 1) * procList.size() / numBatches; ++i)
+                procedures[i] = VerifyOrLoadProcedure(analyzer, cache, tokens, ast, procedureDefns, procList, i);
+        }
+        catch (CompileError& error) {
+            errors[batch] = std::move(error);
+        }
+    });
+    for (const std::optional<CompileError>& error : errors) {
+        if (error)
+            ExitWithCompileError(*error);
+    }
+
+    InlineProcedures(procedures, ProcedureOfSymbol(tokens, ast, procList));
+    LinkProcedures(procedures, procList, procedureDefns, tokens, ast);
+    return procedures;
 }
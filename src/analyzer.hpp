@@ -3,65 +3,164 @@
 #include "parser.hpp"
 
 #include "bytecode.hpp"
-#include <unordered_map>
+#include "optimizer.hpp"
+#include "arena.hpp"
+#include <optional>
 
 struct Type {
     TypeKind kind;
     bool isScalar;
+
+    bool operator==(const Type&) const = default;
+};
+
+// Variables visible in the procedure being verified
+// Each symbol holds its innermost binding. Binding logs the binding it replaces,
+// so leaving a scope just unwinds the log back to where the scope started and nothing is ever copied.
+class ScopedSymbolTable {
+public:
+    struct Binding {
+        ASTIndex defn = AST_NULL; // AST_NULL when not bound
+        size_t stackAddr;
+        // A let scalar initialized to a constant is never stored, loading it pushes the value
+        bool isConstant = false;
+        Instruction::Literal value{};
+    };
+
+private:
+    ArenaVector<Binding> bindings; // Indexed by symbol
+    ArenaVector<std::pair<SymbolId, Binding>> undoLog;
+    ArenaVector<size_t> scopeStarts;
+
+public:
+    explicit ScopedSymbolTable(size_t numSymbols)
+        : bindings(numSymbols)
+    {}
+
+    void PushScope() {
+        scopeStarts.push_back(undoLog.size());
+    }
+
+    void PopScope() {
+        for (size_t start = scopeStarts.back(); undoLog.size() > start; undoLog.pop_back())
+            bindings[undoLog.back().first] = undoLog.back().second;
+        scopeStarts.pop_back();
+    }
+
+    [[nodiscard]] const Binding* Lookup(SymbolId id) const {
+        if (bindings[id].defn == AST_NULL)
+            return nullptr;
+        return &bindings[id];
+    }
+
+    void Bind(SymbolId id, Binding binding) {
+        undoLog.emplace_back(id, bindings[id]);
+        bindings[id] = binding;
+    }
+
+    // Number of bindings made in the current scope and every scope enclosing it
+    [[nodiscard]] size_t NumVisible() const {
+        return undoLog.size();
+    }
 };
 
 struct Procedure {
-    std::vector<Instruction> instructions;
-    ASTNode::ASTProcedure procInfo;
+    ArenaVector<Instruction> instructions;
     std::string_view procName;
     size_t insStartIdx, insEndIdx;
-    std::vector<ASTNode::ASTDefinition> params;
+    ArenaVector<Type> params;
+    TypeKind retType;
+    bool isExtern;
+    bool isPublic;
+    bool isInline; // Declared inline, see InlineProcedures
+    bool isInlinable; // Leaves nothing on the stack but its return value (no arrays, discarded values or asm)
+    // (instruction, callee) of every call, the jumps are patched when linking
+    ArenaVector<std::pair<size_t, SymbolId>> calls;
 };
 
-class Analyzer {
-    struct ProcedureDefn {
-        std::vector<ASTIndex> paramTypes;
-        Type returnType;
-        size_t stackSpace;
-        size_t instructionNum;
-    };
+// Signature of a procedure, every one is declared before any body is verified
+struct ProcedureDefn {
+    ArenaVector<ASTIndex> paramTypes;
+    Type returnType;
+    size_t instructionNum; // Address of the first instruction, known after linking
+    bool isDefined;
+    bool isImported; // Public procedure of another module, see ImportedProcedure
+};
+
+// Public procedure of a separately compiled module (see import), only its signature is known
+struct ImportedProcedure {
+    Token name;
+    ArenaVector<Type> params;
+    Type returnType;
+};
 
-    const std::vector<Token>& tokens;
-    AST& ast;
-    std::unordered_map<std::string_view, ProcedureDefn> procedureDefns;
-    std::vector<std::pair<size_t, std::string_view>> unresolvedCalls;
+// Signatures of the public procedures of a module, bodies may still be deferred
+ArenaVector<ImportedProcedure> ModuleInterface(const TokenList& tokens, const AST& ast);
 
-    ProcedureDefn* currProc;
+// sqrt, puti and the like, defined in every program
+bool IsBuiltinProcedure(std::string_view name);
+
+// Verifies one procedure at a time into its own instructions, with jump addresses relative to its start.
+// Procedures only see each other's signatures, so separate analyzers can run on separate threads.
+class Analyzer {
+    const TokenList& tokens;
+    const AST& ast;
+    const ArenaVector<ProcedureDefn>& procedureDefns; // Indexed by symbol
+    ArenaVector<std::pair<size_t, SymbolId>> unresolvedCalls;
+
+    const ProcedureDefn* currProc;
     // int entryAddr;
     int loopDepth{};
     int blockDepth{};
     // bool hasEntry{};
     bool returnAtTopLevel;
     size_t maxNumVariables;
-    std::vector<std::vector<size_t>> breakAddrs;
-    std::vector<std::vector<size_t>> continueAddrs;
-    std::vector<std::unordered_map<std::string_view, size_t>> stackAddrs;
+    ArenaVector<ArenaVector<size_t>> breakAddrs;
+    ArenaVector<ArenaVector<size_t>> continueAddrs;
+    ScopedSymbolTable symbols;
+    // Pending operators and operand types of the expressions being verified, see VerifyExpression
+    ArenaVector<std::pair<ASTIndex, bool>> exprWork;
+    ArenaVector<Type> exprTypes;
     bool keepGenerating = true;
-    std::vector<Instruction> instructions;
+    bool isInlinable;
+    ArenaVector<Instruction> instructions;
+    DeadCodeEliminator deadCodeEliminator;
 
-    void AssertIdentUnusedInCurrentScope(const std::unordered_map<std::string_view, ASTIndex>& symbolTable, const Token& ident);
-    void VerifyProcedure(ASTIndex procIdx);
-    void VerifyStatements(ASTList list, std::unordered_map<std::string_view, ASTIndex>& symbolTable);
-    void VerifyStatement(ASTIndex stmtIdx, std::unordered_map<std::string_view, ASTIndex>& symbolTable);
-    void VerifyDefinition(ASTIndex defnIdx, std::unordered_map<std::string_view, ASTIndex>& symbolTable);
-    Type VerifyLValue(ASTIndex lvalIdx, std::unordered_map<std::string_view, ASTIndex>& symbolTable, bool isLoading);
-    Type VerifyCall(ASTIndex callIdx, std::unordered_map<std::string_view, ASTIndex>& symbolTable);
-    Type VerifyExpression(ASTIndex exprIdx, std::unordered_map<std::string_view, ASTIndex>& symbolTable);
+    void AssertIdentUnusedInCurrentScope(TokenIndex identIdx);
+    void VerifyStatements(ASTList list);
+    void VerifyStatement(ASTIndex stmtIdx);
+    void VerifyDefinition(ASTIndex defnIdx);
+    Type VerifyLValue(ASTIndex lvalIdx, bool isLoading);
+    Type VerifyCall(ASTIndex callIdx);
+    Type VerifyOperand(ASTIndex exprIdx);
+    Type VerifyUnaryOp(ASTIndex exprIdx, Type exprType);
+    Type VerifyBinaryOp(ASTIndex exprIdx, Type lhsExprType, Type rhsExprType);
+    Type VerifyExpression(ASTIndex rootIdx);
+    void VerifyProcedureBody(ASTIndex procIdx);
+    std::optional<Instruction::Literal> TrailingConstant(size_t fromEnd) const;
+    void ReplaceTrailingInstructions(size_t count, Instruction::Literal value);
 
     void AddInstruction(Instruction ins);
 public:
-    std::vector<Procedure> procedures;
-
-    Analyzer(const std::vector<Token>& tokens_, AST& ast_)
+    Analyzer(const TokenList& tokens_, const AST& ast_, const ArenaVector<ProcedureDefn>& procedureDefns_)
         : tokens{tokens_}, ast{ast_}
+        , procedureDefns{procedureDefns_}
+        , symbols{tokens_.Symbols().size()}
     {}
 
-    void VerifyProgram();
+    // The procedure is not linked, see VerifyAST
+    Procedure VerifyProcedure(ASTIndex procIdx);
 };
 
-std::vector<Procedure> VerifyAST(const std::vector<Token>& tokens, AST& ast);
+class ProcedureCache;
+
+// Declares every procedure, verifies them in parallel, then links them in program order
+// When lazy, only procedures reachable from the first and public procedures are parsed (if deferred), verified and linked
+// With a cache, procedures whose tokens and callee signatures are unchanged are loaded instead of verified
+// Imported procedures can be called, they are left for the linker
+std::vector<Procedure> VerifyAST(const TokenList& tokens, AST& ast, bool lazy = false, ProcedureCache* cache = nullptr,
+    std::span<const ImportedProcedure> imports = {});
+
+// Verifies every procedure without linking them, the procedures defined elsewhere are imported.
+// The language server verifies procedures one at a time like this, so only those an edit affects.
+void VerifyProcedures(const TokenList& tokens, AST& ast, std::span<const ImportedProcedure> imports);
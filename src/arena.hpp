@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+// Bump allocator for everything that lives as long as a compilation session.
+// Memory is handed out from large chunks and only released when the arena is destroyed,
+// individual deallocations are ignored.
+// An arena must only be used by one thread at a time, worker threads Fork() their own.
+class Arena {
+    struct Chunk {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    std::vector<Chunk> chunks;
+    std::byte* cur{};
+    std::byte* end{};
+    const size_t initialChunkSize;
+    size_t nextChunkSize;
+    size_t bytesUsed{};
+    size_t numAllocations{};
+
+    std::mutex childrenMutex;
+    std::vector<std::unique_ptr<Arena>> children;
+
+    void NewChunk(size_t minSize) {
+        size_t size = std::max(nextChunkSize, minSize);
+        chunks.push_back({ std::make_unique_for_overwrite<std::byte[]>(size), size });
+        cur = chunks.back().data.get();
+        end = cur + size;
+        nextChunkSize = size * 2;
+    }
+
+public:
+    struct Stats {
+        size_t bytesUsed;      // Handed out to allocations
+        size_t bytesReserved;  // Held in chunks
+        size_t numAllocations;
+        size_t numChunks;
+    };
+
+    static constexpr size_t MIN_CHUNK_SIZE = 64 * 1024;
+
+    explicit Arena(size_t initialSize = MIN_CHUNK_SIZE)
+        : initialChunkSize{std::max(initialSize, MIN_CHUNK_SIZE)}
+        , nextChunkSize{initialChunkSize}
+    {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    [[nodiscard]] void* Allocate(size_t size, size_t align) {
+        auto addr = reinterpret_cast<uintptr_t>(cur);
+        size_t padding = (align - addr % align) % align;
+        if (size + padding > static_cast<size_t>(end - cur)) {
+            NewChunk(size + align);
+            addr = reinterpret_cast<uintptr_t>(cur);
+            padding = (align - addr % align) % align;
+        }
+        std::byte* ptr = cur + padding;
+        cur = ptr + size;
+        bytesUsed += size;
+        ++numAllocations;
+        return ptr;
+    }
+
+    // A new arena for another thread, released together with this one
+    Arena& Fork() {
+        std::lock_guard lock{childrenMutex};
+        return *children.emplace_back(std::make_unique<Arena>(initialChunkSize / 4));
+    }
+
+    // Includes forked arenas, so no other thread may be allocating
+    [[nodiscard]] Stats GetStats() {
+        Stats stats{ bytesUsed, 0, numAllocations, chunks.size() };
+        for (const Chunk& chunk : chunks)
+            stats.bytesReserved += chunk.size;
+        std::lock_guard lock{childrenMutex};
+        for (auto& child : children) {
+            Stats childStats = child->GetStats();
+            stats.bytesUsed += childStats.bytesUsed;
+            stats.bytesReserved += childStats.bytesReserved;
+            stats.numAllocations += childStats.numAllocations;
+            stats.numChunks += childStats.numChunks;
+        }
+        return stats;
+    }
+
+    // The arena that containers on this thread allocate from (nullptr means the global heap)
+    static Arena*& Current() {
+        thread_local Arena* current = nullptr;
+        return current;
+    }
+};
+
+// Makes an arena current for the lifetime of the scope
+class ArenaScope {
+    Arena* previous;
+
+public:
+    explicit ArenaScope(Arena* arena)
+        : previous{Arena::Current()}
+    {
+        Arena::Current() = arena;
+    }
+    ~ArenaScope() { Arena::Current() = previous; }
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+};
+
+// Standard allocator that draws from the arena current when the container was created.
+// Copies of a container draw from the arena current at the time of the copy.
+template<typename T>
+struct ArenaAllocator {
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    Arena* arena;
+
+    ArenaAllocator() noexcept : arena{Arena::Current()} {}
+    explicit ArenaAllocator(Arena* arena_) noexcept : arena{arena_} {}
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena{other.arena} {} // NOLINT (implicit rebind)
+
+    [[nodiscard]] T* allocate(size_t n) {
+        if (arena == nullptr)
+            return std::allocator<T>{}.allocate(n);
+        return static_cast<T*>(arena->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept {
+        if (arena == nullptr)
+            std::allocator<T>{}.deallocate(ptr, n);
+    }
+
+    [[nodiscard]] ArenaAllocator select_on_container_copy_construction() const {
+        return ArenaAllocator{};
+    }
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U>& other) const noexcept { return arena == other.arena; }
+};
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+template<typename K, typename V>
+using ArenaMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, ArenaAllocator<std::pair<const K, V>>>;
@@ -0,0 +1,142 @@
+#include "benchmark.hpp"
+#include "interpreter.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <optional>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <fmt/core.h>
+
+// Calls stop once both limits are reached, whichever comes last
+static constexpr double WARMUP_SECONDS = 0.1;
+static constexpr size_t MIN_WARMUP_CALLS = 1;
+static constexpr double MEASURE_SECONDS = 1.0;
+static constexpr size_t MIN_MEASURED_CALLS = 5;
+static constexpr size_t MAX_MEASURED_CALLS = 100000;
+
+namespace {
+
+// One hardware counter of this process (user space only), unavailable ones read as nothing.
+// Virtual machines and containers often have none, or only some.
+class HardwareCounter {
+    int fd;
+
+public:
+    HardwareCounter(uint32_t type, uint64_t config) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+    HardwareCounter(const HardwareCounter&) = delete;
+    HardwareCounter& operator=(const HardwareCounter&) = delete;
+    ~HardwareCounter() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    void Enable() { if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0); }
+    void Disable() { if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0); }
+
+    [[nodiscard]] std::optional<uint64_t> Read() const {
+        uint64_t count;
+        if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+            return std::nullopt;
+        return count;
+    }
+};
+
+}
+
+static double Percentile(const std::vector<double>& sorted, double fraction) {
+    auto rank = static_cast<size_t>(std::ceil(fraction * static_cast<double>(sorted.size())));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+// Picks the unit from the median, so the columns line up
+static std::pair<double, const char*> TimeUnit(double seconds) {
+    if (seconds >= 1) return { 1, "s" };
+    if (seconds >= 1e-3) return { 1e3, "ms" };
+    if (seconds >= 1e-6) return { 1e6, "us" };
+    return { 1e9, "ns" };
+}
+
+void BenchmarkProcedure(const std::vector<Procedure>& procedures, std::string_view procName) {
+    auto proc = std::ranges::find(procedures, procName, &Procedure::procName);
+    if (proc == procedures.end()) {
+        fmt::print(stderr, "Error: There is no procedure '{}' to benchmark.\n", procName);
+        exit(1);
+    }
+    if (!proc->params.empty()) {
+        fmt::print(stderr, "Error: Procedure '{}' takes parameters, only procedures without any can be benchmarked.\n", procName);
+        exit(1);
+    }
+
+    Interpreter interpreter{procedures};
+    using Clock = std::chrono::steady_clock;
+    auto SecondsSince = [](Clock::time_point start) { return std::chrono::duration<double>(Clock::now() - start).count(); };
+
+    auto warmupStart = Clock::now();
+    for (size_t numCalls = 0; numCalls < MIN_WARMUP_CALLS || SecondsSince(warmupStart) < WARMUP_SECONDS; ++numCalls)
+        interpreter.Run(*proc);
+
+    struct NamedCounter {
+        const char* name;
+        HardwareCounter counter;
+    };
+    std::array<NamedCounter, 4> counters{{
+        { "cycles", { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES } },
+        { "instructions", { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS } },
+        { "branch misses", { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES } },
+        { "cache misses", { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES } },
+    }};
+
+    // Counters run across all measured calls, only the calls themselves are inside
+    std::vector<double> samples;
+    auto measureStart = Clock::now();
+    while (samples.size() < MAX_MEASURED_CALLS
+        && (samples.size() < MIN_MEASURED_CALLS || SecondsSince(measureStart) < MEASURE_SECONDS))
+    {
+        for (auto& [name, counter] : counters)
+            counter.Enable();
+        auto start = Clock::now();
+        interpreter.Run(*proc);
+        double seconds = SecondsSince(start);
+        for (auto& [name, counter] : counters)
+            counter.Disable();
+        samples.push_back(seconds);
+    }
+
+    fflush(stdout); // Whatever the procedure printed comes before the report
+    std::vector<double> sorted = samples;
+    std::ranges::sort(sorted);
+    double mean = 0;
+    for (double sample : samples)
+        mean += sample / static_cast<double>(samples.size());
+    auto [scale, unit] = TimeUnit(Percentile(sorted, 0.5));
+    fmt::print(stderr, "{}: {} calls\n", procName, samples.size());
+    fmt::print(stderr, "{:<14} {:>12.3f} {}\n", "min", sorted.front() * scale, unit);
+    fmt::print(stderr, "{:<14} {:>12.3f} {}\n", "median", Percentile(sorted, 0.5) * scale, unit);
+    fmt::print(stderr, "{:<14} {:>12.3f} {}\n", "p99", Percentile(sorted, 0.99) * scale, unit);
+    fmt::print(stderr, "{:<14} {:>12.3f} {}\n", "mean", mean * scale, unit);
+
+    bool hasCounters = false;
+    for (const auto& [name, counter] : counters) {
+        if (std::optional<uint64_t> count = counter.Read()) {
+            fmt::print(stderr, "{:<14} {:>12.0f} per call\n", name,
+                static_cast<double>(*count) / static_cast<double>(samples.size()));
+            hasCounters = true;
+        }
+    }
+    if (!hasCounters)
+        fmt::print(stderr, "Hardware counters are not available (perf_event_open failed).\n");
+}
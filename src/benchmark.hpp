@@ -0,0 +1,11 @@
+#pragma once
+
+#include "analyzer.hpp"
+
+#include <string_view>
+#include <vector>
+
+// Calls a procedure without parameters in the interpreter over and over (see -bench),
+// after warming up, and prints the min, median and p99 time of a call to stderr,
+// with hardware counters per call where perf events are available
+void BenchmarkProcedure(const std::vector<Procedure>& procedures, std::string_view procName);
@@ -12,6 +12,8 @@
 #define BUILTIN_ftoi ((size_t)(-6))
 #define BUILTIN_itoc ((size_t)(-7))
 #define BUILTIN_ctoi ((size_t)(-8))
+#define BUILTIN_clock_ns ((size_t)(-9))
+#define BUILTIN_rdtsc ((size_t)(-10))
 #define IS_BUILTIN(x) ((int64_t)(x) < 0)
 
 struct Instruction {
@@ -27,6 +29,7 @@ struct Instruction {
         UNARY_OP,    // TOP = u(x, TOP)
         BINARY_OP,   // TOP = b(x, TOP1, TOP)
         CALL,        // call extern func
+        CALL_IMPORTED, // ip = x in another module, resolved when linking the objects
         JMP,         // ip = x
         JMP_Z,       // if TOP == 0: ip = x
 
@@ -67,7 +70,7 @@ struct Instruction {
     };
 
     union {
-        ASTNode::StringView str; // call, inline
+        ASTNode::StringView str; // call, call_imported, inline
         Literal lit; // push
         Access access; // load_fast, store_fast, alloca
         Operator op; // unaryop, binaryop
@@ -0,0 +1,252 @@
+#include "cache.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fmt/core.h>
+
+static constexpr std::string_view PACK_MAGIC = "TRASHPC";
+
+// Instructions that point at text (in the source when verified, in the arena when loaded)
+static ASTNode::StringView* InstructionText(Instruction& ins) {
+    switch (ins.opcode) {
+        case Instruction::Opcode::INLINE:
+        case Instruction::Opcode::CALL:
+        case Instruction::Opcode::CALL_IMPORTED: return &ins.str;
+        case Instruction::Opcode::PUSH: return ins.lit.kind == TypeKind::STR ? &ins.lit.str : nullptr;
+        default: return nullptr;
+    }
+}
+
+namespace {
+
+class EntryWriter {
+public:
+    std::string bytes;
+
+    template<typename T>
+    void Write(const T& value) {
+        bytes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template<typename T>
+    void WriteArray(const T* values, size_t count) {
+        bytes.append(reinterpret_cast<const char*>(values), count * sizeof(T));
+    }
+
+    void WriteText(std::string_view text) {
+        Write(text.size());
+        bytes.append(text);
+    }
+};
+
+// Every read is bounds checked, a truncated or foreign file is just a miss
+class EntryReader {
+    std::string_view bytes;
+
+public:
+    explicit EntryReader(std::string_view bytes_)
+        : bytes{bytes_}
+    {}
+
+    template<typename T>
+    bool Read(T& value) {
+        if (bytes.size() < sizeof(value)) return false;
+        std::copy_n(bytes.data(), sizeof(value), reinterpret_cast<char*>(&value));
+        bytes.remove_prefix(sizeof(value));
+        return true;
+    }
+
+    template<typename T>
+    bool ReadArray(T* values, size_t count) {
+        if (bytes.size() / sizeof(T) < count) return false;
+        std::copy_n(bytes.data(), count * sizeof(T), reinterpret_cast<char*>(values));
+        bytes.remove_prefix(count * sizeof(T));
+        return true;
+    }
+
+    bool ReadText(std::string_view& text) {
+        size_t size;
+        if (!Read(size) || bytes.size() < size) return false;
+        text = bytes.substr(0, size);
+        bytes.remove_prefix(size);
+        return true;
+    }
+
+    [[nodiscard]] bool AtEnd() const { return bytes.empty(); }
+};
+
+}
+
+// Entries are only read from pages that are touched, a pack holds every procedure of a program
+static std::string_view MapFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return {};
+    struct stat st{};
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        mapping = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return {};
+    return { static_cast<const char*>(mapping), static_cast<size_t>(st.st_size) };
+}
+
+ProcedureCache::ProcedureCache(const std::string& dir, std::span<const std::string> sourceFilenames) {
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec || !std::filesystem::is_directory(dir, ec)) {
+        fmt::print(stderr, "Error: Could not create cache directory \"{}\".\n", dir);
+        exit(1);
+    }
+
+    ContentHash hash;
+    for (const std::string& filename : sourceFilenames)
+        hash.Add(filename);
+    packPath = fmt::format("{}/{:016x}.pack", dir, hash.Digest());
+    ReadPack();
+}
+
+ProcedureCache::~ProcedureCache() {
+    if (!pack.empty())
+        munmap(const_cast<char*>(pack.data()), pack.size());
+}
+
+// An unreadable or foreign pack is treated as empty and replaced on save
+void ProcedureCache::ReadPack() {
+    pack = MapFile(packPath);
+    EntryReader reader{pack};
+    std::string_view magic;
+    uint32_t version;
+    size_t numEntries;
+    if (!reader.ReadText(magic) || magic != PACK_MAGIC || !reader.Read(version) || version != FORMAT_VERSION
+        || !reader.Read(numEntries) || numEntries > pack.size())
+        return;
+
+    entries.reserve(numEntries);
+    for (size_t i = 0; i < numEntries; ++i) {
+        uint64_t key;
+        std::string_view bytes;
+        if (!reader.Read(key) || !reader.ReadText(bytes)) {
+            entries.clear();
+            return;
+        }
+        entries[key].bytes = bytes;
+    }
+}
+
+bool ProcedureCache::Load(uint64_t key, const SymbolTable& symbols, Procedure& proc) {
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        ++numMisses;
+        return false;
+    }
+    EntryReader reader{it->second.bytes};
+
+    size_t numParams, numInstructions, numCalls;
+    size_t maxCount = it->second.bytes.size(); // Bounds every count before anything is allocated for it
+    bool ok = reader.Read(proc.retType) && reader.Read(proc.isExtern) && reader.Read(proc.isPublic)
+        && reader.Read(proc.isInline) && reader.Read(proc.isInlinable)
+        && reader.Read(numParams) && numParams <= maxCount;
+    if (ok) proc.params.resize(numParams);
+    ok = ok && reader.ReadArray(proc.params.data(), numParams);
+
+    ok = ok && reader.Read(numInstructions) && numInstructions <= maxCount / sizeof(Instruction);
+    if (ok) proc.instructions.resize(numInstructions);
+    ok = ok && reader.ReadArray(proc.instructions.data(), numInstructions);
+    for (size_t i = 0; ok && i < numInstructions; ++i) {
+        ASTNode::StringView* text = InstructionText(proc.instructions[i]);
+        std::string_view stored;
+        if (text == nullptr) continue;
+        ok = reader.ReadText(stored);
+        if (!ok) break;
+        // Loaded text lives as long as the session, like the source it replaces
+        char* buf = ArenaAllocator<char>{}.allocate(std::max<size_t>(stored.size(), 1));
+        std::copy(stored.begin(), stored.end(), buf);
+        *text = { buf, stored.size() };
+    }
+
+    ok = ok && reader.Read(numCalls) && numCalls <= maxCount;
+    for (size_t i = 0; ok && i < numCalls; ++i) {
+        size_t jumpIdx;
+        std::string_view callee;
+        ok = reader.Read(jumpIdx) && reader.ReadText(callee) && jumpIdx < numInstructions;
+        SymbolId id = ok ? symbols.Find(callee) : SYMBOL_NONE;
+        ok = ok && id != SYMBOL_NONE;
+        if (ok) proc.calls.emplace_back(jumpIdx, id);
+    }
+
+    if (!ok || !reader.AtEnd()) {
+        proc.params.clear();
+        proc.instructions.clear();
+        proc.calls.clear();
+        ++numMisses;
+        return false;
+    }
+    it->second.isUsed.store(true, std::memory_order_relaxed);
+    ++numHits;
+    return true;
+}
+
+void ProcedureCache::Store(uint64_t key, const SymbolTable& symbols, const Procedure& proc) {
+    EntryWriter writer;
+    writer.Write(proc.retType);
+    writer.Write(proc.isExtern);
+    writer.Write(proc.isPublic);
+    writer.Write(proc.isInline);
+    writer.Write(proc.isInlinable);
+    writer.Write(proc.params.size());
+    writer.WriteArray(proc.params.data(), proc.params.size());
+    writer.Write(proc.instructions.size());
+    writer.WriteArray(proc.instructions.data(), proc.instructions.size());
+    for (Instruction ins : proc.instructions) {
+        if (const ASTNode::StringView* text = InstructionText(ins))
+            writer.WriteText({ text->buf, text->sz });
+    }
+    writer.Write(proc.calls.size());
+    for (auto [jumpIdx, callee] : proc.calls) {
+        writer.Write(jumpIdx);
+        writer.WriteText(symbols.Name(callee));
+    }
+
+    std::lock_guard lock{addedMutex};
+    addedEntries[key] = std::make_unique<std::string>(std::move(writer.bytes));
+}
+
+void ProcedureCache::Save() {
+    if (addedEntries.empty())
+        return;
+
+    EntryWriter writer;
+    writer.WriteText(PACK_MAGIC);
+    writer.Write(FORMAT_VERSION);
+    size_t numEntries = addedEntries.size();
+    for (const auto& [key, entry] : entries)
+        numEntries += entry.isUsed && !addedEntries.contains(key);
+    writer.Write(numEntries);
+    for (const auto& [key, entry] : entries) {
+        if (!entry.isUsed || addedEntries.contains(key)) continue;
+        writer.Write(key);
+        writer.WriteText(entry.bytes);
+    }
+    for (const auto& [key, bytes] : addedEntries) {
+        writer.Write(key);
+        writer.WriteText(*bytes);
+    }
+
+    // Renaming is atomic, concurrent compilations see either the old pack or the new one
+    std::string tmpPath = fmt::format("{}.{}.tmp", packPath, getpid());
+    std::ofstream stream{tmpPath, std::ios::out | std::ios::binary | std::ios::trunc};
+    stream.write(writer.bytes.data(), static_cast<std::streamsize>(writer.bytes.size()));
+    stream.close();
+    std::error_code ec;
+    if (stream)
+        std::filesystem::rename(tmpPath, packPath, ec);
+    if (!stream || ec)
+        std::filesystem::remove(tmpPath, ec);
+}
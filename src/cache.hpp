@@ -0,0 +1,92 @@
+#pragma once
+
+#include "analyzer.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <stdint.h>
+
+// Multiply and xorshift hash taking 8 bytes per step, used to key cache entries by content
+class ContentHash {
+    uint64_t state = 0xcbf29ce484222325;
+
+    void Mix(uint64_t word) {
+        state = (state ^ word) * 0x9e3779b97f4a7c15;
+        state ^= state >> 32;
+    }
+
+public:
+    void Add(const void* data, size_t size) {
+        const auto* bytes = static_cast<const unsigned char*>(data);
+        for (; size >= 8; bytes += 8, size -= 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes, 8);
+            Mix(word);
+        }
+        uint64_t tail = size;
+        for (size_t i = 0; i < size; ++i)
+            tail = (tail << 8) | bytes[i];
+        Mix(tail);
+    }
+
+    template<typename T>
+        requires std::is_trivially_copyable_v<T>
+    void Add(const T& value) { Add(&value, sizeof(value)); }
+
+    // The length goes first, so adjacent strings can't run into each other
+    void Add(std::string_view text) {
+        Add(text.size());
+        Add(text.data(), text.size());
+    }
+
+    [[nodiscard]] uint64_t Digest() const { return state; }
+};
+
+// Verified, unlinked procedures kept on disk between compilations, keyed by content.
+// The key must cover everything verification depends on (see VerifyAST),
+// so an entry is never invalidated, a changed procedure just gets a new key.
+// Each set of input files has one pack file in the directory, read once up front
+// and replaced (write to a temporary file, then rename) only when something was added.
+// The new pack only keeps the entries this compilation used, so stale ones don't pile up.
+class ProcedureCache {
+    struct Entry {
+        std::string_view bytes; // In the mapped pack
+        std::atomic<bool> isUsed;
+    };
+
+    std::string packPath;
+    std::string_view pack; // Mapped read only, empty if there is none
+    std::unordered_map<uint64_t, Entry> entries; // Only read once loaded, so lookups need no lock
+    std::mutex addedMutex;
+    std::unordered_map<uint64_t, std::unique_ptr<std::string>> addedEntries;
+    std::atomic<size_t> numHits{}, numMisses{};
+
+    void ReadPack();
+
+public:
+    // Part of every key, bump it whenever the entry layout or the meaning of the bytecode changes
+    static constexpr uint32_t FORMAT_VERSION = 6;
+
+    // Creates the directory if needed
+    ProcedureCache(const std::string& dir, std::span<const std::string> sourceFilenames);
+    ProcedureCache(const ProcedureCache&) = delete;
+    ProcedureCache& operator=(const ProcedureCache&) = delete;
+    ~ProcedureCache();
+
+    // Fills everything except procName and insStartIdx/insEndIdx, false if there is no (readable) entry.
+    // Callees are looked up by name in symbols.
+    bool Load(uint64_t key, const SymbolTable& symbols, Procedure& proc);
+    void Store(uint64_t key, const SymbolTable& symbols, const Procedure& proc);
+    // Failing to save is not an error, the procedures are verified again next time
+    void Save();
+
+    [[nodiscard]] size_t NumHits() const { return numHits; }
+    [[nodiscard]] size_t NumMisses() const { return numMisses; }
+};
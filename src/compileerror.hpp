@@ -1,6 +1,10 @@
 #pragma once
 
+#include <string>
 #include <string_view>
+#include <vector>
+#include <mutex>
+#include <stdint.h>
 #include <fmt/core.h>
 #include <fmt/color.h>
 
@@ -8,21 +12,35 @@ static bool IsNewline(char ch) {
     return ch == '\r' || ch == '\n';
 }
 
+struct FileLocation {
+    size_t line, col, idx;
+};
+
 struct File {
     std::string_view filename;
     std::string_view source;
+    // Offsets of the first character of every line, built the first time a location is needed
+    mutable std::vector<uint32_t> lineStarts;
 };
 
+// Recovers the (one based) line and column of a character offset in the file
+FileLocation LocateInFile(const File& file, size_t idx);
+
 
 // Convenient when "file" is local or member
 #define CompileErrorAt(token, format, ...) CompileErrorAtToken(file, token, format, __VA_ARGS__)
 
-#define CompileErrorAtToken(file, token, format, ...) CompileErrorAtLocation(*(token).file, (token).pos, format, __VA_ARGS__)
+#define CompileErrorAtToken(file, token, format, ...) CompileErrorAtOffset(*(token).file, (token).Offset(), format, __VA_ARGS__)
 
-#define CompileErrorAtLocation(file, pos, format, ...) do { \
-        fmt::print(stderr, "{}\n", CompileErrorMessage((file).filename, (pos).line, (pos).col, \
-            (file).source, (pos).idx, format __VA_OPT__(,) __VA_ARGS__)); \
-        exit(1); \
+// Worker threads may hit errors at the same time, only the first one gets to report and exit
+// While ThrowCompileErrors() is set the error is thrown instead (the offset is in the file of the error).
+// The line and column are only looked up when reporting (see ExitWithCompileError), one thread at a time,
+// since the line table of a file is built the first time it's needed.
+#define CompileErrorAtOffset(file, offset, format, ...) do { \
+        CompileError error_{ (offset), CompileErrorMessage_(format __VA_OPT__(,) __VA_ARGS__), &(file) }; \
+        if (ThrowCompileErrors()) \
+            throw error_; \
+        ExitWithCompileError(error_); \
     } while (0)
 
 #define CompileErrorMessage(filename, line, col, source, sourceIdx, format, ...) \
@@ -36,13 +54,41 @@ struct File {
         fmt::styled("^", fg(fmt::terminal_color::bright_green)), col \
     )
 
+struct CompileError {
+    size_t idx; // Character offset in the file
+    std::string message; // Without the location or the source line
+    const File* file = nullptr;
+};
+
+// Set on threads that must keep going after an error, like the language server's
+inline bool& ThrowCompileErrors() {
+    thread_local bool isThrowing = false;
+    return isThrowing;
+}
+
+inline std::mutex& CompileErrorMutex() {
+    static std::mutex* mutex = new std::mutex; // Never destroyed, it is still held while exiting
+    return *mutex;
+}
+
+// Makes errors on this thread throw for the lifetime of the scope, see ThrowCompileErrors()
+class ThrowCompileErrorsScope {
+    bool previous;
+
+public:
+    ThrowCompileErrorsScope() : previous{ThrowCompileErrors()} { ThrowCompileErrors() = true; }
+    ~ThrowCompileErrorsScope() { ThrowCompileErrors() = previous; }
+    ThrowCompileErrorsScope(const ThrowCompileErrorsScope&) = delete;
+    ThrowCompileErrorsScope& operator=(const ThrowCompileErrorsScope&) = delete;
+};
+
 static inline std::string_view ExtractWholeLine(std::string_view source, size_t sourceIdx) {
-    const auto *lineStart = source.begin() + sourceIdx - 1;
+    const auto *lineStart = source.begin() + sourceIdx;
     const auto *lineEnd = source.begin() + sourceIdx;
-    while (lineStart != source.begin() && !IsNewline(*lineStart)) {
+    // Never reads before the source, a mapped file may start at a page boundary
+    while (lineStart != source.begin() && !IsNewline(*(lineStart - 1))) {
         --lineStart;
     }
-    if (IsNewline(*lineStart)) ++lineStart;
     while (lineEnd != source.end() && !IsNewline(*lineEnd)) {
         ++lineEnd;
     }
@@ -53,3 +99,12 @@ template<typename S, typename... Args>
 std::string CompileErrorMessage_(const S& format, Args&&... args) {
     return fmt::vformat(format, fmt::make_format_args(args...));
 }
+
+// Reports the error with its line and column, and exits
+[[noreturn]] inline void ExitWithCompileError(const CompileError& error) {
+    CompileErrorMutex().lock();
+    FileLocation pos = LocateInFile(*error.file, error.idx);
+    fmt::print(stderr, "{}\n", CompileErrorMessage(error.file->filename, pos.line, pos.col,
+        error.file->source, pos.idx, "{}", error.message));
+    exit(1);
+}
@@ -5,11 +5,27 @@
 #include "parser.hpp"
 #include "interpreter.hpp"
 #include "generator.hpp"
+#include "parallel.hpp"
+#include "arena.hpp"
+#include "cache.hpp"
+#include "server.hpp"
+#include "timereport.hpp"
+#include "benchmark.hpp"
 
-#include <fstream>
 #include <vector>
 #include <string>
+#include <utility>
+#include <optional>
+#include <memory>
+#include <set>
+#include <filesystem>
+#include <iterator>
 #include <cassert>
+#include <charconv>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fmt/core.h>
 #include <fmt/os.h>
 
@@ -17,6 +33,15 @@
 struct CompilerOptions {
     std::vector<std::string> srcFn;
     std::string binFn;
+    std::string cacheDir; // Empty when not caching
+    std::string traceFn; // Empty when not tracing
+    std::string benchProc; // Empty when not benchmarking
+    size_t numThreads = 0; // 0 uses every hardware thread
+    bool arenaStats = false;
+    bool timeReport = false;
+    bool lazy = false;
+    bool stream = false;
+    bool languageServer = false;
     // ...
 };
 
@@ -25,7 +50,25 @@ static void PrintUsage() {
     fmt::print(stderr,
         "Usage: trashc [options]\n"
         "-i <files>   The name(s) of the input source file(s) to be compiled.\n"
+        "             Imported files that are not given are separate modules, only their public\n"
+        "             procedures can be called and they are linked in from their own output.\n"
         "-o <file>    The name of the compiled output binary file.\n"
+        "-j <n>       The maximum number of worker threads (defaults to all hardware threads).\n"
+        "-arena-stats Prints the memory used by each phase of compilation.\n"
+        "-time-report Prints the time and memory used by each phase of compilation.\n"
+        "-trace <file>\n"
+        "             Writes the phases, and the parsing, verification and codegen of each file\n"
+        "             and procedure on each thread, as a Chrome trace (see chrome://tracing).\n"
+        "-lazy        Only compiles procedures reachable from the first and public procedures,\n"
+        "             errors in the others are not reported.\n"
+        "-stream      Streams tokens to the parser, only keeping the ones the AST refers to.\n"
+        "             Ignored with -lazy or -cache, which need every token.\n"
+        "-cache <dir> Reuses procedures verified by earlier compilations from the directory,\n"
+        "             only those whose tokens or callee signatures changed are verified again.\n"
+        "-lsp         Runs a language server on stdin and stdout instead of compiling.\n"
+        "-bench <proc>\n"
+        "             Calls the procedure (which takes no parameters) over and over in the interpreter\n"
+        "             instead of running the program, and reports min, median and p99 time per call.\n"
         "-h           Displays this information\n"
     );
 }
@@ -34,7 +77,7 @@ static CompilerOptions ParseArguments(int argc, char** argv) {
     CompilerOptions opts{};
     std::vector<std::string> args(argv+1, argv+argc);
 
-    enum class Reading { None, Input, Output };
+    enum class Reading { None, Input, Output, Threads, Cache, Trace, Bench };
     Reading current = Reading::None;
 
     for (auto it = cbegin(args); it != cend(args); ++it) {
@@ -43,6 +86,21 @@ static CompilerOptions ParseArguments(int argc, char** argv) {
             PrintUsage();
             exit(0);
         }
+        else if (arg == "-arena-stats") {
+            opts.arenaStats = true;
+        }
+        else if (arg == "-time-report") {
+            opts.timeReport = true;
+        }
+        else if (arg == "-lazy") {
+            opts.lazy = true;
+        }
+        else if (arg == "-stream") {
+            opts.stream = true;
+        }
+        else if (arg == "-lsp") {
+            opts.languageServer = true;
+        }
         else if (arg == "-i") {
             current = Reading::Input;
             if (it+1 == cend(args)) {
@@ -57,12 +115,60 @@ static CompilerOptions ParseArguments(int argc, char** argv) {
                 exit(1);
             }
         }
+        else if (arg == "-j") {
+            current = Reading::Threads;
+            if (it+1 == cend(args)) {
+                PrintUsage();
+                exit(1);
+            }
+        }
+        else if (arg == "-cache") {
+            current = Reading::Cache;
+            if (it+1 == cend(args)) {
+                PrintUsage();
+                exit(1);
+            }
+        }
+        else if (arg == "-trace") {
+            current = Reading::Trace;
+            if (it+1 == cend(args)) {
+                PrintUsage();
+                exit(1);
+            }
+        }
+        else if (arg == "-bench") {
+            current = Reading::Bench;
+            if (it+1 == cend(args)) {
+                PrintUsage();
+                exit(1);
+            }
+        }
         else if (current == Reading::Input) {
             opts.srcFn.emplace_back(std::move(*it));
         }
         else if (current == Reading::Output) {
             opts.binFn = std::move(*it);
         }
+        else if (current == Reading::Threads) {
+            auto [ptr, err] = std::from_chars(arg.data(), arg.data() + arg.size(), opts.numThreads);
+            if (err != std::errc{} || ptr != arg.data() + arg.size()) {
+                PrintUsage();
+                exit(1);
+            }
+            current = Reading::None;
+        }
+        else if (current == Reading::Cache) {
+            opts.cacheDir = std::move(*it);
+            current = Reading::None;
+        }
+        else if (current == Reading::Trace) {
+            opts.traceFn = std::move(*it);
+            current = Reading::None;
+        }
+        else if (current == Reading::Bench) {
+            opts.benchProc = std::move(*it);
+            current = Reading::None;
+        }
         else {
             fmt::print("bad\n");
             PrintUsage();
@@ -70,7 +176,7 @@ static CompilerOptions ParseArguments(int argc, char** argv) {
         }
     }
 
-    if (opts.srcFn.empty()) {
+    if (opts.srcFn.empty() && !opts.languageServer) {
         PrintUsage();
         exit(1);
     }
@@ -78,47 +184,220 @@ static CompilerOptions ParseArguments(int argc, char** argv) {
     return opts;
 }
 
-static std::string ReadEntireFile(const std::string& filename) {
-    std::ifstream sourceStream{filename, std::ios::in | std::ios::binary | std::ios::ate};
-    if (!sourceStream) {
-        fmt::print(stderr, "Error: Could not open file \"{}\".\n", filename);
-        exit(1);
+// A source file mapped read only into memory, so the source is never copied.
+// Files that can't be mapped (pipes, empty files) are read into the arena instead.
+class SourceFile {
+    int fd{-1};
+    void* mapping{MAP_FAILED};
+    size_t size{};
+
+public:
+    explicit SourceFile(const std::string& filename) {
+        fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st{};
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            fmt::print(stderr, "Error: Could not open file \"{}\".\n", filename);
+            exit(1);
+        }
+        if (!S_ISREG(st.st_mode) || st.st_size == 0)
+            return;
+        size = static_cast<size_t>(st.st_size);
+        mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+            return;
+        // The tokenizer reads front to back, once
+        madvise(mapping, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+        close(fd);
+        fd = -1;
+    }
+    SourceFile(SourceFile&& other) noexcept
+        : fd{std::exchange(other.fd, -1)}
+        , mapping{std::exchange(other.mapping, MAP_FAILED)}
+        , size{std::exchange(other.size, 0)}
+    {}
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    SourceFile& operator=(SourceFile&&) = delete;
+    ~SourceFile() {
+        if (mapping != MAP_FAILED)
+            munmap(mapping, size);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // Known size of the file, 0 if it can only be found by reading it
+    [[nodiscard]] size_t Size() const { return size; }
+
+    // Valid as long as this and the arena are
+    std::string_view Contents(Arena& arena) {
+        if (mapping != MAP_FAILED)
+            return { static_cast<const char*>(mapping), size };
+
+        std::string buffer;
+        char chunk[64 * 1024];
+        ssize_t n;
+        while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+            buffer.append(chunk, static_cast<size_t>(n));
+        if (buffer.empty()) return "";
+        char* contents = static_cast<char*>(arena.Allocate(buffer.size(), 1));
+        std::copy(buffer.begin(), buffer.end(), contents);
+        return { contents, buffer.size() };
+    }
+};
+
+// A file that is imported but not compiled along, only the signatures of its public procedures are read
+struct ImportedModule {
+    std::string filename;
+    SourceFile sourceFile;
+    std::vector<File> files; // Just this one, the token list refers to it
+    TokenList tokens;
+    AST ast;
+
+    explicit ImportedModule(std::string filename_)
+        : filename{std::move(filename_)}
+        , sourceFile{filename}
+    {}
+};
+
+// Imported files that are compiled along are already part of the program.
+// The others are separate modules: calls into them are resolved when linking the objects,
+// so they can't be interpreted, and only their headers are parsed (bodies are deferred and never verified).
+static std::vector<std::unique_ptr<ImportedModule>> LoadImports(const TokenList& tokens, const AST& ast,
+    const std::vector<std::string>& srcFn, bool isInterpreting, Arena& arena)
+{
+    namespace fs = std::filesystem;
+    std::set<fs::path> loaded;
+    for (const std::string& fn : srcFn) {
+        std::error_code ec;
+        loaded.insert(fs::weakly_canonical(fn, ec));
     }
 
-    auto sz = static_cast<size_t>(sourceStream.tellg());
-    if (sz == 0) return "";
-    std::string contents;
-    contents.resize(sz);
-    sourceStream.seekg(0, std::ios::beg);
-    sourceStream.read(&contents[0], // NOLINT (.data() is const)
-        static_cast<long>(contents.size()));
-    sourceStream.close();
-    return contents;
+    std::vector<std::unique_ptr<ImportedModule>> modules;
+    for (ASTIndex importIdx : ast.GetList(ast.tree[0].program.imports)) {
+        const Token& pathTok = tokens[ast.tree[importIdx].tokenIdx];
+        // Relative to the importing file
+        fs::path path = fs::path{pathTok.file->filename}.parent_path() / pathTok.text;
+        std::error_code ec;
+        fs::path canonicalPath = fs::weakly_canonical(path, ec);
+        if (ec || !fs::is_regular_file(canonicalPath, ec))
+            CompileErrorAt(pathTok, "Could not open imported file \"{}\"", path.string());
+        if (!loaded.insert(canonicalPath).second)
+            continue;
+        if (isInterpreting)
+            CompileErrorAt(pathTok, "Imported file \"{}\" is compiled separately, it must be given with -i to be interpreted", path.string());
+
+        ImportedModule& module = *modules.emplace_back(std::make_unique<ImportedModule>(path.string()));
+        module.files.push_back(File{.filename=module.filename, .source=module.sourceFile.Contents(arena), .lineStarts={}});
+        module.ast = ParseEntireSource(module.files, module.tokens, ParseMode::DEFER_BODIES);
+    }
+    return modules;
+}
+
+// Rough number of bytes the frontend allocates per byte of source
+// (tokens, AST, analyzer tables and bytecode), used to size the first arena chunk
+static constexpr size_t ARENA_BYTES_PER_SOURCE_BYTE = 64;
+
+static void PrintArenaStats(const std::vector<std::pair<const char*, Arena::Stats>>& phases) {
+    fmt::print(stderr, "{:<10} {:>14} {:>12}\n", "phase", "bytes", "allocations");
+    Arena::Stats prev{};
+    for (const auto& [name, stats] : phases) {
+        fmt::print(stderr, "{:<10} {:>14} {:>12}\n", name,
+            stats.bytesUsed - prev.bytesUsed, stats.numAllocations - prev.numAllocations);
+        prev = stats;
+    }
+    fmt::print(stderr, "{:<10} {:>14} {:>12}\n", "total", prev.bytesUsed, prev.numAllocations);
+    fmt::print(stderr, "{} bytes reserved in {} chunks\n", prev.bytesReserved, prev.numChunks);
 }
 
 void CompilerMain(int argc, char** argv) {
     assert(argc > 0);
 
     CompilerOptions options{ParseArguments(argc, argv)};
+    MaxWorkerThreads() = options.numThreads;
+    if (options.languageServer) {
+        RunLanguageServer();
+        return;
+    }
 
-    std::vector<std::string> sources;
+    // Spans are only worth their cost when they are written out
+    std::optional<TimeReport> timeReport;
+    if (options.timeReport || !options.traceFn.empty())
+        timeReport.emplace();
+    if (!options.traceFn.empty())
+        TimeReport::Current() = &*timeReport;
+    auto EndPhase = [&](const char* name, Arena& arena) {
+        if (timeReport)
+            timeReport->EndPhase(name, arena);
+    };
+
+    std::vector<SourceFile> sourceFiles;
+    sourceFiles.reserve(options.srcFn.size());
     for (const auto& fn : options.srcFn)
-        sources.emplace_back(ReadEntireFile(fn));
+        sourceFiles.emplace_back(fn);
+
+    // Everything the frontend builds lives until the end of the session and is freed all at once
+    size_t totalSourceSize = 0;
+    for (const SourceFile& sourceFile : sourceFiles)
+        totalSourceSize += sourceFile.Size();
+    Arena arena{totalSourceSize * ARENA_BYTES_PER_SOURCE_BYTE};
+    ArenaScope arenaScope{&arena};
+    std::vector<std::pair<const char*, Arena::Stats>> phaseStats;
+
     std::vector<File> files;
-    for (size_t i = 0; i < sources.size(); ++i)
-         files.push_back(File{options.srcFn[i], sources[i]});
+    for (size_t i = 0; i < sourceFiles.size(); ++i) {
+        std::string_view source = sourceFiles[i].Contents(arena);
+        files.push_back(File{.filename=options.srcFn[i], .source=source, .lineStarts={}});
+    }
+    phaseStats.emplace_back("read", arena.GetStats());
+    EndPhase("read", arena);
+
+    TokenList tokens;
+    ParseMode parseMode = options.lazy ? ParseMode::DEFER_BODIES :
+        options.stream && options.cacheDir.empty() ? ParseMode::STREAM_TOKENS : ParseMode::EAGER;
+    AST ast = ParseEntireSource(files, tokens, parseMode);
+    EndPhase("parse", arena);
+    std::vector<std::unique_ptr<ImportedModule>> importedModules =
+        LoadImports(tokens, ast, options.srcFn, options.binFn.empty() || !options.benchProc.empty(), arena);
+    ArenaVector<ImportedProcedure> imports;
+    for (const auto& module : importedModules) {
+        ArenaVector<ImportedProcedure> interface = ModuleInterface(module->tokens, module->ast);
+        std::move(interface.begin(), interface.end(), std::back_inserter(imports));
+    }
+    phaseStats.emplace_back("parse", arena.GetStats());
+    EndPhase("imports", arena);
+    std::optional<ProcedureCache> cache;
+    if (!options.cacheDir.empty())
+        cache.emplace(options.cacheDir, options.srcFn);
+    std::vector<Procedure> procedures = VerifyAST(tokens, ast, options.lazy, cache ? &*cache : nullptr, imports);
+    if (cache)
+        cache->Save();
+    phaseStats.emplace_back("analyze", arena.GetStats());
+    EndPhase("analyze", arena);
 
-    std::vector<Token> tokens = TokenizeEntireSource(files);
-    AST ast = ParseEntireProgram(tokens);
-    std::vector<Procedure> procedures = VerifyAST(tokens, ast);
+    if (options.arenaStats)
+        PrintArenaStats(phaseStats);
 
-    if (options.binFn.empty()) {
+    if (!options.benchProc.empty()) {
+        BenchmarkProcedure(procedures, options.benchProc);
+        EndPhase("bench", arena);
+    }
+    else if (options.binFn.empty()) {
         InterpretInstructions(procedures);
+        EndPhase("interpret", arena);
     }
     else {
         fmt::ostream binFile = fmt::output_file(options.binFn);
         EmitInstructions(binFile, Target::X86_64_ELF, procedures);
         binFile.close();
+        EndPhase("emit", arena);
+    }
+
+    if (options.timeReport)
+        timeReport->PrintSummary();
+    if (!options.traceFn.empty()) {
+        TimeReport::Current() = nullptr;
+        if (!timeReport->WriteTrace(options.traceFn))
+            fmt::print(stderr, "Error: Could not write trace file \"{}\".\n", options.traceFn);
     }
 
     fmt::print(stderr, "DONE!\n");
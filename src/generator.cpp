@@ -2,14 +2,472 @@
 #include "bytecode.hpp"
 #include "compileerror.hpp"
 #include "interpreter.hpp"
+#include "parallel.hpp"
+#include "timereport.hpp"
 
 #include <cassert>
+#include <iterator>
+#include <set>
+#include <utility>
 #define DBG_INS 1
 
+// Text and literal pools of a run of consecutive procedures
+// Pool indices continue from the batches before, so batches can be formatted separately and concatenated in order
+struct AsmBatch {
+    fmt::memory_buffer text;
+    std::vector<std::string> stringLiteralPool;
+    std::vector<double> floatLiteralPool;
+    size_t stringPoolBase, floatPoolBase;
+
+    template<typename... Args>
+    void print(fmt::format_string<Args...> format, Args&&... args) {
+        fmt::format_to(std::back_inserter(text), format, std::forward<Args>(args)...);
+    }
+};
+
+static void CountLiterals(const Procedure& proc, size_t& numStrings, size_t& numFloats) {
+    for (const Instruction& ins : proc.instructions) {
+        if (ins.opcode != Instruction::Opcode::PUSH) continue;
+        if (ins.lit.kind == TypeKind::STR) ++numStrings;
+        else if (ins.lit.kind == TypeKind::F64) ++numFloats;
+    }
+}
+
+static void EmitProcedure(AsmBatch& out, const Procedure& proc) {
+    TraceSpan span{"codegen", proc.procName};
+    size_t ip = proc.insStartIdx;
+    out.print("trash_{}:\n", proc.procName);
+    const auto& instructions = proc.instructions;
+    for (size_t i = 0; i < instructions.size(); ++i, ++ip) {
+        out.print("INS_{}:\n", ip);
+        Instruction ins = instructions[i];
+
+        switch (ins.opcode) {
+            case Instruction::Opcode::INLINE: {
+#if DBG_INS
+                out.print("; INLINE ASM\n");
+#endif
+                out.print("{}\n", std::string_view{ins.str.buf, ins.str.sz});
+            } break;
+
+            case Instruction::Opcode::PUSH: {
+#if DBG_INS
+                if (ins.lit.kind == TypeKind::I64) out.print("; PUSH {}\n", ins.lit.i64);
+                else if (ins.lit.kind == TypeKind::F64) out.print("; PUSH {}\n", ins.lit.f64);
+                else if (ins.lit.kind == TypeKind::U8) out.print("; PUSH {}\n", (char)ins.lit.u8);
+                else if (ins.lit.kind == TypeKind::STR) out.print("; PUSH \"{}\"\n", std::string_view{ins.lit.str.buf, ins.lit.str.sz});
+                else assert(0);
+#endif
+                if (ins.lit.kind == TypeKind::I64) {
+                    // push only takes a sign extended 32 bit immediate
+                    auto x = static_cast<int64_t>(ins.lit.i64);
+                    if (x >= INT32_MIN && x <= INT32_MAX) { out.print("push {}\n", x); }
+                    else { out.print("mov rax, {}\npush rax\n", x); }
+                }
+                else if (ins.lit.kind == TypeKind::F64) {
+                    out.print("push QWORD [REL FLOAT_{}]\n", out.floatPoolBase + out.floatLiteralPool.size());
+                    out.floatLiteralPool.push_back(ins.lit.f64);
+                }
+                else if (ins.lit.kind == TypeKind::U8) { out.print("push {}\n", ins.lit.u8); }
+                else if (ins.lit.kind == TypeKind::STR) {
+                    size_t poolIdx = out.stringPoolBase + out.stringLiteralPool.size();
+                    out.stringLiteralPool.emplace_back(UnescapeString(ins.lit.str.buf, ins.lit.str.sz));
+                    out.print("lea rax, [REL STRING_{}]\n", poolIdx);
+                    out.print("push rax\n"); // TOP = x
+                }
+                else assert(0);
+            } break;
+
+            case Instruction::Opcode::LOAD_FAST: {
+#if DBG_INS
+                out.print("; LOAD_FAST {} ({})\n", ins.access.varAddr, ins.access.accessSize);
+#endif
+                out.print("xor eax, eax\n");
+                out.print("mov {}, {} [rbp-{}-8]\n", // rax = *x
+                          ins.access.accessSize == 8 ? "rax" :
+                          ins.access.accessSize == 4 ? "eax" :
+                          ins.access.accessSize == 2 ? "ax" : "al",
+                          ins.access.accessSize == 8 ? "QWORD" :
+                          ins.access.accessSize == 4 ? "DWORD" :
+                          ins.access.accessSize == 2 ? "WORD" : "BYTE",
+                          ins.access.varAddr*8);
+                out.print("push rax\n"); // TOP = *x
+            } break;
+
+            case Instruction::Opcode::STORE: {
+#if DBG_INS
+                out.print("; STORE ({})\n", ins.access.accessSize);
+#endif
+                out.print("pop rax\n"); // TOP
+                out.print("pop rbx\n"); // TOP1
+                out.print("mov {} [rax], {}\n", // *TOP = TOP1
+                          ins.access.accessSize == 8 ? "QWORD" :
+                          ins.access.accessSize == 4 ? "DWORD" :
+                          ins.access.accessSize == 2 ? "WORD" : "BYTE",
+                          ins.access.accessSize == 8 ? "rbx" :
+                          ins.access.accessSize == 4 ? "ebx" :
+                          ins.access.accessSize == 2 ? "bx" : "bl");
+            } break;
+
+            case Instruction::Opcode::STORE_FAST: {
+#if DBG_INS
+                out.print("; STORE_FAST {} ({})\n", ins.access.varAddr, ins.access.accessSize);
+#endif
+                out.print("pop rax\n"); // TOP
+                out.print("mov {} [rbp-{}-8], {}\n", // *x = TOP
+                          ins.access.accessSize == 8 ? "QWORD" :
+                          ins.access.accessSize == 4 ? "DWORD" :
+                          ins.access.accessSize == 2 ? "WORD" : "BYTE",
+                          ins.access.varAddr*8,
+                          ins.access.accessSize == 8 ? "rax" :
+                          ins.access.accessSize == 4 ? "eax" :
+                          ins.access.accessSize == 2 ? "ax" : "al");
+            } break;
+
+            case Instruction::Opcode::ALLOCA: {
+#if DBG_INS
+                out.print("; ALLOCA {}\n", ins.access.varAddr);
+#endif
+                out.print("pop rax\n"); // TOP
+                out.print("mov QWORD [rbp-{}*8-8], rsp\n", // *x = addr
+                          ins.access.varAddr);
+                out.print("sub QWORD [rbp-{}*8-8], rax\n",
+                          ins.access.varAddr);
+                out.print("sub rsp, rax\n"); // sp = alloca(TOP)
+                out.print("sub rsp, 7\n");
+                out.print("mov rax, 0xFFFFFFFFFFFFFFF8\n");
+                out.print("and rsp, rax\n");
+            } break;
+
+            case Instruction::Opcode::DEREF: {
+#if DBG_INS
+                out.print("; DEREF ({})\n", ins.access.accessSize);
+#endif
+                out.print("pop rax\n"); // TOP
+                out.print("xor ebx, ebx\n");
+                out.print("mov {}, {} [rax]\n", // TOP = *TOP1
+                          ins.access.accessSize == 8 ? "rbx" :
+                          ins.access.accessSize == 4 ? "ebx" :
+                          ins.access.accessSize == 2 ? "bx" : "bl",
+                          ins.access.accessSize == 8 ? "QWORD" :
+                          ins.access.accessSize == 4 ? "DWORD" :
+                          ins.access.accessSize == 2 ? "WORD" : "BYTE");
+                out.print("push rbx\n");
+            } break;
+
+            case Instruction::Opcode::UNARY_OP: {
+#if DBG_INS
+                if (ins.op.op_kind == ASTKind::NEG_UNARYOP_EXPR) out.print("; UNOP (NEG {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::NOT_UNARYOP_EXPR) out.print("; UNOP (NOT {})\n", TypeKindName(ins.op.kind));
+                else assert(0);
+#endif
+                if (ins.op.kind == TypeKind::I64 || ins.op.kind == TypeKind::U8) {
+                    out.print("pop rax\n");
+                    if (ins.op.op_kind == ASTKind::NEG_UNARYOP_EXPR) {
+                        out.print("neg rax\n");
+                    }
+                    else if (ins.op.op_kind == ASTKind::NOT_UNARYOP_EXPR) {
+                        out.print("cmp rax, 0\n");
+                        out.print("sete al\n");
+                        out.print("movzx eax, al\n"); // Is this necessary?
+                    }
+                    else assert(0);
+                    out.print("push rax\n");
+                }
+                else if (ins.op.kind == TypeKind::F64) {
+                    if (ins.op.op_kind == ASTKind::NEG_UNARYOP_EXPR) {
+                        out.print("movsd xmm0, [rsp]\n");
+                        out.print("movsd xmm1, QWORD [REL DOUBLE_FLOAT_XOR]\n");
+                        out.print("xorpd xmm0, xmm1\n");
+                        out.print("movsd [rsp], xmm0\n");
+                    }
+                    else assert(0);
+                }
+                else assert(0);
+            } break;
+
+            case Instruction::Opcode::BINARY_OP: {
+#if DBG_INS
+                if (ins.op.op_kind == ASTKind::EQ_BINARYOP_EXPR) out.print("; BINOP (EQ {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::NE_BINARYOP_EXPR) out.print("; BINOP (NE {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::GE_BINARYOP_EXPR) out.print("; BINOP (GE {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::GT_BINARYOP_EXPR) out.print("; BINOP (GT {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::LE_BINARYOP_EXPR) out.print("; BINOP (LE {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::LT_BINARYOP_EXPR) out.print("; BINOP (LT {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::AND_BINARYOP_EXPR) out.print("; BINOP (AND {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::OR_BINARYOP_EXPR) out.print("; BINOP (OR {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::ADD_BINARYOP_EXPR) out.print("; BINOP (ADD {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::SUB_BINARYOP_EXPR) out.print("; BINOP (SUB {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::MUL_BINARYOP_EXPR) out.print("; BINOP (MUL {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::DIV_BINARYOP_EXPR) out.print("; BINOP (DIV {})\n", TypeKindName(ins.op.kind));
+                else if (ins.op.op_kind == ASTKind::MOD_BINARYOP_EXPR) out.print("; BINOP (MOD {})\n", TypeKindName(ins.op.kind));
+                else assert(0);
+#endif
+                if (ins.op.kind == TypeKind::I64 || ins.op.kind == TypeKind::U8) {
+                    out.print("pop rbx\n"); // TOP
+                    out.print("pop rax\n"); // TOP1
+
+                    switch (ins.op.op_kind) {
+                        case ASTKind::ADD_BINARYOP_EXPR: { out.print("add rax, rbx\n"); } break;
+                        case ASTKind::SUB_BINARYOP_EXPR: { out.print("sub rax, rbx\n"); } break;
+                        case ASTKind::MUL_BINARYOP_EXPR: { out.print("imul rax, rbx\n"); } break;
+                        case ASTKind::DIV_BINARYOP_EXPR:
+                        case ASTKind::MOD_BINARYOP_EXPR: {
+                            out.print("cqo\n");
+                            out.print("idiv rbx\n");
+                            if (ins.op.op_kind == ASTKind::MOD_BINARYOP_EXPR) {
+                                out.print("mov rax, rdx\n");
+                            }
+                        } break;
+                        case ASTKind::AND_BINARYOP_EXPR: {
+                            out.print("cmp rax, 0\n");
+                            out.print("setne al\n");
+                            out.print("cmp rbx, 0\n");
+                            out.print("setne bl\n");
+                            out.print("and rax, rbx\n");
+                        } break;
+                        case ASTKind::OR_BINARYOP_EXPR: {
+                            out.print("or rax, rbx\n");
+                            out.print("setne al\n");
+                            out.print("movzx eax, al\n");
+                        } break;
+                        case ASTKind::EQ_BINARYOP_EXPR:
+                        case ASTKind::NE_BINARYOP_EXPR:
+                        case ASTKind::GE_BINARYOP_EXPR:
+                        case ASTKind::GT_BINARYOP_EXPR:
+                        case ASTKind::LE_BINARYOP_EXPR:
+                        case ASTKind::LT_BINARYOP_EXPR: {
+                            out.print("cmp rax, rbx\n");
+                            switch (ins.op.op_kind) {
+                                case ASTKind::EQ_BINARYOP_EXPR: out.print("sete al\n"); break;
+                                case ASTKind::NE_BINARYOP_EXPR: out.print("setne al\n"); break;
+                                case ASTKind::GE_BINARYOP_EXPR: out.print("setge al\n"); break;
+                                case ASTKind::GT_BINARYOP_EXPR: out.print("setg al\n"); break;
+                                case ASTKind::LE_BINARYOP_EXPR: out.print("setle al\n"); break;
+                                case ASTKind::LT_BINARYOP_EXPR: out.print("setl al\n"); break;
+                                default: assert(0);
+                            }
+                            out.print("movzx eax, al\n");
+                        } break;
+
+                        default: assert(0);
+                    }
+
+                    out.print("push rax\n");
+                }
+                else if (ins.op.kind == TypeKind::F64) {
+                    switch (ins.op.op_kind) {
+                        case ASTKind::ADD_BINARYOP_EXPR: {
+                            out.print("movsd xmm1, [rsp]\n");   // TOP
+                            out.print("movsd xmm0, [rsp+8]\n"); // TOP1
+                            out.print("addsd xmm0, xmm1\n");
+                            out.print("add rsp, 8\n");
+                            out.print("movq [rsp], xmm0\n");
+                        } break;
+                        case ASTKind::SUB_BINARYOP_EXPR: {
+                            out.print("movsd xmm1, [rsp]\n");   // TOP
+                            out.print("movsd xmm0, [rsp+8]\n"); // TOP1
+                            out.print("subsd xmm0, xmm1\n");
+                            out.print("add rsp, 8\n");
+                            out.print("movq [rsp], xmm0\n");
+                        } break;
+                        case ASTKind::MUL_BINARYOP_EXPR: {
+                            out.print("movsd xmm1, [rsp]\n");   // TOP
+                            out.print("movsd xmm0, [rsp+8]\n"); // TOP1
+                            out.print("mulsd xmm0, xmm1\n");
+                            out.print("add rsp, 8\n");
+                            out.print("movq [rsp], xmm0\n");
+                        } break;
+                        case ASTKind::DIV_BINARYOP_EXPR: {
+                            out.print("movsd xmm1, [rsp]\n");   // TOP
+                            out.print("movsd xmm0, [rsp+8]\n"); // TOP1
+                            out.print("divsd xmm0, xmm1\n");
+                            out.print("add rsp, 8\n");
+                            out.print("movq [rsp], xmm0\n");
+                        } break;
+                        case ASTKind::MOD_BINARYOP_EXPR: {
+                            out.print("movsd xmm1, [rsp]\n");   // TOP
+                            out.print("movsd xmm0, [rsp+8]\n"); // TOP1
+                            out.print("fld QWORD [rsp+8]\n"
+                                      "fld QWORD [rsp]\n"
+                                      "fxch st1\n"
+                                      ".fmod_loop:\n"
+                                      "fprem\n"
+                                      "fnstsw  ax\n"
+                                      "sahf\n"
+                                      "jp .fmod_loop\n"
+                                      "fstp st1\n"
+                                      "fstp QWORD [rsp-8]\n"
+                                      "movsd xmm0, QWORD [rsp-8]\n"
+                                      );
+                            out.print("add rsp, 8\n");
+                            out.print("movq [rsp], xmm0\n");
+                        } break;
+                        case ASTKind::AND_BINARYOP_EXPR:
+                        case ASTKind::OR_BINARYOP_EXPR: {
+                            out.print("xorpd xmm0, xmm0\n");
+                            out.print("ucomisd xmm0, [rsp]\n"); // TOP
+                            out.print("setne al\n");
+                            out.print("xorpd xmm0, xmm0\n"); // Necessary?
+                            out.print("ucomisd xmm0, [rsp+8]\n"); // TOP1
+                            out.print("setne cl\n");
+                            if (ins.op.op_kind == ASTKind::AND_BINARYOP_EXPR) {
+                                out.print("and cl, al\n");
+                            }
+                            else {
+                                out.print("or cl, al\n");
+                            }
+                            out.print("movzx eax, cl\n");
+                            out.print("add rsp, 16\n");
+                            out.print("push rax\n");
+                        } break;
+                        case ASTKind::EQ_BINARYOP_EXPR:
+                        case ASTKind::NE_BINARYOP_EXPR:
+                        case ASTKind::GE_BINARYOP_EXPR:
+                        case ASTKind::GT_BINARYOP_EXPR:
+                        case ASTKind::LE_BINARYOP_EXPR:
+                        case ASTKind::LT_BINARYOP_EXPR: {
+                            if (ins.op.op_kind == ASTKind::LE_BINARYOP_EXPR ||
+                                ins.op.op_kind == ASTKind::LT_BINARYOP_EXPR)
+                            {
+                                // swap regs
+                                out.print("movsd xmm0, [rsp]\n");
+                                out.print("xor eax, eax\n");
+                                out.print("comisd xmm0, [rsp+8]\n");
+                            }
+                            else {
+                                out.print("movsd xmm0, [rsp+8]\n");
+                                out.print("xor eax, eax\n");
+                                out.print("comisd xmm0, [rsp]\n");
+                            }
+                            switch (ins.op.op_kind) {
+                                case ASTKind::EQ_BINARYOP_EXPR: out.print("sete al\n"); break;
+                                case ASTKind::NE_BINARYOP_EXPR: out.print("setne al\n"); break;
+                                case ASTKind::GE_BINARYOP_EXPR:
+                                case ASTKind::GT_BINARYOP_EXPR:
+                                case ASTKind::LE_BINARYOP_EXPR: out.print("setnb al\n"); break;
+                                case ASTKind::LT_BINARYOP_EXPR: out.print("seta al\n"); break;
+                                default: assert(0);
+                            }
+
+                            out.print("movzx eax, al\n");
+                            out.print("add rsp, 16\n");
+                            out.print("push rax\n");
+                        } break;
+
+                        default: assert(0);
+                    }
+                }
+                else assert(0);
+            } break;
+
+            case Instruction::Opcode::CALL: {
+                std::string_view sv{ins.str.buf, ins.str.sz};
+#if DBG_INS
+                out.print("; CALL EXTERN {}\n", sv);
+#endif
+                out.print("jmp extern_{}\n", sv);
+            } break;
+
+            case Instruction::Opcode::CALL_IMPORTED: {
+                std::string_view sv{ins.str.buf, ins.str.sz};
+#if DBG_INS
+                out.print("; CALL IMPORTED {}\n", sv);
+#endif
+                out.print("jmp trash_{}\n", sv); // Exported by the module that defines it
+            } break;
+
+            case Instruction::Opcode::JMP: {
+                if (IS_BUILTIN(ins.jmpAddr)) {
+#if DBG_INS
+                    out.print("; CALL {}\n", (int64_t) ins.jmpAddr);
+#endif
+                    if (ins.jmpAddr == BUILTIN_putf) out.print("jmp BUILTIN_putf\n");
+                    else if (ins.jmpAddr == BUILTIN_puti) out.print("jmp BUILTIN_puti\n");
+                    else if (ins.jmpAddr == BUILTIN_puts) out.print("jmp BUILTIN_puts\n");
+                    else if (ins.jmpAddr == BUILTIN_itoc) out.print("jmp BUILTIN_itoc\n");
+                    else if (ins.jmpAddr == BUILTIN_ctoi) out.print("jmp BUILTIN_ctoi\n");
+                    else if (ins.jmpAddr == BUILTIN_itof) out.print("jmp BUILTIN_itof\n");
+                    else if (ins.jmpAddr == BUILTIN_ftoi) out.print("jmp BUILTIN_ftoi\n");
+                    else if (ins.jmpAddr == BUILTIN_sqrt) out.print("jmp BUILTIN_sqrt\n");
+                    else if (ins.jmpAddr == BUILTIN_clock_ns) out.print("jmp BUILTIN_clock_ns\n");
+                    else if (ins.jmpAddr == BUILTIN_rdtsc) out.print("jmp BUILTIN_rdtsc\n");
+                    else {
+                        fmt::print(stderr, "{}\n", (int64_t) ins.jmpAddr);
+                        assert(0);
+                    }
+                }
+                else {
+#if DBG_INS
+                    out.print("; JMP {}\n", ins.jmpAddr);
+#endif
+                    out.print("jmp INS_{}\n", ins.jmpAddr); // ip = x
+                }
+            } break;
+
+            case Instruction::Opcode::JMP_Z: {
+#if DBG_INS
+                out.print("; JMP_Z {}\n", ins.jmpAddr);
+#endif
+                out.print("pop rax\n");
+                out.print("cmp {}, 0\n",
+                          ins.access.accessSize == 8 ? "rax" :
+                          ins.access.accessSize == 4 ? "eax" :
+                          ins.access.accessSize == 2 ? "ax" : "al");
+                out.print("je INS_{}\n", ins.jmpAddr); // if TOP == 0: ip = x
+            } break;
+
+            case Instruction::Opcode::SAVE: {
+#if DBG_INS
+                out.print("; SAVE {}\n", ins.jmpAddr);
+#endif
+                out.print("lea rax, [REL INS_{}]\n", ins.jmpAddr);
+                out.print("push rax\n");
+                out.print("push rbp\n");
+            } break;
+
+            case Instruction::Opcode::ENTER: {
+#if DBG_INS
+                out.print("; ENTER {} {}\n", ins.frame.numParams, ins.frame.numLocals);
+#endif
+                out.print("mov rbp, rsp\n");
+                out.print("add rbp, {}\n", ins.frame.numParams*8); // bp = sp - x
+                out.print("sub rsp, {}\n", ins.frame.numLocals*8); // sp += y
+            } break;
+
+            case Instruction::Opcode::RETURN_VOID: {
+#if DBG_INS
+                out.print("; RETURN_VOID\n");
+#endif
+                out.print("mov rsp, rbp\n"); // sp = bp
+                out.print("pop rbp\n"); // bp = TOP
+                out.print("ret\n"); // jmp TOP
+            } break;
+
+            case Instruction::Opcode::RETURN_VAL: {
+#if DBG_INS
+                out.print("; RETURN_VAL\n");
+#endif
+                out.print("pop rax\n"); // retval = TOP
+                out.print("mov rsp, rbp\n"); // sp = bp
+                out.print("pop rbp\n"); // bp = TOP
+                out.print("push rax\n"); // TOP = retval
+                // swap retval and return addr
+                out.print("pop rax\n");
+                out.print("pop rbx\n");
+                out.print("push rax\n");
+                out.print("push rbx\n");
+
+                out.print("ret\n"); // jmp TOP
+            } break;
+
+            default: break;
+        }
+    }
+}
+
 void EmitInstructions(fmt::ostream& out, Target target, const std::vector<Procedure>& procedures) {
     if (target == Target::X86_64_ELF) {
-        std::vector<std::string> stringLiteralPool;
-        std::vector<double> floatLiteralPool;
         // std::vector<uint16_t> ehdr = {
         //     0x7f45, 0x4c46, 0x0201, 0x0100, 0x0000, 0x0000, 0x0000, 0x0000,
         //     0x0100, 0x3e00, 0x0100, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
@@ -23,23 +481,32 @@ void EmitInstructions(fmt::ostream& out, Target target, const std::vector<Proced
             "section .text\n"
         );
         for (const auto& proc : procedures) {
-            if (proc.procInfo.isPublic) {
+            if (proc.isPublic) {
                 out.print("global {}\n", proc.procName); // sysv abi
                 out.print("global trash_{}\n", proc.procName);
             }
-            else if (proc.procInfo.isExtern) {
+            else if (proc.isExtern) {
                 out.print("extern {}\n", proc.procName);
             }
         }
+        std::set<std::string_view> importedProcs;
         for (const auto& proc : procedures) {
-            if (proc.procInfo.isPublic) {
+            for (const Instruction& ins : proc.instructions) {
+                if (ins.opcode == Instruction::Opcode::CALL_IMPORTED)
+                    importedProcs.emplace(ins.str.buf, ins.str.sz);
+            }
+        }
+        for (std::string_view name : importedProcs)
+            out.print("extern trash_{}\n", name);
+        for (const auto& proc : procedures) {
+            if (proc.isPublic) {
                 out.print("{}:\n", proc.procName);
                 out.print("push rbp\n");
                 size_t numInts = 0;
                 size_t numFloats = 0;
-                for (ASTNode::ASTDefinition param : proc.params) {
-                    TypeKind kind = param.type;
-                    bool isPointer = param.arraySize != 0;
+                for (Type param : proc.params) {
+                    TypeKind kind = param.kind;
+                    bool isPointer = !param.isScalar;
                     if (isPointer || kind == TypeKind::I64 || kind == TypeKind::U8) {
                         switch (numInts++) {
                             case 0: out.print("push rdi\n"); break;
@@ -68,17 +535,17 @@ void EmitInstructions(fmt::ostream& out, Target target, const std::vector<Proced
                     else assert(0);
                 }
                 out.print("jmp trash_{}\n", proc.procName);
-                if (proc.procInfo.retType != TypeKind::NONE) {
+                if (proc.retType != TypeKind::NONE) {
                     out.print("pop rax\n", proc.procName);
                 }
             }
-            else if (proc.procInfo.isExtern) {
+            else if (proc.isExtern) {
                 out.print("extern_{}:\n", proc.procName);
                 size_t numInts = 0;
                 size_t numFloats = 0;
-                for (ASTNode::ASTDefinition param : proc.params) {
-                    TypeKind kind = param.type;
-                    bool isPointer = param.arraySize != 0;
+                for (Type param : proc.params) {
+                    TypeKind kind = param.kind;
+                    bool isPointer = !param.isScalar;
                     if (isPointer || kind == TypeKind::I64 || kind == TypeKind::U8) {
                         ++numInts;
                     }
@@ -87,9 +554,9 @@ void EmitInstructions(fmt::ostream& out, Target target, const std::vector<Proced
                     }
                 }
                 for (size_t i = proc.params.size(); i-- > 0;) {
-                    ASTNode::ASTDefinition param = proc.params[i];
-                    TypeKind kind = param.type;
-                    bool isPointer = param.arraySize != 0;
+                    Type param = proc.params[i];
+                    TypeKind kind = param.kind;
+                    bool isPointer = !param.isScalar;
                     if (isPointer || kind == TypeKind::I64 || kind == TypeKind::U8) {
                         switch (--numInts) {
                             case 0: out.print("pop rdi\n"); break;
@@ -121,7 +588,7 @@ void EmitInstructions(fmt::ostream& out, Target target, const std::vector<Proced
                           "call {}\n",
                           proc.procName);
 
-                if (proc.procInfo.retType == TypeKind::NONE) {
+                if (proc.retType == TypeKind::NONE) {
                     out.print("mov rsp, rbp\n"
                               "pop rbp\n"
                               "ret\n");
@@ -232,6 +699,35 @@ void EmitInstructions(fmt::ostream& out, Target target, const std::vector<Proced
                   "push rbx\n"
                   "ret\n"
         );
+        // Nothing to pop, the frame is just the saved bp and return address
+        out.print("BUILTIN_clock_ns:\n"
+                  "mov rbp, rsp\n"
+                  "sub rsp, 16\n"
+                  "mov eax, 228\n" // sys_clock_gettime
+                  "mov edi, 1\n" // CLOCK_MONOTONIC
+                  "mov rsi, rsp\n"
+                  "syscall\n"
+                  "imul rax, [rsp], 1000000000\n"
+                  "add rax, [rsp+8]\n"
+                  "mov rsp, rbp\n"
+                  "pop rbp\n"
+                  "pop rbx\n"
+                  "push rax\n"
+                  "push rbx\n"
+                  "ret\n"
+        );
+        out.print("BUILTIN_rdtsc:\n"
+                  "mov rbp, rsp\n"
+                  "rdtsc\n"
+                  "shl rdx, 32\n"
+                  "or rax, rdx\n"
+                  "mov rsp, rbp\n"
+                  "pop rbp\n"
+                  "pop rbx\n"
+                  "push rax\n"
+                  "push rbx\n"
+                  "ret\n"
+        );
         // out.print("putss:\n  mov rdx, rsi\n  mov rsi, rdi\n  mov eax, 1\n  mov edi, 1\n  syscall\n  ret\n");
         out.print("putcs:\n  mov rsi, rdi\n  mov rdx, -1\n.putcs_loop:\n  cmp BYTE [rsi+rdx+1], 0\n  lea rdx, [rdx+1]\n  jne .putcs_loop\n  mov eax, 1\n  mov edi, 1\n  syscall\n  ret\n");
         // out.print("putc:\n  push rdi\n  mov rax, 1 ; sys_write\n  mov rdi, 1 ; stdout\n  lea rsi, [rsp]\n  mov rdx, 1\n  syscall\n  pop rax\n  ret\n");
@@ -240,422 +736,37 @@ void EmitInstructions(fmt::ostream& out, Target target, const std::vector<Proced
         // out.print("memcp:\n  test rdx, rdx\n  je .memcp_done\n  mov eax, 0\n.memcp_loop:\n  movzx ecx, BYTE [rsi+rax]\n  mov BYTE [rdi+rax], cl\n  add rax, 1\n  cmp rdx, rax\n  jne .memcp_loop\n.memcp_done:\n  ret\n");
 
 
-        size_t ip = 0;
-        for (const auto& proc : procedures) {
-            out.print("trash_{}:\n", proc.procName);
-            const auto& instructions = proc.instructions;
-            for (size_t i = 0; i < instructions.size(); ++i, ++ip) {
-                out.print("INS_{}:\n", ip);
-                Instruction ins = instructions[i];
-
-                switch (ins.opcode) {
-                    case Instruction::Opcode::INLINE: {
-#if DBG_INS
-                        out.print("; INLINE ASM\n");
-#endif
-                        out.print("{}\n", std::string_view{ins.str.buf, ins.str.sz});
-                    } break;
-
-                    case Instruction::Opcode::PUSH: {
-#if DBG_INS
-                        if (ins.lit.kind == TypeKind::I64) out.print("; PUSH {}\n", ins.lit.i64);
-                        else if (ins.lit.kind == TypeKind::F64) out.print("; PUSH {}\n", ins.lit.f64);
-                        else if (ins.lit.kind == TypeKind::U8) out.print("; PUSH {}\n", (char)ins.lit.u8);
-                        else if (ins.lit.kind == TypeKind::STR) out.print("; PUSH \"{}\"\n", std::string_view{ins.lit.str.buf, ins.lit.str.sz});
-                        else assert(0);
-#endif
-                        if (ins.lit.kind == TypeKind::I64) { out.print("push {}\n", ins.lit.i64); }
-                        else if (ins.lit.kind == TypeKind::F64) {
-                            out.print("push QWORD [REL FLOAT_{}]\n", floatLiteralPool.size());
-                            floatLiteralPool.push_back(ins.lit.f64);
-                        }
-                        else if (ins.lit.kind == TypeKind::U8) { out.print("push {}\n", ins.lit.u8); }
-                        else if (ins.lit.kind == TypeKind::STR) {
-                            int64_t poolIdx = stringLiteralPool.size();
-                            stringLiteralPool.emplace_back(UnescapeString(ins.lit.str.buf, ins.lit.str.sz));
-                            out.print("lea rax, [REL STRING_{}]\n", poolIdx);
-                            out.print("push rax\n"); // TOP = x
-                        }
-                        else assert(0);
-                    } break;
-
-                    case Instruction::Opcode::LOAD_FAST: {
-#if DBG_INS
-                        out.print("; LOAD_FAST {} ({})\n", ins.access.varAddr, ins.access.accessSize);
-#endif
-                        out.print("xor eax, eax\n");
-                        out.print("mov {}, {} [rbp-{}-8]\n", // rax = *x
-                                  ins.access.accessSize == 8 ? "rax" :
-                                  ins.access.accessSize == 4 ? "eax" :
-                                  ins.access.accessSize == 2 ? "ax" : "al",
-                                  ins.access.accessSize == 8 ? "QWORD" :
-                                  ins.access.accessSize == 4 ? "DWORD" :
-                                  ins.access.accessSize == 2 ? "WORD" : "BYTE",
-                                  ins.access.varAddr*8);
-                        out.print("push rax\n"); // TOP = *x
-                    } break;
-
-                    case Instruction::Opcode::STORE: {
-#if DBG_INS
-                        out.print("; STORE ({})\n", ins.access.accessSize);
-#endif
-                        out.print("pop rax\n"); // TOP
-                        out.print("pop rbx\n"); // TOP1
-                        out.print("mov {} [rax], {}\n", // *TOP = TOP1
-                                  ins.access.accessSize == 8 ? "QWORD" :
-                                  ins.access.accessSize == 4 ? "DWORD" :
-                                  ins.access.accessSize == 2 ? "WORD" : "BYTE",
-                                  ins.access.accessSize == 8 ? "rbx" :
-                                  ins.access.accessSize == 4 ? "ebx" :
-                                  ins.access.accessSize == 2 ? "bx" : "bl");
-                    } break;
-
-                    case Instruction::Opcode::STORE_FAST: {
-#if DBG_INS
-                        out.print("; STORE_FAST {} ({})\n", ins.access.varAddr, ins.access.accessSize);
-#endif
-                        out.print("pop rax\n"); // TOP
-                        out.print("mov {} [rbp-{}-8], {}\n", // *x = TOP
-                                  ins.access.accessSize == 8 ? "QWORD" :
-                                  ins.access.accessSize == 4 ? "DWORD" :
-                                  ins.access.accessSize == 2 ? "WORD" : "BYTE",
-                                  ins.access.varAddr*8,
-                                  ins.access.accessSize == 8 ? "rax" :
-                                  ins.access.accessSize == 4 ? "eax" :
-                                  ins.access.accessSize == 2 ? "ax" : "al");
-                    } break;
-
-                    case Instruction::Opcode::ALLOCA: {
-#if DBG_INS
-                        out.print("; ALLOCA {}\n", ins.access.varAddr);
-#endif
-                        out.print("pop rax\n"); // TOP
-                        out.print("mov QWORD [rbp-{}*8-8], rsp\n", // *x = addr
-                                  ins.access.varAddr);
-                        out.print("sub QWORD [rbp-{}*8-8], rax\n",
-                                  ins.access.varAddr);
-                        out.print("sub rsp, rax\n"); // sp = alloca(TOP)
-                        out.print("sub rsp, 7\n");
-                        out.print("mov rax, 0xFFFFFFFFFFFFFFF8\n");
-                        out.print("and rsp, rax\n");
-                    } break;
-
-                    case Instruction::Opcode::DEREF: {
-#if DBG_INS
-                        out.print("; DEREF ({})\n", ins.access.accessSize);
-#endif
-                        out.print("pop rax\n"); // TOP
-                        out.print("xor ebx, ebx\n");
-                        out.print("mov {}, {} [rax]\n", // TOP = *TOP1
-                                  ins.access.accessSize == 8 ? "rbx" :
-                                  ins.access.accessSize == 4 ? "ebx" :
-                                  ins.access.accessSize == 2 ? "bx" : "bl",
-                                  ins.access.accessSize == 8 ? "QWORD" :
-                                  ins.access.accessSize == 4 ? "DWORD" :
-                                  ins.access.accessSize == 2 ? "WORD" : "BYTE");
-                        out.print("push rbx\n");
-                    } break;
-
-                    case Instruction::Opcode::UNARY_OP: {
-#if DBG_INS
-                        if (ins.op.op_kind == ASTKind::NEG_UNARYOP_EXPR) out.print("; UNOP (NEG {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::NOT_UNARYOP_EXPR) out.print("; UNOP (NOT {})\n", TypeKindName(ins.op.kind));
-                        else assert(0);
-#endif
-                        if (ins.op.kind == TypeKind::I64 || ins.op.kind == TypeKind::U8) {
-                            out.print("pop rax\n");
-                            if (ins.op.op_kind == ASTKind::NEG_UNARYOP_EXPR) {
-                                out.print("neg rax\n");
-                            }
-                            else if (ins.op.op_kind == ASTKind::NOT_UNARYOP_EXPR) {
-                                out.print("cmp rax, 0\n");
-                                out.print("sete al\n");
-                                out.print("movzx eax, al\n"); // Is this necessary?
-                            }
-                            else assert(0);
-                            out.print("push rax\n");
-                        }
-                        else if (ins.op.kind == TypeKind::F64) {
-                            if (ins.op.op_kind == ASTKind::NEG_UNARYOP_EXPR) {
-                                out.print("movsd xmm0, [rsp]\n");
-                                out.print("movsd xmm1, QWORD [REL DOUBLE_FLOAT_XOR]\n");
-                                out.print("xorpd xmm0, xmm1\n");
-                                out.print("movsd [rsp], xmm0\n");
-                            }
-                            else assert(0);
-                        }
-                        else assert(0);
-                    } break;
-
-                    case Instruction::Opcode::BINARY_OP: {
-#if DBG_INS
-                        if (ins.op.op_kind == ASTKind::EQ_BINARYOP_EXPR) out.print("; BINOP (EQ {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::NE_BINARYOP_EXPR) out.print("; BINOP (NE {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::GE_BINARYOP_EXPR) out.print("; BINOP (GE {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::GT_BINARYOP_EXPR) out.print("; BINOP (GT {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::LE_BINARYOP_EXPR) out.print("; BINOP (LE {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::LT_BINARYOP_EXPR) out.print("; BINOP (LT {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::AND_BINARYOP_EXPR) out.print("; BINOP (AND {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::OR_BINARYOP_EXPR) out.print("; BINOP (OR {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::ADD_BINARYOP_EXPR) out.print("; BINOP (ADD {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::SUB_BINARYOP_EXPR) out.print("; BINOP (SUB {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::MUL_BINARYOP_EXPR) out.print("; BINOP (MUL {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::DIV_BINARYOP_EXPR) out.print("; BINOP (DIV {})\n", TypeKindName(ins.op.kind));
-                        else if (ins.op.op_kind == ASTKind::MOD_BINARYOP_EXPR) out.print("; BINOP (MOD {})\n", TypeKindName(ins.op.kind));
-                        else assert(0);
-#endif
-                        if (ins.op.kind == TypeKind::I64 || ins.op.kind == TypeKind::U8) {
-                            out.print("pop rbx\n"); // TOP
-                            out.print("pop rax\n"); // TOP1
-
-                            switch (ins.op.op_kind) {
-                                case ASTKind::ADD_BINARYOP_EXPR: { out.print("add rax, rbx\n"); } break;
-                                case ASTKind::SUB_BINARYOP_EXPR: { out.print("sub rax, rbx\n"); } break;
-                                case ASTKind::MUL_BINARYOP_EXPR: { out.print("imul rax, rbx\n"); } break;
-                                case ASTKind::DIV_BINARYOP_EXPR:
-                                case ASTKind::MOD_BINARYOP_EXPR: {
-                                    out.print("cqo\n");
-                                    out.print("idiv rbx\n");
-                                    if (ins.op.op_kind == ASTKind::MOD_BINARYOP_EXPR) {
-                                        out.print("mov rax, rdx\n");
-                                    }
-                                } break;
-                                case ASTKind::AND_BINARYOP_EXPR: {
-                                    out.print("cmp rax, 0\n");
-                                    out.print("setne al\n");
-                                    out.print("cmp rbx, 0\n");
-                                    out.print("setne bl\n");
-                                    out.print("and rax, rbx\n");
-                                } break;
-                                case ASTKind::OR_BINARYOP_EXPR: {
-                                    out.print("or rax, rbx\n");
-                                    out.print("setne al\n");
-                                    out.print("movzx eax, al\n");
-                                } break;
-                                case ASTKind::EQ_BINARYOP_EXPR:
-                                case ASTKind::NE_BINARYOP_EXPR:
-                                case ASTKind::GE_BINARYOP_EXPR:
-                                case ASTKind::GT_BINARYOP_EXPR:
-                                case ASTKind::LE_BINARYOP_EXPR:
-                                case ASTKind::LT_BINARYOP_EXPR: {
-                                    out.print("cmp rax, rbx\n");
-                                    switch (ins.op.op_kind) {
-                                        case ASTKind::EQ_BINARYOP_EXPR: out.print("sete al\n"); break;
-                                        case ASTKind::NE_BINARYOP_EXPR: out.print("setne al\n"); break;
-                                        case ASTKind::GE_BINARYOP_EXPR: out.print("setge al\n"); break;
-                                        case ASTKind::GT_BINARYOP_EXPR: out.print("setg al\n"); break;
-                                        case ASTKind::LE_BINARYOP_EXPR: out.print("setle al\n"); break;
-                                        case ASTKind::LT_BINARYOP_EXPR: out.print("setl al\n"); break;
-                                        default: assert(0);
-                                    }
-                                    out.print("movzx eax, al\n");
-                                } break;
-
-                                default: assert(0);
-                            }
-
-                            out.print("push rax\n");
-                        }
-                        else if (ins.op.kind == TypeKind::F64) {
-                            switch (ins.op.op_kind) {
-                                case ASTKind::ADD_BINARYOP_EXPR: {
-                                    out.print("movsd xmm1, [rsp]\n");   // TOP
-                                    out.print("movsd xmm0, [rsp+8]\n"); // TOP1
-                                    out.print("addsd xmm0, xmm1\n");
-                                    out.print("add rsp, 8\n");
-                                    out.print("movq [rsp], xmm0\n");
-                                } break;
-                                case ASTKind::SUB_BINARYOP_EXPR: {
-                                    out.print("movsd xmm1, [rsp]\n");   // TOP
-                                    out.print("movsd xmm0, [rsp+8]\n"); // TOP1
-                                    out.print("subsd xmm0, xmm1\n");
-                                    out.print("add rsp, 8\n");
-                                    out.print("movq [rsp], xmm0\n");
-                                } break;
-                                case ASTKind::MUL_BINARYOP_EXPR: {
-                                    out.print("movsd xmm1, [rsp]\n");   // TOP
-                                    out.print("movsd xmm0, [rsp+8]\n"); // TOP1
-                                    out.print("mulsd xmm0, xmm1\n");
-                                    out.print("add rsp, 8\n");
-                                    out.print("movq [rsp], xmm0\n");
-                                } break;
-                                case ASTKind::DIV_BINARYOP_EXPR: {
-                                    out.print("movsd xmm1, [rsp]\n");   // TOP
-                                    out.print("movsd xmm0, [rsp+8]\n"); // TOP1
-                                    out.print("divsd xmm0, xmm1\n");
-                                    out.print("add rsp, 8\n");
-                                    out.print("movq [rsp], xmm0\n");
-                                } break;
-                                case ASTKind::MOD_BINARYOP_EXPR: {
-                                    out.print("movsd xmm1, [rsp]\n");   // TOP
-                                    out.print("movsd xmm0, [rsp+8]\n"); // TOP1
-                                    out.print("fld QWORD [rsp+8]\n"
-                                              "fld QWORD [rsp]\n"
-                                              "fxch st1\n"
-                                              ".fmod_loop:\n"
-                                              "fprem\n"
-                                              "fnstsw  ax\n"
-                                              "sahf\n"
-                                              "jp .fmod_loop\n"
-                                              "fstp st1\n"
-                                              "fstp QWORD [rsp-8]\n"
-                                              "movsd xmm0, QWORD [rsp-8]\n"
-                                              );
-                                    out.print("add rsp, 8\n");
-                                    out.print("movq [rsp], xmm0\n");
-                                } break;
-                                case ASTKind::AND_BINARYOP_EXPR:
-                                case ASTKind::OR_BINARYOP_EXPR: {
-                                    out.print("xorpd xmm0, xmm0\n");
-                                    out.print("ucomisd xmm0, [rsp]\n"); // TOP
-                                    out.print("setne al\n");
-                                    out.print("xorpd xmm0, xmm0\n"); // Necessary?
-                                    out.print("ucomisd xmm0, [rsp+8]\n"); // TOP1
-                                    out.print("setne cl\n");
-                                    if (ins.op.op_kind == ASTKind::AND_BINARYOP_EXPR) {
-                                        out.print("and cl, al\n");
-                                    }
-                                    else {
-                                        out.print("or cl, al\n");
-                                    }
-                                    out.print("movzx eax, cl\n");
-                                    out.print("add rsp, 16\n");
-                                    out.print("push rax\n");
-                                } break;
-                                case ASTKind::EQ_BINARYOP_EXPR:
-                                case ASTKind::NE_BINARYOP_EXPR:
-                                case ASTKind::GE_BINARYOP_EXPR:
-                                case ASTKind::GT_BINARYOP_EXPR:
-                                case ASTKind::LE_BINARYOP_EXPR:
-                                case ASTKind::LT_BINARYOP_EXPR: {
-                                    if (ins.op.op_kind == ASTKind::LE_BINARYOP_EXPR ||
-                                        ins.op.op_kind == ASTKind::LT_BINARYOP_EXPR)
-                                    {
-                                        // swap regs
-                                        out.print("movsd xmm0, [rsp]\n");
-                                        out.print("xor eax, eax\n");
-                                        out.print("comisd xmm0, [rsp+8]\n");
-                                    }
-                                    else {
-                                        out.print("movsd xmm0, [rsp+8]\n");
-                                        out.print("xor eax, eax\n");
-                                        out.print("comisd xmm0, [rsp]\n");
-                                    }
-                                    switch (ins.op.op_kind) {
-                                        case ASTKind::EQ_BINARYOP_EXPR: out.print("sete al\n"); break;
-                                        case ASTKind::NE_BINARYOP_EXPR: out.print("setne al\n"); break;
-                                        case ASTKind::GE_BINARYOP_EXPR:
-                                        case ASTKind::GT_BINARYOP_EXPR:
-                                        case ASTKind::LE_BINARYOP_EXPR: out.print("setnb al\n"); break;
-                                        case ASTKind::LT_BINARYOP_EXPR: out.print("seta al\n"); break;
-                                        default: assert(0);
-                                    }
-
-                                    out.print("movzx eax, al\n");
-                                    out.print("add rsp, 16\n");
-                                    out.print("push rax\n");
-                                } break;
-
-                                default: assert(0);
-                            }
-                        }
-                        else assert(0);
-                    } break;
-
-                    case Instruction::Opcode::CALL: {
-                        std::string_view sv{ins.str.buf, ins.str.sz};
-#if DBG_INS
-                        out.print("; CALL EXTERN {}\n", sv);
-#endif
-                        out.print("jmp extern_{}\n", sv);
-                    } break;
-
-                    case Instruction::Opcode::JMP: {
-                        if (IS_BUILTIN(ins.jmpAddr)) {
-#if DBG_INS
-                            out.print("; CALL {}\n", (int64_t) ins.jmpAddr);
-#endif
-                            if (ins.jmpAddr == BUILTIN_putf) out.print("jmp BUILTIN_putf\n");
-                            else if (ins.jmpAddr == BUILTIN_puti) out.print("jmp BUILTIN_puti\n");
-                            else if (ins.jmpAddr == BUILTIN_puts) out.print("jmp BUILTIN_puts\n");
-                            else if (ins.jmpAddr == BUILTIN_itoc) out.print("jmp BUILTIN_itoc\n");
-                            else if (ins.jmpAddr == BUILTIN_ctoi) out.print("jmp BUILTIN_ctoi\n");
-                            else if (ins.jmpAddr == BUILTIN_itof) out.print("jmp BUILTIN_itof\n");
-                            else if (ins.jmpAddr == BUILTIN_ftoi) out.print("jmp BUILTIN_ftoi\n");
-                            else if (ins.jmpAddr == BUILTIN_sqrt) out.print("jmp BUILTIN_sqrt\n");
-                            else {
-                                fmt::print(stderr, "{}\n", (int64_t) ins.jmpAddr);
-                                assert(0);
-                            }
-                        }
-                        else {
-#if DBG_INS
-                            out.print("; JMP {}\n", ins.jmpAddr);
-#endif
-                            out.print("jmp INS_{}\n", ins.jmpAddr); // ip = x
-                        }
-                    } break;
-
-                    case Instruction::Opcode::JMP_Z: {
-#if DBG_INS
-                        out.print("; JMP_Z {}\n", ins.jmpAddr);
-#endif
-                        out.print("pop rax\n");
-                        out.print("cmp {}, 0\n",
-                                  ins.access.accessSize == 8 ? "rax" :
-                                  ins.access.accessSize == 4 ? "eax" :
-                                  ins.access.accessSize == 2 ? "ax" : "al");
-                        out.print("je INS_{}\n", ins.jmpAddr); // if TOP == 0: ip = x
-                    } break;
-
-                    case Instruction::Opcode::SAVE: {
-#if DBG_INS
-                        out.print("; SAVE {}\n", ins.jmpAddr);
-#endif
-                        out.print("lea rax, [REL INS_{}]\n", ins.jmpAddr);
-                        out.print("push rax\n");
-                        out.print("push rbp\n");
-                    } break;
-
-                    case Instruction::Opcode::ENTER: {
-#if DBG_INS
-                        out.print("; ENTER {} {}\n", ins.frame.numParams, ins.frame.numLocals);
-#endif
-                        out.print("mov rbp, rsp\n");
-                        out.print("add rbp, {}\n", ins.frame.numParams*8); // bp = sp - x
-                        out.print("sub rsp, {}\n", ins.frame.numLocals*8); // sp += y
-                    } break;
-
-                    case Instruction::Opcode::RETURN_VOID: {
-#if DBG_INS
-                        out.print("; RETURN_VOID\n");
-#endif
-                        out.print("mov rsp, rbp\n"); // sp = bp
-                        out.print("pop rbp\n"); // bp = TOP
-                        out.print("ret\n"); // jmp TOP
-                    } break;
-
-                    case Instruction::Opcode::RETURN_VAL: {
-#if DBG_INS
-                        out.print("; RETURN_VAL\n");
-#endif
-                        out.print("pop rax\n"); // retval = TOP
-                        out.print("mov rsp, rbp\n"); // sp = bp
-                        out.print("pop rbp\n"); // bp = TOP
-                        out.print("push rax\n"); // TOP = retval
-                        // swap retval and return addr
-                        out.print("pop rax\n");
-                        out.print("pop rbx\n");
-                        out.print("push rax\n");
-                        out.print("push rbx\n");
-
-                        out.print("ret\n"); // jmp TOP
-                    } break;
-
-                    default: break;
-                }
-            }
+        // Procedures are formatted in batches on the worker pool.
+        // Literals are counted first so each batch knows where its pool entries start,
+        // the output is the same as formatting everything in order.
+        size_t numBatches = std::min(procedures.size(), NumWorkerThreads(procedures.size()) * 4);
+        std::vector<AsmBatch> batches(numBatches);
+        auto BatchBegin = [&](size_t batch) { return batch * procedures.size() / numBatches; };
+        ParallelFor(numBatches, [&](size_t batch) {
+            size_t numStrings = 0, numFloats = 0;
+            for (size_t i = BatchBegin(batch); i < BatchBegin(batch + 1); ++i)
+                CountLiterals(procedures[i], numStrings, numFloats);
+            batches[batch].stringPoolBase = numStrings;
+            batches[batch].floatPoolBase = numFloats;
+        });
+        size_t numStrings = 0, numFloats = 0;
+        for (AsmBatch& batch : batches) {
+            numStrings += std::exchange(batch.stringPoolBase, numStrings);
+            numFloats += std::exchange(batch.floatPoolBase, numFloats);
+        }
+        ParallelFor(numBatches, [&](size_t batch) {
+            for (size_t i = BatchBegin(batch); i < BatchBegin(batch + 1); ++i)
+                EmitProcedure(batches[batch], procedures[i]);
+        });
 
+        std::vector<std::string> stringLiteralPool;
+        std::vector<double> floatLiteralPool;
+        stringLiteralPool.reserve(numStrings);
+        floatLiteralPool.reserve(numFloats);
+        for (AsmBatch& batch : batches) {
+            out.print("{}", fmt::string_view{batch.text.data(), batch.text.size()});
+            std::move(batch.stringLiteralPool.begin(), batch.stringLiteralPool.end(), std::back_inserter(stringLiteralPool));
+            floatLiteralPool.insert(floatLiteralPool.end(), batch.floatLiteralPool.begin(), batch.floatLiteralPool.end());
         }
         for (size_t i = 0, n = stringLiteralPool.size(); i < n; ++i) {
             out.print("STRING_{} db ", i);
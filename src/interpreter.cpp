@@ -3,7 +3,10 @@
 #include "parser.hpp"
 
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <unordered_map>
+#include <x86intrin.h>
 
 #define DBG_INS 0
 
@@ -36,15 +39,32 @@ std::string UnescapeString(const char* buff, size_t sz) {
 }
 
 uint8_t st[10000000];
-void InterpretInstructions(const std::vector<Procedure>& procedures) {
+
+Interpreter::Interpreter(const std::vector<Procedure>& procedures) {
     // Flatten procedures to list of instructions
-    std::vector<Instruction> instructions;
     for (const auto& proc : procedures) {
         instructions.insert(instructions.end(), proc.instructions.begin(), proc.instructions.end());
     }
+    // Literals are unescaped once here, not every time they are pushed
+    for (Instruction& ins : instructions) {
+        if (ins.opcode == Instruction::Opcode::PUSH && ins.lit.kind == TypeKind::STR) {
+            std::string str = UnescapeString(ins.lit.str.buf, ins.lit.str.sz);
+            ins.lit.i64 = stringLiteralPool.size();
+            stringLiteralPool.push_back(std::move(str));
+        }
+    }
+}
+
+void InterpretInstructions(const std::vector<Procedure>& procedures) {
+    if (procedures.empty())
+        return;
+    Interpreter interpreter{procedures};
+    interpreter.Run(procedures[0]);
+}
+
+void Interpreter::Run(const Procedure& proc) {
     size_t sp = 0;
     size_t bp = sp;
-    std::vector<std::string> stringLiteralPool;
 
     auto PrintStack = [&]() {
         assert(sp % 8 == 0);
@@ -57,7 +77,7 @@ void InterpretInstructions(const std::vector<Procedure>& procedures) {
         fprintf(stderr, "\n");
     };
 
-    for (size_t ip = 0; ip < instructions.size(); ++ip) {
+    for (size_t ip = proc.insStartIdx; ip < instructions.size(); ++ip) {
         Instruction ins = instructions[ip];
 
 #if DBG_INS
@@ -68,18 +88,13 @@ void InterpretInstructions(const std::vector<Procedure>& procedures) {
                  if (ins.lit.kind == TypeKind::I64) fmt::print(stderr, "PUSH {}\n", ins.lit.i64);
             else if (ins.lit.kind == TypeKind::F64) fmt::print(stderr, "PUSH {}\n", ins.lit.f64);
             else if (ins.lit.kind == TypeKind::U8) fmt::print(stderr, "PUSH {}\n", (char)ins.lit.u8);
-            else if (ins.lit.kind == TypeKind::STR) fmt::print(stderr, "PUSH \"{}\"\n", std::string_view{ins.lit.str.buf, ins.lit.str.sz});
+            else if (ins.lit.kind == TypeKind::STR) fmt::print(stderr, "PUSH \"{}\"\n", stringLiteralPool[ins.lit.i64]);
             else assert(0);
 #else
                  if (ins.lit.kind == TypeKind::I64) { memcpy(st + sp, &ins.lit.i64, 8); sp += 8; }
             else if (ins.lit.kind == TypeKind::F64) { memcpy(st + sp, &ins.lit.f64, 8); sp += 8; }
-            else if (ins.lit.kind == TypeKind::U8)  { memcpy(st + sp, &ins.lit.u8, 1);  sp += 8; }
-            else if (ins.lit.kind == TypeKind::STR) {
-                int64_t poolIdx = stringLiteralPool.size();
-                stringLiteralPool.emplace_back(UnescapeString(ins.lit.str.buf, ins.lit.str.sz));
-                memcpy(st + sp, &poolIdx, 8);
-                sp += 8;
-            }
+            else if (ins.lit.kind == TypeKind::U8)  { uint64_t x = ins.lit.u8; memcpy(st + sp, &x, 8); sp += 8; }
+            else if (ins.lit.kind == TypeKind::STR) { memcpy(st + sp, &ins.lit.i64, 8); sp += 8; }
             else assert(0);
 #endif
         }
@@ -289,12 +304,25 @@ void InterpretInstructions(const std::vector<Procedure>& procedures) {
                     memcpy(st + sp, &y, 8);
                     sp += 8;
                 }
+                else if (ins.jmpAddr == BUILTIN_clock_ns) {
+                    sp -= 16;
+                    auto x = static_cast<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count());
+                    memcpy(st + sp, &x, 8);
+                    sp += 8;
+                }
+                else if (ins.jmpAddr == BUILTIN_rdtsc) {
+                    sp -= 16;
+                    auto x = static_cast<int64_t>(__rdtsc());
+                    memcpy(st + sp, &x, 8);
+                    sp += 8;
+                }
                 else if (ins.jmpAddr == BUILTIN_sqrt) {
                     double x;
                     sp -= 8;
                     memcpy(&x, st + sp, 8);
                     sp -= 16;
-                    x = sqrtf(x);
+                    x = std::sqrt(x);
                     memcpy(st + sp, &x, 8);
                     sp += 8;
                 }
@@ -2,10 +2,23 @@
 
 #include "analyzer.hpp"
 #include "bytecode.hpp"
+#include <string>
 #include <vector>
 
 
 char UnescapeChar(const char* buff, size_t sz);
 std::string UnescapeString(const char* buff, size_t sz);
 
+// A linked program flattened into one list of instructions, its procedures can be run one at a time (see -bench)
+class Interpreter {
+    std::vector<Instruction> instructions;
+    std::vector<std::string> stringLiteralPool; // Pushing a string literal pushes its index here
+
+public:
+    explicit Interpreter(const std::vector<Procedure>& procedures);
+    // Runs a procedure that takes no parameters until it returns
+    void Run(const Procedure& proc);
+};
+
+// Runs the first procedure
 void InterpretInstructions(const std::vector<Procedure>& procedures);
@@ -0,0 +1,309 @@
+#include "json.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <fmt/core.h>
+
+namespace {
+
+// Recursive descent, any error makes the whole text invalid
+class JsonParser {
+    std::string_view text;
+    size_t idx{};
+    int depth{};
+
+    static constexpr int MAX_DEPTH = 256;
+
+    void SkipWhitespace() {
+        while (idx < text.size() && (text[idx] == ' ' || text[idx] == '\t' || text[idx] == '\n' || text[idx] == '\r'))
+            ++idx;
+    }
+
+    bool Consume(std::string_view expected) {
+        if (text.substr(idx, expected.size()) != expected)
+            return false;
+        idx += expected.size();
+        return true;
+    }
+
+    bool ParseHex4(uint32_t& value) {
+        if (idx + 4 > text.size())
+            return false;
+        value = 0;
+        for (size_t end = idx + 4; idx < end; ++idx) {
+            char ch = text[idx];
+            uint32_t digit = ch >= '0' && ch <= '9' ? static_cast<uint32_t>(ch - '0') :
+                (ch | 0x20) >= 'a' && (ch | 0x20) <= 'f' ? static_cast<uint32_t>((ch | 0x20) - 'a' + 10) : 16;
+            if (digit == 16)
+                return false;
+            value = value * 16 + digit;
+        }
+        return true;
+    }
+
+    static void AppendUtf8(std::string& out, uint32_t codepoint) {
+        if (codepoint < 0x80) {
+            out += static_cast<char>(codepoint);
+        }
+        else if (codepoint < 0x800) {
+            out += static_cast<char>(0xc0 | (codepoint >> 6));
+            out += static_cast<char>(0x80 | (codepoint & 0x3f));
+        }
+        else if (codepoint < 0x10000) {
+            out += static_cast<char>(0xe0 | (codepoint >> 12));
+            out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (codepoint & 0x3f));
+        }
+        else {
+            out += static_cast<char>(0xf0 | (codepoint >> 18));
+            out += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3f));
+            out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (codepoint & 0x3f));
+        }
+    }
+
+    bool ParseString(std::string& out) {
+        if (!Consume("\""))
+            return false;
+        while (idx < text.size() && text[idx] != '"') {
+            char ch = text[idx++];
+            if (ch != '\\') {
+                out += ch;
+                continue;
+            }
+            if (idx >= text.size())
+                return false;
+            switch (text[idx++]) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    uint32_t codepoint;
+                    if (!ParseHex4(codepoint))
+                        return false;
+                    // Characters outside the basic plane are escaped as a surrogate pair
+                    uint32_t low;
+                    if (codepoint >= 0xd800 && codepoint < 0xdc00 && Consume("\\u") && ParseHex4(low)
+                        && low >= 0xdc00 && low < 0xe000)
+                    {
+                        codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (low - 0xdc00);
+                    }
+                    AppendUtf8(out, codepoint);
+                } break;
+                default: return false;
+            }
+        }
+        return Consume("\"");
+    }
+
+    bool ParseNumber(double& out) {
+        size_t start = idx;
+        if (idx < text.size() && text[idx] == '-')
+            ++idx;
+        while (idx < text.size() && ((text[idx] >= '0' && text[idx] <= '9')
+            || text[idx] == '.' || text[idx] == 'e' || text[idx] == 'E' || text[idx] == '+' || text[idx] == '-'))
+        {
+            ++idx;
+        }
+        std::string number{text.substr(start, idx - start)};
+        char* end = nullptr;
+        out = std::strtod(number.c_str(), &end);
+        return !number.empty() && end == number.c_str() + number.size();
+    }
+
+public:
+    explicit JsonParser(std::string_view text_)
+        : text{text_}
+    {}
+
+    bool ParseValue(Json& out) {
+        SkipWhitespace();
+        if (idx >= text.size() || ++depth > MAX_DEPTH)
+            return false;
+
+        bool ok = true;
+        char ch = text[idx];
+        if (ch == '{') {
+            ++idx;
+            out = Json::Object();
+            SkipWhitespace();
+            if (!Consume("}")) {
+                do {
+                    SkipWhitespace();
+                    std::string key;
+                    Json value;
+                    ok = ParseString(key);
+                    SkipWhitespace();
+                    ok = ok && Consume(":") && ParseValue(value);
+                    if (ok)
+                        out.Set(key, std::move(value));
+                    SkipWhitespace();
+                } while (ok && Consume(","));
+                ok = ok && Consume("}");
+            }
+        }
+        else if (ch == '[') {
+            ++idx;
+            out = Json::Array();
+            SkipWhitespace();
+            if (!Consume("]")) {
+                do {
+                    Json value;
+                    ok = ParseValue(value);
+                    if (ok)
+                        out.Push(std::move(value));
+                    SkipWhitespace();
+                } while (ok && Consume(","));
+                ok = ok && Consume("]");
+            }
+        }
+        else if (ch == '"') {
+            std::string value;
+            ok = ParseString(value);
+            out = std::move(value);
+        }
+        else if (Consume("true")) {
+            out = true;
+        }
+        else if (Consume("false")) {
+            out = false;
+        }
+        else if (Consume("null")) {
+            out = nullptr;
+        }
+        else {
+            double value;
+            ok = ParseNumber(value);
+            out = value;
+        }
+        --depth;
+        return ok;
+    }
+
+    bool AtEnd() {
+        SkipWhitespace();
+        return idx == text.size();
+    }
+};
+
+}
+
+std::optional<Json> Json::Parse(std::string_view text) {
+    JsonParser parser{text};
+    Json json;
+    if (!parser.ParseValue(json) || !parser.AtEnd())
+        return std::nullopt;
+    return json;
+}
+
+const Json& Json::operator[](std::string_view key) const {
+    static const Json null;
+    for (const auto& [name, value] : members) {
+        if (name == key)
+            return value;
+    }
+    return null;
+}
+
+Json& Json::Set(std::string_view key, Json value) {
+    for (auto& [name, member] : members) {
+        if (name == key)
+            return member = std::move(value);
+    }
+    return members.emplace_back(key, std::move(value)).second;
+}
+
+Json& Json::Push(Json value) {
+    return elements.emplace_back(std::move(value));
+}
+
+// Length of the UTF-8 sequence starting at idx, 0 if it is malformed
+static size_t Utf8SequenceLength(std::string_view text, size_t idx) {
+    auto lead = static_cast<unsigned char>(text[idx]);
+    size_t length = lead < 0x80 ? 1 : lead >= 0xc2 && lead < 0xe0 ? 2 : lead >= 0xe0 && lead < 0xf0 ? 3 :
+        lead >= 0xf0 && lead < 0xf5 ? 4 : 0;
+    if (length == 0 || idx + length > text.size())
+        return 0;
+    for (size_t i = 1; i < length; ++i) {
+        if ((static_cast<unsigned char>(text[idx + i]) & 0xc0) != 0x80)
+            return 0;
+    }
+    return length;
+}
+
+// Messages can quote a single byte of a multibyte character, which becomes U+FFFD
+static void DumpString(std::string& out, std::string_view text) {
+    out += '"';
+    for (size_t idx = 0; idx < text.size(); ++idx) {
+        char ch = text[idx];
+        if (static_cast<unsigned char>(ch) >= 0x80) {
+            size_t length = Utf8SequenceLength(text, idx);
+            if (length == 0) {
+                out += "\ufffd";
+                continue;
+            }
+            out += text.substr(idx, length);
+            idx += length - 1;
+            continue;
+        }
+        switch (ch) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(ch) < 0x20)
+                    out += fmt::format("\\u{:04x}", static_cast<unsigned>(ch));
+                else
+                    out += ch;
+        }
+    }
+    out += '"';
+}
+
+void Json::DumpTo(std::string& out) const {
+    switch (kind) {
+        case Kind::NUL: out += "null"; break;
+        case Kind::BOOL: out += boolean ? "true" : "false"; break;
+        case Kind::NUMBER: {
+            // Integers (ids, positions) must not come out as 1e+06 or 3.0
+            if (std::isfinite(number) && number == std::trunc(number) && std::fabs(number) < 1e15)
+                out += fmt::format("{}", static_cast<int64_t>(number));
+            else if (std::isfinite(number))
+                out += fmt::format("{}", number);
+            else
+                out += "null";
+        } break;
+        case Kind::STRING: DumpString(out, string); break;
+        case Kind::ARRAY: {
+            out += '[';
+            for (size_t i = 0; i < elements.size(); ++i) {
+                if (i > 0) out += ',';
+                elements[i].DumpTo(out);
+            }
+            out += ']';
+        } break;
+        case Kind::OBJECT: {
+            out += '{';
+            for (size_t i = 0; i < members.size(); ++i) {
+                if (i > 0) out += ',';
+                DumpString(out, members[i].first);
+                out += ':';
+                members[i].second.DumpTo(out);
+            }
+            out += '}';
+        } break;
+    }
+}
+
+std::string Json::Dump() const {
+    std::string out;
+    DumpTo(out);
+    return out;
+}
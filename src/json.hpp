@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Just enough JSON for the language server protocol.
+// Objects keep their members in order, lookups are linear (messages have a handful of members).
+class Json {
+public:
+    enum class Kind : uint8_t {
+        NUL,
+        BOOL,
+        NUMBER,
+        STRING,
+        ARRAY,
+        OBJECT,
+    };
+
+private:
+    Kind kind = Kind::NUL;
+    bool boolean{};
+    double number{};
+    std::string string;
+    std::vector<Json> elements;
+    std::vector<std::pair<std::string, Json>> members;
+
+    void DumpTo(std::string& out) const;
+
+public:
+    Json() = default;
+    Json(std::nullptr_t) {} // NOLINT (implicit, like the other literals)
+    Json(bool value) : kind{Kind::BOOL}, boolean{value} {} // NOLINT
+    Json(double value) : kind{Kind::NUMBER}, number{value} {} // NOLINT
+    template<typename T>
+        requires std::is_integral_v<T> && (!std::is_same_v<T, bool>)
+    Json(T value) : kind{Kind::NUMBER}, number{static_cast<double>(value)} {} // NOLINT
+    Json(std::string value) : kind{Kind::STRING}, string{std::move(value)} {} // NOLINT
+    Json(std::string_view value) : kind{Kind::STRING}, string{value} {} // NOLINT
+    Json(const char* value) : kind{Kind::STRING}, string{value} {} // NOLINT
+
+    static Json Array() { Json json; json.kind = Kind::ARRAY; return json; }
+    static Json Object() { Json json; json.kind = Kind::OBJECT; return json; }
+    // Nothing if the text is not a single valid value
+    static std::optional<Json> Parse(std::string_view text);
+
+    [[nodiscard]] Kind GetKind() const { return kind; }
+    [[nodiscard]] bool IsNull() const { return kind == Kind::NUL; }
+    // The value, or the fallback if this is something else
+    [[nodiscard]] bool AsBool(bool fallback = false) const { return kind == Kind::BOOL ? boolean : fallback; }
+    [[nodiscard]] double AsNumber(double fallback = 0) const { return kind == Kind::NUMBER ? number : fallback; }
+    [[nodiscard]] std::string_view AsString() const { return kind == Kind::STRING ? std::string_view{string} : std::string_view{}; }
+    // Empty unless this is an array
+    [[nodiscard]] const std::vector<Json>& Elements() const { return elements; }
+
+    // Null if this is not an object or has no such member
+    [[nodiscard]] const Json& operator[](std::string_view key) const;
+    // Replaces a member of the same name
+    Json& Set(std::string_view key, Json value);
+    Json& Push(Json value);
+
+    [[nodiscard]] std::string Dump() const;
+};
@@ -0,0 +1,490 @@
+#include "optimizer.hpp"
+#include "analyzer.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+using Opcode = Instruction::Opcode;
+
+// Successors of instruction i, numInstructions is the end of the procedure
+template<typename F>
+void DeadCodeEliminator::ForEachSuccessor(size_t i, F f) const {
+    const Instruction& ins = proc->instructions[i];
+    if (isRemoved[i] || isCall[i]) {
+        f(i + 1);
+        return;
+    }
+    switch (ins.opcode) {
+        case Opcode::JMP: f(ins.jmpAddr); break;
+        case Opcode::JMP_Z: f(i + 1); f(ins.jmp.jmpAddr); break;
+        case Opcode::RETURN_VOID:
+        case Opcode::RETURN_VAL: break;
+        default: f(i + 1); break;
+    }
+}
+
+template<typename F>
+void DeadCodeEliminator::ForEachSuccessorBlock(size_t block, F f) const {
+    ForEachSuccessor(blockStarts[block + 1] - 1, [&](size_t next) { f(blockOf[next]); });
+}
+
+// Whether control can't fall through to the next instruction
+bool DeadCodeEliminator::EndsBlock(size_t i) const {
+    Opcode opcode = proc->instructions[i].opcode;
+    return !isRemoved[i] && !isCall[i] && (opcode == Opcode::JMP || opcode == Opcode::JMP_Z
+        || opcode == Opcode::RETURN_VOID || opcode == Opcode::RETURN_VAL);
+}
+
+void DeadCodeEliminator::FindTargets() {
+    isTarget.assign(numInstructions + 1, false);
+    for (size_t i = 0; i < numInstructions; ++i) {
+        const Instruction& ins = proc->instructions[i];
+        if (isRemoved[i])
+            continue;
+        if ((ins.opcode == Opcode::JMP && !isCall[i]) || ins.opcode == Opcode::SAVE)
+            isTarget[ins.jmpAddr] = true;
+        else if (ins.opcode == Opcode::JMP_Z)
+            isTarget[ins.jmp.jmpAddr] = true;
+    }
+}
+
+// A constant condition either always jumps or never does
+void DeadCodeEliminator::FoldConstantBranches() {
+    for (size_t i = 1; i < numInstructions; ++i) {
+        Instruction& cond = proc->instructions[i - 1];
+        const Instruction& jmp = proc->instructions[i];
+        if (jmp.opcode != Opcode::JMP_Z || isTarget[i] || cond.opcode != Opcode::PUSH || cond.lit.kind == TypeKind::STR)
+            continue;
+        bool isZero = cond.lit.kind == TypeKind::U8 ? cond.lit.u8 == 0 : cond.lit.i64 == 0;
+        if (isZero)
+            cond = Instruction{.opcode=Opcode::JMP, .jmpAddr=jmp.jmp.jmpAddr};
+        else
+            isRemoved[i - 1] = true;
+        isRemoved[i] = true;
+    }
+}
+
+void DeadCodeEliminator::RemoveUnreachable() {
+    isReached.assign(numInstructions + 1, false);
+    isReached[0] = true;
+    work.assign(1, 0);
+    while (!work.empty()) {
+        size_t i = work.back();
+        work.pop_back();
+        ForEachSuccessor(i, [&](size_t next) {
+            if (!isReached[next]) {
+                isReached[next] = true;
+                if (next < numInstructions)
+                    work.push_back(next);
+            }
+        });
+    }
+    for (size_t i = 0; i < numInstructions; ++i)
+        isRemoved[i] = isRemoved[i] || !isReached[i];
+}
+
+// Jumps over nothing but removed instructions, backwards so the next kept instruction of each target is known
+void DeadCodeEliminator::RemoveJumpsToNext() {
+    std::vector<size_t>& nextKept = addrs;
+    nextKept.resize(numInstructions + 1);
+    nextKept[numInstructions] = numInstructions;
+    for (size_t i = numInstructions; i-- > 0;) {
+        const Instruction& ins = proc->instructions[i];
+        if (!isRemoved[i] && ins.opcode == Opcode::JMP && !isCall[i]
+            && ins.jmpAddr > i && nextKept[ins.jmpAddr] == nextKept[i + 1])
+        {
+            isRemoved[i] = true;
+        }
+        nextKept[i] = isRemoved[i] ? nextKept[i + 1] : i;
+    }
+}
+
+// First instruction of the side effect free expression stored by instruction storeIdx, if it is one
+std::optional<size_t> DeadCodeEliminator::PureExpressionStart(size_t storeIdx) const {
+    size_t numNeeded = 1;
+    for (size_t i = storeIdx; i-- > 0;) {
+        const Instruction& ins = proc->instructions[i];
+        if (isRemoved[i] || isTarget[i + 1])
+            return std::nullopt;
+        switch (ins.opcode) {
+            case Opcode::PUSH:
+            case Opcode::LOAD_FAST: --numNeeded; break;
+            case Opcode::UNARY_OP: break;
+            case Opcode::BINARY_OP: {
+                // Integer division by zero traps
+                bool canTrap = ins.op.kind != TypeKind::F64
+                    && (ins.op.op_kind == ASTKind::DIV_BINARYOP_EXPR || ins.op.op_kind == ASTKind::MOD_BINARYOP_EXPR);
+                if (canTrap)
+                    return std::nullopt;
+                ++numNeeded;
+            } break;
+            default: return std::nullopt;
+        }
+        if (numNeeded == 0)
+            return i;
+    }
+    return std::nullopt;
+}
+
+void DeadCodeEliminator::ComputeLiveOut(size_t block, size_t numWords) {
+    std::fill_n(liveOut.begin(), numWords, 0);
+    ForEachSuccessorBlock(block, [&](size_t next) {
+        for (size_t w = 0; w < numWords; ++w)
+            liveOut[w] |= liveIn[next * numWords + w];
+    });
+}
+
+// Backwards liveness of the variable slots over basic blocks.
+// Returns whether a removed expression loaded a variable, which may have made more stores dead.
+bool DeadCodeEliminator::RemoveDeadStores() {
+    const ArenaVector<Instruction>& instructions = proc->instructions;
+    size_t numSlots = 0;
+    for (size_t i = 0; i < numInstructions; ++i) {
+        const Instruction& ins = instructions[i];
+        if (isRemoved[i])
+            continue;
+        // Inline assembly may read any variable
+        if (ins.opcode == Opcode::INLINE)
+            return false;
+        if (ins.opcode == Opcode::LOAD_FAST || ins.opcode == Opcode::STORE_FAST)
+            numSlots = std::max(numSlots, ins.access.varAddr + 1);
+    }
+    if (numSlots == 0)
+        return false;
+
+    // Block b is instructions blockStarts[b] until blockStarts[b + 1], the last block is the end of the procedure
+    blockStarts.clear();
+    blockOf.resize(numInstructions + 1);
+    for (size_t i = 0; i < numInstructions; ++i) {
+        if (i == 0 || isTarget[i] || EndsBlock(i - 1))
+            blockStarts.push_back(i);
+        blockOf[i] = blockStarts.size() - 1;
+    }
+    const size_t numBlocks = blockStarts.size();
+    blockStarts.push_back(numInstructions);
+    blockOf[numInstructions] = numBlocks;
+
+    // One bit per slot for each block, used ones are read before being written in the block
+    const size_t numWords = (numSlots + 63) / 64;
+    used.assign((numBlocks + 1) * numWords, 0);
+    written.assign((numBlocks + 1) * numWords, 0);
+    liveIn.assign((numBlocks + 1) * numWords, 0);
+    liveOut.resize(numWords);
+    for (size_t b = 0; b < numBlocks; ++b) {
+        for (size_t i = blockStarts[b + 1]; i-- > blockStarts[b];) {
+            const Instruction& ins = instructions[i];
+            if (isRemoved[i] || (ins.opcode != Opcode::LOAD_FAST && ins.opcode != Opcode::STORE_FAST))
+                continue;
+            size_t w = b * numWords + ins.access.varAddr / 64;
+            uint64_t bit = uint64_t{1} << (ins.access.varAddr % 64);
+            bool isLoad = ins.opcode == Opcode::LOAD_FAST;
+            used[w] = isLoad ? used[w] | bit : used[w] & ~bit;
+            written[w] = isLoad ? written[w] & ~bit : written[w] | bit;
+        }
+    }
+
+    // Predecessors of block b are predecessors[predecessorStarts[b]] until predecessors[predecessorStarts[b + 1]]
+    predecessorStarts.assign(numBlocks + 2, 0);
+    for (size_t b = 0; b < numBlocks; ++b)
+        ForEachSuccessorBlock(b, [&](size_t next) { ++predecessorStarts[next + 1]; });
+    for (size_t b = 0; b <= numBlocks; ++b)
+        predecessorStarts[b + 1] += predecessorStarts[b];
+    predecessors.resize(predecessorStarts[numBlocks + 1]);
+    for (size_t b = 0; b < numBlocks; ++b)
+        ForEachSuccessorBlock(b, [&](size_t next) { predecessors[predecessorStarts[next]++] = b; });
+    // Filling moved each start to where the next block's starts
+    for (size_t b = numBlocks + 1; b > 0; --b)
+        predecessorStarts[b] = predecessorStarts[b - 1];
+    predecessorStarts[0] = 0;
+
+    // Later blocks first, so most blocks settle in one visit
+    isQueued.assign(numBlocks, true);
+    work.resize(numBlocks);
+    for (size_t b = 0; b < numBlocks; ++b)
+        work[b] = b;
+    while (!work.empty()) {
+        size_t b = work.back();
+        work.pop_back();
+        isQueued[b] = false;
+        ComputeLiveOut(b, numWords);
+        bool isChanged = false;
+        for (size_t w = b * numWords; w < (b + 1) * numWords; ++w) {
+            uint64_t word = used[w] | (liveOut[w - b * numWords] & ~written[w]);
+            isChanged = isChanged || word != liveIn[w];
+            liveIn[w] = word;
+        }
+        if (!isChanged)
+            continue;
+        for (size_t p = predecessorStarts[b]; p < predecessorStarts[b + 1]; ++p) {
+            if (!isQueued[predecessors[p]]) {
+                isQueued[predecessors[p]] = true;
+                work.push_back(predecessors[p]);
+            }
+        }
+    }
+
+    bool isLoadRemoved = false;
+    for (size_t b = 0; b < numBlocks; ++b) {
+        ComputeLiveOut(b, numWords);
+        for (size_t i = blockStarts[b + 1]; i-- > blockStarts[b];) {
+            const Instruction& ins = instructions[i];
+            if (isRemoved[i] || (ins.opcode != Opcode::LOAD_FAST && ins.opcode != Opcode::STORE_FAST))
+                continue;
+            uint64_t bit = uint64_t{1} << (ins.access.varAddr % 64);
+            uint64_t& word = liveOut[ins.access.varAddr / 64];
+            std::optional<size_t> start;
+            if (ins.opcode == Opcode::STORE_FAST && !(word & bit))
+                start = PureExpressionStart(i);
+            if (start) {
+                for (size_t j = *start; j <= i; ++j) {
+                    isLoadRemoved = isLoadRemoved || instructions[j].opcode == Opcode::LOAD_FAST;
+                    isRemoved[j] = true;
+                }
+                continue;
+            }
+            word = ins.opcode == Opcode::LOAD_FAST ? word | bit : word & ~bit;
+        }
+    }
+    return isLoadRemoved;
+}
+
+// Drops the removed instructions, a jump to one goes to the next instruction that is kept
+void DeadCodeEliminator::Compact() {
+    ArenaVector<Instruction>& instructions = proc->instructions;
+    std::vector<size_t>& newAddr = addrs;
+    newAddr.resize(numInstructions + 1);
+    size_t numKept = 0;
+    for (size_t i = 0; i < numInstructions; ++i) {
+        newAddr[i] = numKept;
+        if (!isRemoved[i])
+            instructions[numKept++] = instructions[i];
+    }
+    newAddr[numInstructions] = numKept;
+    if (numKept == numInstructions)
+        return;
+
+    std::erase_if(proc->calls, [&](const auto& call) { return isRemoved[call.first]; });
+    isCall.assign(numKept, false);
+    for (auto& [jumpIdx, callee] : proc->calls) {
+        jumpIdx = newAddr[jumpIdx];
+        isCall[jumpIdx] = true;
+    }
+    instructions.resize(numKept);
+    for (size_t i = 0; i < numKept; ++i) {
+        Instruction& ins = instructions[i];
+        if ((ins.opcode == Opcode::JMP && !isCall[i]) || ins.opcode == Opcode::SAVE)
+            ins.jmpAddr = newAddr[ins.jmpAddr];
+        else if (ins.opcode == Opcode::JMP_Z)
+            ins.jmp.jmpAddr = newAddr[ins.jmp.jmpAddr];
+    }
+}
+
+void DeadCodeEliminator::Run(Procedure& procedure) {
+    if (procedure.isExtern || procedure.instructions.empty())
+        return;
+    proc = &procedure;
+    numInstructions = procedure.instructions.size();
+    isRemoved.assign(numInstructions, false);
+    isCall.assign(numInstructions + 1, false);
+    for (auto [jumpIdx, callee] : procedure.calls)
+        isCall[jumpIdx] = true;
+
+    FindTargets();
+    FoldConstantBranches();
+    RemoveUnreachable();
+    RemoveJumpsToNext();
+    FindTargets();
+    while (RemoveDeadStores())
+        FindTargets();
+    Compact();
+}
+
+// Instructions of the callee's body, doubled for each loop around the call (up to 4 times)
+static constexpr size_t INLINE_SIZE_LIMIT = 12;
+static constexpr size_t INLINE_MAX_LOOP_DEPTH = 2;
+static constexpr size_t INLINE_DECLARED_SIZE_LIMIT = 512;
+// A caller stops growing here
+static constexpr size_t INLINE_CALLER_SIZE_LIMIT = 8192;
+
+namespace {
+
+class Inliner {
+    enum State : uint8_t { UNVISITED, IN_PROGRESS, DONE };
+
+    std::vector<Procedure>& procedures;
+    std::span<const uint32_t> procOfSymbol;
+    std::vector<uint8_t> states;
+    std::vector<uint8_t> isCall, isInlined; // Indexed by instruction of the caller
+    std::vector<int32_t> loopDepths;
+    std::vector<size_t> saveOf; // SAVE of the call returning to each instruction
+    std::vector<size_t> newAddr;
+    ArenaVector<Instruction> out;
+    ArenaVector<std::pair<size_t, SymbolId>> outCalls;
+    DeadCodeEliminator deadCodeEliminator;
+
+    void FindLoopDepths(const Procedure& caller);
+    bool InlineCalls(Procedure& caller);
+
+public:
+    Inliner(std::vector<Procedure>& procedures_, std::span<const uint32_t> procOfSymbol_)
+        : procedures{procedures_}, procOfSymbol{procOfSymbol_}, states(procedures_.size(), UNVISITED) {}
+
+    void Run();
+};
+
+}
+
+// Loops end in a jump back to their condition, everything in between is inside the loop
+void Inliner::FindLoopDepths(const Procedure& caller) {
+    const ArenaVector<Instruction>& instructions = caller.instructions;
+    loopDepths.assign(instructions.size() + 1, 0);
+    for (size_t i = 0; i < instructions.size(); ++i) {
+        const Instruction& ins = instructions[i];
+        if (ins.opcode == Opcode::JMP && !isCall[i] && ins.jmpAddr <= i) {
+            ++loopDepths[ins.jmpAddr];
+            --loopDepths[i + 1];
+        }
+    }
+    for (size_t i = 1; i < instructions.size(); ++i)
+        loopDepths[i] += loopDepths[i - 1];
+}
+
+// A call is SAVE, the arguments, then the jump. Inlined, the arguments are stored to fresh variable slots
+// past the caller's own, followed by the callee's body with its slots moved there and its returns jumping past it.
+// Every inlined body reuses the same slots, one finishes before the next starts (arguments come before the body).
+// Returns whether anything was inlined.
+bool Inliner::InlineCalls(Procedure& caller) {
+    ArenaVector<Instruction>& instructions = caller.instructions;
+    const size_t numInstructions = instructions.size();
+    isCall.assign(numInstructions + 1, false);
+    for (auto [jumpIdx, callee] : caller.calls)
+        isCall[jumpIdx] = true;
+    FindLoopDepths(caller);
+    saveOf.resize(numInstructions + 1);
+    for (size_t i = 0; i < numInstructions; ++i) {
+        if (instructions[i].opcode == Opcode::SAVE)
+            saveOf[instructions[i].jmpAddr] = i;
+    }
+
+    // Pick the calls, counting what each instruction becomes
+    isInlined.assign(numInstructions + 1, false);
+    newAddr.resize(numInstructions + 1);
+    std::ranges::fill(newAddr, 1);
+    size_t newSize = numInstructions;
+    size_t numExtraSlots = 0;
+    bool isAnyInlined = false;
+    for (auto [jumpIdx, symbol] : caller.calls) {
+        uint32_t calleeIdx = procOfSymbol[symbol];
+        if (calleeIdx == UINT32_MAX || states[calleeIdx] != DONE || !procedures[calleeIdx].isInlinable)
+            continue;
+        const Procedure& callee = procedures[calleeIdx];
+        const Instruction::StackFrame& frame = callee.instructions[0].frame;
+        // The ENTER goes, each parameter gets a store
+        size_t calleeSize = callee.instructions.size() - 1 + frame.numParams;
+        size_t sizeLimit = callee.isInline ? INLINE_DECLARED_SIZE_LIMIT
+            : INLINE_SIZE_LIMIT << std::min(static_cast<size_t>(loopDepths[jumpIdx]), INLINE_MAX_LOOP_DEPTH);
+        if (callee.instructions.size() - 1 > sizeLimit || newSize + calleeSize > INLINE_CALLER_SIZE_LIMIT)
+            continue;
+        isInlined[jumpIdx] = true;
+        isAnyInlined = true;
+        newAddr[jumpIdx] = calleeSize;
+        newAddr[saveOf[jumpIdx + 1]] = 0;
+        newSize = newSize + calleeSize - 2;
+        numExtraSlots = std::max(numExtraSlots, frame.numParams + frame.numLocals);
+    }
+    if (!isAnyInlined)
+        return false;
+    size_t addr = 0;
+    for (size_t i = 0; i <= numInstructions; ++i)
+        addr += std::exchange(newAddr[i], addr);
+
+    Instruction::StackFrame& callerFrame = instructions[0].frame;
+    const size_t base = callerFrame.numParams + callerFrame.numLocals;
+    out.clear();
+    outCalls.clear();
+    auto call = caller.calls.begin();
+    for (size_t i = 0; i < numInstructions; ++i) {
+        Instruction ins = instructions[i];
+        if (isCall[i]) {
+            SymbolId symbol = (call++)->second;
+            if (!isInlined[i]) {
+                outCalls.emplace_back(out.size(), symbol);
+                out.push_back(ins);
+                continue;
+            }
+            const Procedure& callee = procedures[procOfSymbol[symbol]];
+            const Instruction::StackFrame& frame = callee.instructions[0].frame;
+            for (size_t k = frame.numParams; k-- > 0;)
+                out.push_back(Instruction{.opcode=Opcode::STORE_FAST, .access={.varAddr=base + k, .accessSize=8}});
+            // Instruction t of the callee goes to bodyStart + t, its ENTER (at 0) is dropped
+            const size_t bodyStart = out.size() - 1;
+            const size_t end = bodyStart + callee.instructions.size();
+            auto calleeCall = callee.calls.begin();
+            for (size_t t = 1; t < callee.instructions.size(); ++t) {
+                Instruction calleeIns = callee.instructions[t];
+                switch (calleeIns.opcode) {
+                    case Opcode::LOAD_FAST:
+                    case Opcode::STORE_FAST: calleeIns.access.varAddr += base; break;
+                    case Opcode::JMP: {
+                        if (calleeCall != callee.calls.end() && calleeCall->first == t)
+                            outCalls.emplace_back(out.size(), (calleeCall++)->second);
+                        else
+                            calleeIns.jmpAddr += bodyStart;
+                    } break;
+                    case Opcode::SAVE: calleeIns.jmpAddr += bodyStart; break;
+                    case Opcode::JMP_Z: calleeIns.jmp.jmpAddr += bodyStart; break;
+                    case Opcode::RETURN_VOID:
+                    case Opcode::RETURN_VAL: calleeIns = Instruction{.opcode=Opcode::JMP, .jmpAddr=end}; break;
+                    default: break;
+                }
+                out.push_back(calleeIns);
+            }
+            continue;
+        }
+        if (newAddr[i] == newAddr[i + 1]) // SAVE of an inlined call
+            continue;
+        if (ins.opcode == Opcode::JMP || ins.opcode == Opcode::SAVE)
+            ins.jmpAddr = newAddr[ins.jmpAddr];
+        else if (ins.opcode == Opcode::JMP_Z)
+            ins.jmp.jmpAddr = newAddr[ins.jmp.jmpAddr];
+        out.push_back(ins);
+    }
+    assert(out.size() == newSize);
+
+    std::swap(instructions, out);
+    std::swap(caller.calls, outCalls);
+    instructions[0].frame.numLocals += numExtraSlots;
+    return true;
+}
+
+// Depth first over the calls, each procedure after everything it calls
+void Inliner::Run() {
+    std::vector<std::pair<uint32_t, size_t>> stack; // (procedure, next call)
+    for (uint32_t root = 0; root < procedures.size(); ++root) {
+        if (states[root] != UNVISITED)
+            continue;
+        states[root] = IN_PROGRESS;
+        stack.emplace_back(root, 0);
+        while (!stack.empty()) {
+            auto& [procIdx, nextCall] = stack.back();
+            Procedure& proc = procedures[procIdx];
+            if (nextCall < proc.calls.size()) {
+                uint32_t calleeIdx = procOfSymbol[proc.calls[nextCall++].second];
+                if (calleeIdx != UINT32_MAX && states[calleeIdx] == UNVISITED) {
+                    states[calleeIdx] = IN_PROGRESS;
+                    stack.emplace_back(calleeIdx, 0);
+                }
+                continue;
+            }
+            if (!proc.isExtern && InlineCalls(proc))
+                deadCodeEliminator.Run(proc);
+            states[procIdx] = DONE;
+            stack.pop_back();
+        }
+    }
+}
+
+void InlineProcedures(std::vector<Procedure>& procedures, std::span<const uint32_t> procOfSymbol) {
+    Inliner{procedures, procOfSymbol}.Run();
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "bytecode.hpp"
+
+#include <optional>
+#include <span>
+#include <vector>
+#include <stdint.h>
+
+struct Procedure;
+
+// Removes what can never run or never be read from a verified procedure (before linking):
+// branches on constants, code no path reaches, jumps to the next instruction,
+// and stores of side effect free expressions to variables that are not read before being overwritten.
+// Keeps its buffers from one procedure to the next, each analyzer has its own.
+class DeadCodeEliminator {
+    Procedure* proc = nullptr;
+    size_t numInstructions = 0;
+    // Instructions are only marked removed until the end, so addresses stay valid throughout.
+    // A removed instruction falls through to the next one.
+    std::vector<uint8_t> isRemoved;
+    std::vector<uint8_t> isCall; // Jumps to other procedures, they come back to the next instruction
+    std::vector<uint8_t> isTarget; // Something jumps or returns here
+    std::vector<uint8_t> isReached, isQueued;
+    std::vector<size_t> work;
+    std::vector<size_t> addrs; // Next kept instruction, or the new address of each instruction
+    // Liveness, see RemoveDeadStores
+    std::vector<size_t> blockStarts, blockOf, predecessorStarts, predecessors;
+    std::vector<uint64_t> used, written, liveIn, liveOut;
+
+    template<typename F>
+    void ForEachSuccessor(size_t i, F f) const;
+    template<typename F>
+    void ForEachSuccessorBlock(size_t block, F f) const;
+    [[nodiscard]] bool EndsBlock(size_t i) const;
+    [[nodiscard]] std::optional<size_t> PureExpressionStart(size_t storeIdx) const;
+    void ComputeLiveOut(size_t block, size_t numWords);
+
+    void FindTargets();
+    void FoldConstantBranches();
+    void RemoveUnreachable();
+    void RemoveJumpsToNext();
+    bool RemoveDeadStores();
+    void Compact();
+
+public:
+    void Run(Procedure& procedure);
+};
+
+// Copies the bodies of small procedures, and of procedures declared inline, into their callers
+// (after verifying, before linking), callees first so their own calls are already inlined.
+// Calls inside loops may copy bigger bodies. Recursive calls, extern and imported procedures are left as calls.
+// procOfSymbol maps the symbol of each procedure to its index, and every other symbol to UINT32_MAX.
+void InlineProcedures(std::vector<Procedure>& procedures, std::span<const uint32_t> procOfSymbol);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "arena.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// 0 means "use every hardware thread"
+inline size_t& MaxWorkerThreads() {
+    static size_t maxWorkers = 0;
+    return maxWorkers;
+}
+
+inline size_t NumWorkerThreads(size_t numItems) {
+    size_t numWorkers = MaxWorkerThreads();
+    if (numWorkers == 0)
+        numWorkers = std::max(1u, std::thread::hardware_concurrency());
+    return std::min(numWorkers, numItems);
+}
+
+// Calls fn(i) for every i in [0, n)
+// Items are handed out one at a time, so workers balance themselves when items are uneven.
+// The calling thread participates, so n <= 1 (or a single worker) never spawns a thread.
+// Spawned workers allocate from their own fork of the caller's arena.
+template<typename Fn>
+void ParallelFor(size_t n, Fn&& fn) {
+    size_t numWorkers = NumWorkerThreads(n);
+    if (numWorkers <= 1) {
+        for (size_t i = 0; i < n; ++i)
+            fn(i);
+        return;
+    }
+
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next.fetch_add(1, std::memory_order_relaxed);
+            i < n;
+            i = next.fetch_add(1, std::memory_order_relaxed))
+        {
+            fn(i);
+        }
+    };
+
+    Arena* parentArena = Arena::Current();
+    std::vector<std::thread> threads;
+    threads.reserve(numWorkers - 1);
+    for (size_t t = 1; t < numWorkers; ++t) {
+        threads.emplace_back([&worker, parentArena]() {
+            ArenaScope scope{parentArena != nullptr ? &parentArena->Fork() : nullptr};
+            worker();
+        });
+    }
+    worker();
+    for (std::thread& thread : threads)
+        thread.join();
+}
@@ -1,9 +1,12 @@
 #include "parser.hpp"
 #include "tokenizer.hpp"
 #include "compileerror.hpp"
+#include "parallel.hpp"
+#include "timereport.hpp"
 
 #include <array>
 #include <cassert>
+#include <optional>
 
 #include <charconv>
 static bool ParseLiteral(std::string_view text, auto& out) {
@@ -15,11 +18,12 @@ static bool ParseLiteral(std::string_view text, auto& out) {
 }
 
 const char* ASTKindName(ASTKind kind) {
-    static_assert(static_cast<uint32_t>(ASTKind::COUNT) == 32, "Exhaustive check of AST kinds failed");
+    static_assert(static_cast<uint32_t>(ASTKind::COUNT) == 33, "Exhaustive check of AST kinds failed");
     const std::array<const char*, static_cast<uint32_t>(ASTKind::COUNT)> ASTKindNames{
         "UNINITIALIZED",
         "PROGRAM",
         "PROCEDURE",
+        "IMPORT",
         "IF_STATEMENT",
         "FOR_STATEMENT",
         "RETURN_STATEMENT",
@@ -82,7 +86,7 @@ ASTIndex Parser::NewNode(ASTKind kind) {
 ASTIndex Parser::NewNodeFromToken(TokenIndex tokIdx, ASTKind kind) {
     ASTIndex idx = NewNode(kind);
     ASTNode& node = ast.tree[idx];
-    node.tokenIdx = tokIdx;
+    node.tokenIdx = PinToken(tokIdx);
     return idx;
 }
 
@@ -90,25 +94,68 @@ ASTIndex Parser::NewNodeFromLastToken(ASTKind kind) {
     return NewNodeFromToken(tokenIdx - 1, kind);
 }
 
-const Token& Parser::PeekCurrentToken() const {
-    if (tokenIdx >= tokens.size())
-        CompileErrorAt(tokens.back(), "Unexpected end of file (did you forget a closing curly brace?)");
-    return tokens[tokenIdx];
+bool Parser::AtEnd(TokenIndex idx) const {
+    return stream != nullptr ? !stream->Has(idx) : idx >= tokens.size();
 }
 
-const Token& Parser::PollCurrentToken() {
-    if (tokenIdx >= tokens.size())
-        CompileErrorAt(tokens.back(), "Unexpected end of file (did you forget a closing curly brace?)");
-    return tokens[tokenIdx++];
+Token Parser::TokenAt(TokenIndex idx) const {
+    return stream != nullptr ? (*stream)[idx] : tokens[idx];
 }
 
+TokenKind Parser::KindAt(TokenIndex idx) const {
+    return stream != nullptr ? stream->Kind(idx) : tokens.Kind(idx);
+}
+
+// The index a node stores for the token
+TokenIndex Parser::PinToken(TokenIndex idx) {
+    return stream != nullptr ? stream->Pin(idx) : idx;
+}
+
+// Nothing backtracks past the start of a statement, so the tokens before it can go
+void Parser::RetireTokens() {
+    if (stream != nullptr)
+        stream->Retire(tokenIdx);
+}
+
+Token Parser::PeekCurrentToken() const {
+    if (AtEnd(tokenIdx))
+        CompileErrorAt(stream != nullptr ? stream->Last() : tokens.back(), "Unexpected end of file (did you forget a closing curly brace?)");
+    return TokenAt(tokenIdx);
+}
+
+Token Parser::PollCurrentToken() {
+    Token token = PeekCurrentToken();
+    ++tokenIdx;
+    return token;
+}
+
+// Reserves an empty list, which is filled in by EndASTList
 ASTList Parser::NewASTList() {
     ast.lists.emplace_back();
     return static_cast<ASTList>(ast.lists.size() - 1);
 }
 
-void Parser::AddToASTList(ASTList list, ASTIndex idx) {
-    ast.lists[list].push_back(idx);
+size_t Parser::BeginASTList() {
+    return listScratch.size();
+}
+
+void Parser::AddToASTList(ASTIndex idx) {
+    listScratch.push_back(idx);
+}
+
+// Moves everything added since begin into the pool
+void Parser::EndASTList(ASTList list, size_t begin) {
+    ast.lists[list] = {
+        .offset = static_cast<uint32_t>(ast.listPool.size()),
+        .length = static_cast<uint32_t>(listScratch.size() - begin),
+    };
+    ast.listPool.insert(ast.listPool.end(), listScratch.begin() + static_cast<ptrdiff_t>(begin), listScratch.end());
+    listScratch.resize(begin);
+}
+
+uint32_t Parser::NewString(std::string_view text) {
+    ast.strings.push_back({ .buf = text.data(), .sz = text.size() });
+    return static_cast<uint32_t>(ast.strings.size() - 1);
 }
 
 static void PrintIndent(uint32_t depth) {
@@ -127,7 +174,7 @@ void Parser::PrintNode(ASTIndex rootIdx) const {
 // TODO: make freestanding or make templated fmt::formatter
 void Parser::PrintAST(ASTIndex rootIdx = AST_NULL, uint32_t depth = 0) const {
     auto PrintASTList = [&](ASTList body, uint32_t newDepth) {
-        for (ASTIndex childIdx : ast.lists[body])
+        for (ASTIndex childIdx : ast.GetList(body))
             PrintAST(childIdx, newDepth);
     };
 
@@ -135,8 +182,14 @@ void Parser::PrintAST(ASTIndex rootIdx = AST_NULL, uint32_t depth = 0) const {
 
     switch (root.kind) {
         case ASTKind::PROGRAM: {
+            PrintASTList(root.program.imports, depth);
             PrintASTList(root.program.procedures, depth);
         } break;
+        case ASTKind::IMPORT: {
+            PrintIndent(depth);
+            PrintNode(rootIdx);
+            fmt::print(stderr, "\n");
+        } break;
         case ASTKind::PROCEDURE: {
             fmt::print(stderr, "\n");
             PrintIndent(depth);
@@ -144,7 +197,7 @@ void Parser::PrintAST(ASTIndex rootIdx = AST_NULL, uint32_t depth = 0) const {
             fmt::print(stderr, "\n");
             PrintASTList(root.procedure.params, depth + 1);
             PrintIndent(depth + 1);
-            fmt::print(stderr, "-> {}\n\n", TypeKindName(root.procedure.retType));
+            fmt::print(stderr, "-> {}\n\n", TypeKindName(root.type));
             PrintASTList(root.procedure.body, depth + 1);
         } break;
         case ASTKind::IF_STATEMENT: {
@@ -153,22 +206,20 @@ void Parser::PrintAST(ASTIndex rootIdx = AST_NULL, uint32_t depth = 0) const {
             fmt::print(stderr, "\n");
             PrintAST(root.ifstmt.cond, depth + 1);
             PrintASTList(root.ifstmt.body, depth + 1);
-            if (root.ifstmt.elsestmt != AST_EMPTY) {
+            if (root.flags.hasElse) {
                 PrintIndent(depth);
                 fmt::print(stderr, "ELSE\n");
-                PrintASTList(root.ifstmt.elsestmt, depth + 1);
+                PrintASTList(root.ifstmt.ElseBody(), depth + 1);
             }
         } break;
         case ASTKind::FOR_STATEMENT: {
             PrintIndent(depth);
             PrintNode(rootIdx);
             fmt::print(stderr, "\n");
-            if (root.forstmt.init != AST_NULL) PrintAST(root.forstmt.init, depth + 1);
-            else { PrintIndent(depth + 1); fmt::print(stderr, "-\n"); }
-            if (root.forstmt.cond != AST_NULL) PrintAST(root.forstmt.cond, depth + 1);
-            else { PrintIndent(depth + 1); fmt::print(stderr, "-\n"); }
-            if (root.forstmt.incr != AST_NULL) PrintAST(root.forstmt.incr, depth + 1);
-            else { PrintIndent(depth + 1); fmt::print(stderr, "-\n"); }
+            for (ASTIndex clause : ast.GetList(root.forstmt.clauses)) {
+                if (clause != AST_NULL) PrintAST(clause, depth + 1);
+                else { PrintIndent(depth + 1); fmt::print(stderr, "-\n"); }
+            }
             PrintIndent(depth); fmt::print(stderr, "\n");
             PrintASTList(root.forstmt.body, depth + 1);
         } break;
@@ -183,8 +234,8 @@ void Parser::PrintAST(ASTIndex rootIdx = AST_NULL, uint32_t depth = 0) const {
             PrintIndent(depth);
             PrintNode(rootIdx);
             fmt::print(stderr, " ({} {}",
-                (root.defn.isConst ? "let" : "mut"),
-                TypeKindName(root.defn.type));
+                (root.flags.isConst ? "let" : "mut"),
+                TypeKindName(root.type));
             if (root.defn.arraySize != AST_NULL) {
                 fmt::print(stderr, "[]");
             }
@@ -247,7 +298,8 @@ void Parser::PrintAST(ASTIndex rootIdx = AST_NULL, uint32_t depth = 0) const {
         case ASTKind::STRING_LITERAL_EXPR: {
             PrintIndent(depth);
             PrintNode(rootIdx);
-            fmt::print(stderr, " ({})\n", std::string_view{root.literal.str.buf, root.literal.str.sz});
+            ASTNode::StringView str = ast.strings[root.literal.str];
+            fmt::print(stderr, " ({})\n", std::string_view{str.buf, str.sz});
         } break;
         case ASTKind::LVALUE_EXPR: {
             PrintIndent(depth);
@@ -335,8 +387,11 @@ ASTIndex Parser::ParseVarDefn() {
         "Invalid variable declaration, expected identifier after type");
 
     ASTIndex defn = NewNodeFromLastToken(ASTKind::DEFINITION);
-    ast.tree[defn].defn.isConst = letOrMut.kind == TokenKind::LET;
-    ast.tree[defn].defn.type = type;
+    // The analyzer reports initializer errors at the token after the name, keep it next to the name
+    if (stream != nullptr && !AtEnd(tokenIdx))
+        PinToken(tokenIdx);
+    ast.tree[defn].flags.isConst = letOrMut.kind == TokenKind::LET;
+    ast.tree[defn].type = type;
     ast.tree[defn].defn.arraySize = arrSize;
 
     return defn;
@@ -379,13 +434,19 @@ ASTIndex Parser::ParseIf() {
 
     if (PollCurrentToken().kind != TokenKind::RPAREN)
         CompileErrorAt(lparen, "Unmatched parenthesis after \"if\" statement");
-    ast.tree[ifStmt].ifstmt.body = ParseBody();
+    // The else body is always the next list, so both are reserved before any nested list
+    ASTList body = NewASTList();
+    [[maybe_unused]] ASTList elseBody = NewASTList();
+    ast.tree[ifStmt].ifstmt.body = body;
+    assert(ast.tree[ifStmt].ifstmt.ElseBody() == elseBody);
+    ParseBody(body);
 
     // Parse optional else
     const Token& maybeElse = PeekCurrentToken();
     if (maybeElse.kind == TokenKind::ELSE) {
         ++tokenIdx;
-        ast.tree[ifStmt].ifstmt.elsestmt = ParseBody();
+        ast.tree[ifStmt].flags.hasElse = true;
+        ParseBody(ast.tree[ifStmt].ifstmt.ElseBody());
     }
 
     return ifStmt;
@@ -415,7 +476,9 @@ ASTIndex Parser::ParseCall() {
         return call;
     }
 
-    ast.tree[call].call.args = NewASTList();
+    ASTList args = NewASTList();
+    ast.tree[call].call.args = args;
+    size_t argsBegin = BeginASTList();
 
     // At least one argument, continue
     while (true) {
@@ -424,7 +487,7 @@ ASTIndex Parser::ParseCall() {
             CompileErrorAt(PeekCurrentToken(),
                 "Invalid argument, excpected comma separated expression list");
 
-        AddToASTList(ast.tree[call].call.args, arg);
+        AddToASTList(arg);
 
         const Token& commaOrClose = PollCurrentToken();
         if (commaOrClose.kind == TokenKind::RPAREN) {
@@ -434,6 +497,7 @@ ASTIndex Parser::ParseCall() {
             CompileErrorAt(commaOrClose, "Unexpected token, excpected \",\" or \")\") in argument list");
         }
     }
+    EndASTList(args, argsBegin);
 
     return call;
 }
@@ -493,6 +557,9 @@ ASTIndex Parser::ParseFor() {
     const Token& lparen = PollCurrentToken();
     if (lparen.kind != TokenKind::LPAREN)
         CompileErrorAt(lparen, "Expected \"(\" after \"for\"");
+    ASTList clauses = NewASTList();
+    ast.tree[forStmt].forstmt.clauses = clauses;
+    size_t clausesBegin = BeginASTList();
     ASTIndex init = ParseVarDefnAsgn();
     if (init == AST_NULL) {
         const Token& semi = PeekCurrentToken();
@@ -500,7 +567,7 @@ ASTIndex Parser::ParseFor() {
             CompileErrorAt(semi, "Invalid declaration");
     }
     ExpectAndConsumeToken(TokenKind::SEMICOLON, "Expected semicolon after for statement initializer");
-    ast.tree[forStmt].forstmt.init = init;
+    AddToASTList(init);
 
     ASTIndex cond = ParseExpression();
     if (cond == AST_NULL) {
@@ -509,7 +576,7 @@ ASTIndex Parser::ParseFor() {
             CompileErrorAt(semi, "Invalid condition");
     }
     ExpectAndConsumeToken(TokenKind::SEMICOLON, "Expected semicolon after for statement condition");
-    ast.tree[forStmt].forstmt.cond = cond;
+    AddToASTList(cond);
 
     ASTIndex incr = ParseAssignment();
     if (incr == AST_NULL) {
@@ -519,14 +586,16 @@ ASTIndex Parser::ParseFor() {
     }
     if (PollCurrentToken().kind != TokenKind::RPAREN)
         CompileErrorAt(lparen, "Unmatched parenthesis after \"for\" statement");
-    ast.tree[forStmt].forstmt.incr = incr;
+    AddToASTList(incr);
+    EndASTList(clauses, clausesBegin);
 
     ast.tree[forStmt].forstmt.body = ParseBody();
 
     return forStmt;
 }
 
-ASTIndex Parser::ParseFactor() {
+// Factors without prefix operators or parentheses, those are handled by ParseExpression
+ASTIndex Parser::ParseOperand() {
     const Token& tok = PeekCurrentToken();
     if (tok.kind == TokenKind::INTEGER_LITERAL) {
         ++tokenIdx;
@@ -546,7 +615,7 @@ ASTIndex Parser::ParseFactor() {
         ++tokenIdx;
         ASTIndex lit = NewNodeFromLastToken(ASTKind::STRING_LITERAL_EXPR);
         // TODO: Concatenated string literals
-        ast.tree[lit].literal.str = { .buf = tok.text.data(), .sz = tok.text.size() };
+        ast.tree[lit].literal.str = NewString(tok.text);
         return lit;
     }
     else if (tok.kind == TokenKind::CHAR_LITERAL) {
@@ -560,34 +629,6 @@ ASTIndex Parser::ParseFactor() {
         );
         return lit;
     }
-    else if (tok.kind == TokenKind::OPERATOR_NEG) {
-        ++tokenIdx;
-        ASTIndex neg = NewNodeFromLastToken(ASTKind::NEG_UNARYOP_EXPR);
-        ASTIndex expr = ParseFactor();
-        if (expr == AST_NULL)
-            CompileErrorAt(tok, "Expected factor after \"-\"");
-        ast.tree[neg].unaryOp.expr = expr;
-        return neg;
-    }
-    else if (tok.kind == TokenKind::OPERATOR_NOT) {
-        ++tokenIdx;
-        ASTIndex neg = NewNodeFromLastToken(ASTKind::NOT_UNARYOP_EXPR);
-        ASTIndex expr = ParseFactor();
-        if (expr == AST_NULL)
-            CompileErrorAt(tok, "Expected factor after \"!\"");
-        ast.tree[neg].unaryOp.expr = expr;
-        return neg;
-    }
-    else if (tok.kind == TokenKind::LPAREN) {
-        // Parenthesized expression
-        ++tokenIdx;
-        ASTIndex expr = ParseExpression();
-        if (expr == AST_NULL)
-            CompileErrorAt(tok, "Expected expression after \"(\"");
-        if (PollCurrentToken().kind != TokenKind::RPAREN)
-            CompileErrorAt(tok, "Unmatched parenthesis");
-        return expr;
-    }
     else if (tok.kind == TokenKind::IDENTIFIER) {
         // LValue or ProcedureCall
         ASTIndex call = ParseCall();
@@ -599,158 +640,129 @@ ASTIndex Parser::ParseFactor() {
     return AST_NULL;
 }
 
-ASTIndex Parser::ParseTerm() {
-    ASTIndex left = ParseFactor();
-    if (left == AST_NULL)
-        return AST_NULL;
-    while (true) {
-        const Token& delim = PeekCurrentToken();
-        if (delim.kind != TokenKind::OPERATOR_MUL &&
-            delim.kind != TokenKind::OPERATOR_DIV &&
-            delim.kind != TokenKind::OPERATOR_MOD)
-        {
-            break;
-        }
-        TokenIndex op = tokenIdx++;
-        ASTIndex right = ParseFactor();
-        if (right == AST_NULL) {
-            tokenIdx = op;
-            return AST_NULL;
-        }
-        ASTIndex binop = NewNodeFromToken(op,
-            delim.kind == TokenKind::OPERATOR_MUL ? ASTKind::MUL_BINARYOP_EXPR :
-            delim.kind == TokenKind::OPERATOR_DIV ? ASTKind::DIV_BINARYOP_EXPR : ASTKind::MOD_BINARYOP_EXPR);
-        ast.tree[binop].binaryOp.left = left;
-        ast.tree[binop].binaryOp.right = right;
-        left = binop;
-    }
-    return left;
-}
+// Binary operators indexed by token kind, precedence 0 means the token is not a binary operator
+// Higher precedence binds tighter, every operator is left associative
+// Adding an operator (or a level) only requires an entry here
+struct BinaryOperator {
+    uint8_t precedence;
+    ASTKind kind;
+};
+
+static constexpr auto BINARY_OPERATORS = []() {
+    std::array<BinaryOperator, static_cast<size_t>(TokenKind::TOKEN_COUNT)> table{};
+    auto Set = [&](TokenKind tok, uint8_t precedence, ASTKind kind) {
+        table[static_cast<size_t>(tok)] = { precedence, kind };
+    };
+    Set(TokenKind::OPERATOR_OR,  1, ASTKind::OR_BINARYOP_EXPR);
+    Set(TokenKind::OPERATOR_AND, 2, ASTKind::AND_BINARYOP_EXPR);
+    Set(TokenKind::OPERATOR_EQ,  3, ASTKind::EQ_BINARYOP_EXPR);
+    Set(TokenKind::OPERATOR_NE,  3, ASTKind::NE_BINARYOP_EXPR);
+    Set(TokenKind::OPERATOR_GE,  4, ASTKind::GE_BINARYOP_EXPR);
+    Set(TokenKind::OPERATOR_GT,  4, ASTKind::GT_BINARYOP_EXPR);
+    Set(TokenKind::OPERATOR_LE,  4, ASTKind::LE_BINARYOP_EXPR);
+    Set(TokenKind::OPERATOR_LT,  4, ASTKind::LT_BINARYOP_EXPR);
+    Set(TokenKind::OPERATOR_POS, 5, ASTKind::ADD_BINARYOP_EXPR);
+    Set(TokenKind::OPERATOR_NEG, 5, ASTKind::SUB_BINARYOP_EXPR);
+    Set(TokenKind::OPERATOR_MUL, 6, ASTKind::MUL_BINARYOP_EXPR);
+    Set(TokenKind::OPERATOR_DIV, 6, ASTKind::DIV_BINARYOP_EXPR);
+    Set(TokenKind::OPERATOR_MOD, 6, ASTKind::MOD_BINARYOP_EXPR);
+    return table;
+}();
+
+// Precedence climbing, with the recursion kept on an explicit stack (exprStack)
+// so deep nesting and long operator chains only grow the stack, not the native one.
+// Each BINARY frame parses operators that bind at least as tight as its minPrecedence,
+// UNARY and PAREN frames wrap the factor that ends up on top of them.
+// let i64 x = 4 % 1 + !"asd" / 2.0 && a > -(8 + 2) * 3;
+ASTIndex Parser::ParseExpression() {
+    const size_t base = exprStack.size();
+    exprStack.push_back({ .kind = ExprFrame::BINARY, .minPrecedence = 1 });
 
-ASTIndex Parser::ParseValue() {
-    ASTIndex left = ParseTerm();
-    if (left == AST_NULL)
-        return AST_NULL;
+    ASTIndex result = AST_NULL;
+    bool needFactor = true;
     while (true) {
-        const Token& delim = PeekCurrentToken();
-        if (delim.kind != TokenKind::OPERATOR_POS && delim.kind != TokenKind::OPERATOR_NEG)
-            break;
-        TokenIndex op = tokenIdx++;
-        ASTIndex right = ParseTerm();
-        if (right == AST_NULL) {
-            tokenIdx = op;
-            return AST_NULL;
+        if (needFactor) {
+            // Prefix operators and parentheses nest, the innermost factor completes them in reverse
+            const Token& tok = PeekCurrentToken();
+            if (tok.kind == TokenKind::OPERATOR_NEG || tok.kind == TokenKind::OPERATOR_NOT) {
+                ++tokenIdx;
+                ASTIndex unary = NewNodeFromLastToken(tok.kind == TokenKind::OPERATOR_NEG ?
+                    ASTKind::NEG_UNARYOP_EXPR : ASTKind::NOT_UNARYOP_EXPR);
+                exprStack.push_back({ .kind = ExprFrame::UNARY, .op = tokenIdx - 1, .node = unary });
+                continue;
+            }
+            if (tok.kind == TokenKind::LPAREN) {
+                ++tokenIdx;
+                exprStack.push_back({ .kind = ExprFrame::PAREN, .op = tokenIdx - 1 });
+                exprStack.push_back({ .kind = ExprFrame::BINARY, .minPrecedence = 1 });
+                continue;
+            }
+            result = ParseOperand();
+            needFactor = false;
         }
-        ASTIndex binop = NewNodeFromToken(op, delim.kind == TokenKind::OPERATOR_POS ?
-            ASTKind::ADD_BINARYOP_EXPR : ASTKind::SUB_BINARYOP_EXPR);
-        ast.tree[binop].binaryOp.left = left;
-        ast.tree[binop].binaryOp.right = right;
-        left = binop;
-    }
-    return left;
-}
 
-ASTIndex Parser::ParseComparison() {
-    ASTIndex left = ParseValue();
-    if (left == AST_NULL)
-        return AST_NULL;
-    while (true) {
-        const Token& delim = PeekCurrentToken();
-        if (delim.kind != TokenKind::OPERATOR_GE && delim.kind != TokenKind::OPERATOR_LE &&
-            delim.kind != TokenKind::OPERATOR_GT && delim.kind != TokenKind::OPERATOR_LT)
-        {
-            break;
+        if (exprStack.size() == base)
+            return result;
+
+        ExprFrame& frame = exprStack.back();
+        if (frame.kind == ExprFrame::UNARY) {
+            if (result == AST_NULL) {
+                const Token& tok = TokenAt(frame.op);
+                CompileErrorAt(tok, "Expected factor after \"{}\"", tok.text);
+            }
+            ast.tree[frame.node].unaryOp.expr = result;
+            result = frame.node;
+            exprStack.pop_back();
+            continue;
         }
-        TokenIndex op = tokenIdx++;
-        ASTIndex right = ParseValue();
-        if (right == AST_NULL) {
-            tokenIdx = op;
-            return AST_NULL;
+        if (frame.kind == ExprFrame::PAREN) {
+            const Token& tok = TokenAt(frame.op);
+            if (result == AST_NULL)
+                CompileErrorAt(tok, "Expected expression after \"(\"");
+            if (PollCurrentToken().kind != TokenKind::RPAREN)
+                CompileErrorAt(tok, "Unmatched parenthesis");
+            exprStack.pop_back();
+            continue;
         }
-        ASTIndex binop = NewNodeFromToken(op,
-            delim.kind == TokenKind::OPERATOR_GE ? ASTKind::GE_BINARYOP_EXPR :
-            delim.kind == TokenKind::OPERATOR_LE ? ASTKind::LE_BINARYOP_EXPR :
-            delim.kind == TokenKind::OPERATOR_GT ? ASTKind::GT_BINARYOP_EXPR : ASTKind::LT_BINARYOP_EXPR);
-        ast.tree[binop].binaryOp.left = left;
-        ast.tree[binop].binaryOp.right = right;
-        left = binop;
-    }
-    return left;
-}
 
-ASTIndex Parser::ParseLogicalFactor() {
-    ASTIndex left = ParseComparison();
-    if (left == AST_NULL)
-        return AST_NULL;
-    while (true) {
-        const Token& delim = PeekCurrentToken();
-        if (delim.kind != TokenKind::OPERATOR_EQ && delim.kind != TokenKind::OPERATOR_NE)
-            break;
-        TokenIndex op = tokenIdx++;
-        ASTIndex right = ParseComparison();
-        if (right == AST_NULL) {
-            tokenIdx = op;
-            return AST_NULL;
+        // The result is either the first factor or the right operand of the pending operator
+        if (frame.op == TOKEN_NULL) {
+            if (result == AST_NULL) {
+                exprStack.pop_back();
+                continue;
+            }
+            frame.node = result;
         }
-        ASTIndex binop = NewNodeFromToken(op, delim.kind == TokenKind::OPERATOR_EQ ?
-            ASTKind::EQ_BINARYOP_EXPR : ASTKind::NE_BINARYOP_EXPR);
-        ast.tree[binop].binaryOp.left = left;
-        ast.tree[binop].binaryOp.right = right;
-        left = binop;
-    }
-    return left;
-}
-
-ASTIndex Parser::ParseLogicalTerm() {
-    ASTIndex left = ParseLogicalFactor();
-    if (left == AST_NULL)
-        return AST_NULL;
-    while (true) {
-        const Token& delim = PeekCurrentToken();
-        if (delim.kind != TokenKind::OPERATOR_AND)
-            break;
-        TokenIndex op = tokenIdx++;
-        ASTIndex right = ParseLogicalFactor();
-        if (right == AST_NULL) {
-            tokenIdx = op;
-            return AST_NULL;
+        else {
+            if (result == AST_NULL) {
+                // TODO: Should an error be thrown here?
+                // In this case, token index does not have to be saved
+                // TODO: Compare existing error messages to clang and gcc and improve where necessary
+                tokenIdx = frame.op;
+                exprStack.pop_back();
+                continue;
+            }
+            ASTIndex binop = NewNodeFromToken(frame.op, BINARY_OPERATORS[static_cast<size_t>(KindAt(frame.op))].kind);
+            ast.tree[binop].binaryOp.left = frame.node;
+            ast.tree[binop].binaryOp.right = result;
+            frame.node = binop;
+            frame.op = TOKEN_NULL;
         }
-        ASTIndex binop = NewNodeFromToken(op, ASTKind::AND_BINARYOP_EXPR);
-        ast.tree[binop].binaryOp.left = left;
-        ast.tree[binop].binaryOp.right = right;
-        left = binop;
-    }
-    return left;
-}
 
-// let i64 x = 4 % 1 + !"asd" / 2.0 && a > -(8 + 2) * 3;
-// TODO: Pratt parsing for binary operators, remove repetitive functions
-ASTIndex Parser::ParseExpression() {
-    ASTIndex left = ParseLogicalTerm();
-    if (left == AST_NULL)
-        return AST_NULL;
-    while (true) {
-        const Token& delim = PeekCurrentToken();
-        if (delim.kind != TokenKind::OPERATOR_OR)
-            break;
-        TokenIndex op = tokenIdx++;
-        ASTIndex right = ParseLogicalTerm();
-        if (right == AST_NULL) {
-            // TODO: Should an error be thrown here?
-            // In this case, token index does not have to be saved
-            // TODO: Compare existing error messages to clang and gcc and improve where necessary
-            tokenIdx = op;
-            return AST_NULL;
+        BinaryOperator binaryOp = BINARY_OPERATORS[static_cast<size_t>(PeekCurrentToken().kind)];
+        if (binaryOp.precedence == 0 || binaryOp.precedence < frame.minPrecedence) {
+            result = frame.node;
+            exprStack.pop_back();
+            continue;
         }
-        ASTIndex binop = NewNodeFromToken(op, ASTKind::OR_BINARYOP_EXPR);
-        ast.tree[binop].binaryOp.left = left;
-        ast.tree[binop].binaryOp.right = right;
-        left = binop;
+        frame.op = tokenIdx++;
+        exprStack.push_back({ .kind = ExprFrame::BINARY, .minPrecedence = static_cast<uint8_t>(binaryOp.precedence + 1) });
+        needFactor = true;
     }
-    return left;
 }
 
 ASTIndex Parser::ParseStatement() {
+    RetireTokens();
     const Token& tok = PeekCurrentToken();
     if (tok.kind == TokenKind::IF) {
         return ParseIf();
@@ -790,6 +802,7 @@ ASTIndex Parser::ParseStatement() {
         ++tokenIdx;
         ASTIndex asmKw = NewNodeFromLastToken(ASTKind::ASM_STATEMENT);
         ASTList strings = NewASTList();
+        size_t stringsBegin = BeginASTList();
         bool first = true;
         while (true) {
             const Token& strlit = PeekCurrentToken();
@@ -801,9 +814,10 @@ ASTIndex Parser::ParseStatement() {
             first = false;
             ++tokenIdx;
             ASTIndex expr = NewNodeFromLastToken(ASTKind::STRING_LITERAL_EXPR);
-            ast.tree[expr].literal.str = { .buf = strlit.text.data(), .sz = strlit.text.size() };
-            AddToASTList(strings, expr);
+            ast.tree[expr].literal.str = NewString(strlit.text);
+            AddToASTList(expr);
         }
+        EndASTList(strings, stringsBegin);
         ast.tree[asmKw].asm_.strings = strings;
         // FIXME: report error at the actual token
         ExpectAndConsumeToken(TokenKind::SEMICOLON, "Expected semicolon after asm");
@@ -828,9 +842,9 @@ ASTIndex Parser::ParseStatement() {
     return expr;
 }
 
-ASTList Parser::ParseBody() {
+void Parser::ParseBody(ASTList body) {
     const Token& maybeCurly = PeekCurrentToken();
-    ASTList body = NewASTList();
+    size_t bodyBegin = BeginASTList();
 
     if (maybeCurly.kind == TokenKind::LCURLY) {
         // Parse entire block
@@ -844,15 +858,21 @@ ASTList Parser::ParseBody() {
 
             ASTIndex stmt = ParseStatement();
             assert(stmt != AST_NULL);
-            AddToASTList(body, stmt);
+            AddToASTList(stmt);
         }
     }
     else {
         // Parse single statement
         ASTIndex stmt = ParseStatement();
         assert(stmt != AST_NULL);
-        AddToASTList(body, stmt);
+        AddToASTList(stmt);
     }
+    EndASTList(body, bodyBegin);
+}
+
+ASTList Parser::ParseBody() {
+    ASTList body = NewASTList();
+    ParseBody(body);
     return body;
 }
 
@@ -864,6 +884,7 @@ ASTIndex Parser::ParseProcedure() {
     bool isCdecl = false;
     bool isExtern = false;
     bool isPublic = false;
+    bool isInline = false;
     while (true) {
         const Token& annotation = PeekCurrentToken();
         if (annotation.kind == TokenKind::CDECL) {
@@ -884,10 +905,17 @@ ASTIndex Parser::ParseProcedure() {
                 CompileErrorAt(annotation, "Duplicate annotation \"public\"");
             isPublic = true;
         }
+        else if (annotation.kind == TokenKind::INLINE) {
+            ++tokenIdx;
+            if (isInline)
+                CompileErrorAt(annotation, "Duplicate annotation \"inline\"");
+            isInline = true;
+        }
         else break;
     }
     // Annotation rules:
     // !(public & extern)
+    // !(inline & extern)
     // cdecl => extern
     if (isCdecl && !isExtern) {
         CompileErrorAt(PeekCurrentToken(), "Non-extern procedure cannot be declared \"cdecl\"");
@@ -895,6 +923,9 @@ ASTIndex Parser::ParseProcedure() {
     if (isPublic && isExtern) {
         CompileErrorAt(PeekCurrentToken(), "Procedure cannot be declared \"public\" and \"extern\"");
     }
+    if (isInline && isExtern) {
+        CompileErrorAt(PeekCurrentToken(), "Procedure cannot be declared \"inline\" and \"extern\"");
+    }
 
     ExpectAndConsumeToken(TokenKind::IDENTIFIER,
         "Expected identifier after \"proc\"");
@@ -902,9 +933,10 @@ ASTIndex Parser::ParseProcedure() {
     ExpectAndConsumeToken(TokenKind::LPAREN,
         "Expected \"(\" after procedure name");
 
-    ast.tree[proc].procedure.isCdecl = isCdecl;
-    ast.tree[proc].procedure.isExtern = isExtern;
-    ast.tree[proc].procedure.isPublic = isPublic;
+    ast.tree[proc].flags.isCdecl = isCdecl;
+    ast.tree[proc].flags.isExtern = isExtern;
+    ast.tree[proc].flags.isPublic = isPublic;
+    ast.tree[proc].flags.isInline = isInline;
 
     const Token& nextTok = PeekCurrentToken();
     if (nextTok.kind == TokenKind::RPAREN) {
@@ -914,13 +946,14 @@ ASTIndex Parser::ParseProcedure() {
     else if (nextTok.kind == TokenKind::LET || nextTok.kind == TokenKind::MUT) {
         // At least one parameter, continue
         ASTList params = ast.tree[proc].procedure.params = NewASTList();
+        size_t paramsBegin = BeginASTList();
         while (true) {
             ASTIndex param = ParseVarDefn();
             if (param == AST_NULL)
                 CompileErrorAt(PeekCurrentToken(),
                     "Unexpected token, excpected comma separated parameter list");
 
-            AddToASTList(params, param);
+            AddToASTList(param);
 
             const Token& commaOrClose = PollCurrentToken();
             if (commaOrClose.kind == TokenKind::RPAREN) {
@@ -931,6 +964,7 @@ ASTIndex Parser::ParseProcedure() {
             }
 
         }
+        EndASTList(params, paramsBegin);
     }
     else {
         CompileErrorAt(PeekCurrentToken(), "Unexpected token after procedure definition, expected variable definition or closing parenthesis");
@@ -945,22 +979,79 @@ ASTIndex Parser::ParseProcedure() {
         //     CompileErrorAt(arrowOrCurly, "Returning arrays is not allowed!");
         // }
 
-        ast.tree[proc].procedure.retType = retType;
-        ast.tree[proc].procedure.retIsArray = arrSize != AST_NULL;
+        ast.tree[proc].type = retType;
+        ast.tree[proc].flags.retIsArray = arrSize != AST_NULL;
     }
 
-    ast.tree[proc].procedure.body = isExtern ? AST_EMPTY : ParseBody();
+    if (isExtern) {
+        ast.tree[proc].procedure.body = AST_EMPTY;
+    }
+    else if (deferBodies && PeekCurrentToken().kind == TokenKind::LCURLY) {
+        ast.tree[proc].flags.isDeferred = true;
+        ast.tree[proc].procedure.body = tokenIdx;
+        SkipBlock();
+    }
+    else {
+        ast.tree[proc].procedure.body = ParseBody();
+    }
 
     return proc;
 }
 
+// Skips a block by matching curly braces, nothing inside is looked at
+void Parser::SkipBlock() {
+    size_t depth = 0;
+    do {
+        TokenKind kind = PollCurrentToken().kind;
+        if (kind == TokenKind::LCURLY) ++depth;
+        else if (kind == TokenKind::RCURLY) --depth;
+    } while (depth > 0);
+}
+
+void Parser::ParseDeferredBody(ASTIndex procIdx) {
+    if (!ast.tree[procIdx].flags.isDeferred)
+        return;
+    tokenIdx = ast.tree[procIdx].procedure.body;
+    ASTList body = ParseBody();
+    ast.tree[procIdx].procedure.body = body;
+    ast.tree[procIdx].flags.isDeferred = false;
+    assert(listScratch.empty());
+}
+
+// import "path/relative/to/this/file.trash";
+ASTIndex Parser::ParseImport() {
+    ExpectAndConsumeToken(TokenKind::IMPORT,
+        "Invalid import, expected \"import\"");
+    ExpectAndConsumeToken(TokenKind::STRING_LITERAL,
+        "Invalid import, expected file name in quotes after \"import\"");
+    ASTIndex import = NewNodeFromLastToken(ASTKind::IMPORT);
+    ExpectAndConsumeToken(TokenKind::SEMICOLON,
+        "Invalid import, expected \";\" after file name");
+    return import;
+}
+
 void Parser::ParseProgram() {
-    ASTIndex allProcs = NewASTList();
-    while (tokenIdx < tokens.size()) {
+    ASTList allImports = NewASTList();
+    size_t importsBegin = BeginASTList();
+    while (!AtEnd(tokenIdx) && PeekCurrentToken().kind == TokenKind::IMPORT) {
+        RetireTokens();
+        AddToASTList(ParseImport());
+    }
+    EndASTList(allImports, importsBegin);
+    ast.tree[0].program.imports = allImports;
+
+    ASTList allProcs = NewASTList();
+    size_t procsBegin = BeginASTList();
+    while (!AtEnd(tokenIdx)) {
+        RetireTokens();
+        const Token& tok = PeekCurrentToken();
+        if (tok.kind == TokenKind::IMPORT)
+            CompileErrorAt(tok, "Imports must come before every procedure");
         ASTIndex proc = ParseProcedure();
         assert(proc != AST_NULL);
-        AddToASTList(allProcs, proc);
+        AddToASTList(proc);
     }
+    EndASTList(allProcs, procsBegin);
     ast.tree[0].program.procedures = allProcs;
 }
 
@@ -969,18 +1060,214 @@ void Parser::ParseEntireProgram() {
     // Null indices are valid if the field is optional (for instance, for statement condition)
     tokenIdx = 1;              // TokenIndex TOKEN_NULL
     NewNode(ASTKind::PROGRAM); // ASTIndex AST_NULL
-    NewASTList();              // ASTList AST_EMPTY
+    NewASTList();              // ASTList AST_EMPTY (zero length span)
     assert(!tokens.empty() && tokens[0].kind == TokenKind::NONE);
     assert(ast.tree.size() == 1);
     assert(ast.lists.size() == 1);
 
     ParseProgram();
+    assert(listScratch.empty());
 }
 
-AST ParseEntireProgram(const std::vector<Token>& tokens) {
+AST ParseEntireProgram(const TokenList& tokens, ParseMode mode) {
+    assert(mode != ParseMode::STREAM_TOKENS);
     AST ast;
-    Parser parser{tokens, ast};
+    Parser parser{tokens, ast, mode};
     parser.ParseEntireProgram();
     // parser.PrintAST();
     return ast;
 }
+
+// Shift every index stored in a node appended from another segment
+static void RebaseNode(ASTNode& node, TokenIndex tokenOffset, ASTIndex nodeOffset, ASTList listOffset, uint32_t stringOffset) {
+    auto RebaseIndex = [&](ASTIndex& idx) { if (idx != AST_NULL) idx += nodeOffset; };
+    auto RebaseList = [&](ASTList& list) { if (list != AST_EMPTY) list += listOffset; };
+
+    if (node.tokenIdx != TOKEN_NULL)
+        node.tokenIdx += tokenOffset;
+
+    switch (node.kind) {
+        case ASTKind::PROCEDURE: {
+            RebaseList(node.procedure.params);
+            if (node.flags.isDeferred)
+                node.procedure.body += tokenOffset;
+            else
+                RebaseList(node.procedure.body);
+        } break;
+        case ASTKind::IF_STATEMENT: {
+            RebaseIndex(node.ifstmt.cond);
+            RebaseList(node.ifstmt.body); // Else body moves along with it
+        } break;
+        case ASTKind::FOR_STATEMENT: {
+            RebaseList(node.forstmt.clauses);
+            RebaseList(node.forstmt.body);
+        } break;
+        case ASTKind::RETURN_STATEMENT: {
+            RebaseIndex(node.ret.expr);
+        } break;
+        case ASTKind::ASM_STATEMENT: {
+            RebaseList(node.asm_.strings);
+        } break;
+        case ASTKind::DEFINITION: {
+            RebaseIndex(node.defn.arraySize);
+            RebaseIndex(node.defn.initExpr);
+        } break;
+        case ASTKind::ASSIGN: {
+            RebaseIndex(node.asgn.lvalue);
+            RebaseIndex(node.asgn.rvalue);
+        } break;
+        case ASTKind::NEG_UNARYOP_EXPR:
+        case ASTKind::NOT_UNARYOP_EXPR: {
+            RebaseIndex(node.unaryOp.expr);
+        } break;
+        case ASTKind::EQ_BINARYOP_EXPR:
+        case ASTKind::NE_BINARYOP_EXPR:
+        case ASTKind::GE_BINARYOP_EXPR:
+        case ASTKind::GT_BINARYOP_EXPR:
+        case ASTKind::LE_BINARYOP_EXPR:
+        case ASTKind::LT_BINARYOP_EXPR:
+        case ASTKind::AND_BINARYOP_EXPR:
+        case ASTKind::OR_BINARYOP_EXPR:
+        case ASTKind::ADD_BINARYOP_EXPR:
+        case ASTKind::SUB_BINARYOP_EXPR:
+        case ASTKind::MUL_BINARYOP_EXPR:
+        case ASTKind::DIV_BINARYOP_EXPR:
+        case ASTKind::MOD_BINARYOP_EXPR: {
+            RebaseIndex(node.binaryOp.left);
+            RebaseIndex(node.binaryOp.right);
+        } break;
+        case ASTKind::LVALUE_EXPR: {
+            RebaseIndex(node.lvalue.subscript);
+        } break;
+        case ASTKind::CALL_EXPR: {
+            RebaseList(node.call.args);
+        } break;
+        case ASTKind::STRING_LITERAL_EXPR: {
+            node.literal.str += stringOffset;
+        } break;
+        case ASTKind::INTEGER_LITERAL_EXPR:
+        case ASTKind::FLOAT_LITERAL_EXPR:
+        case ASTKind::CHAR_LITERAL_EXPR:
+        case ASTKind::IMPORT:
+        case ASTKind::CONTINUE_STATEMENT:
+        case ASTKind::BREAK_STATEMENT: break;
+
+        case ASTKind::UNINITIALIZED:
+        case ASTKind::PROGRAM:
+        case ASTKind::COUNT: assert(0); break;
+    }
+}
+
+static AST ParseFile(const std::vector<File>& files, size_t fileId, TokenList& tokens, ParseMode mode) {
+    if (mode != ParseMode::STREAM_TOKENS) {
+        tokens = TokenizeFile(files, fileId);
+        return ParseEntireProgram(tokens, mode);
+    }
+
+    AST ast;
+    tokens = TokenList{files};
+    TokenStream stream{files, fileId, tokens};
+    Parser parser{stream, tokens, ast};
+    parser.ParseEntireProgram();
+    return ast;
+}
+
+AST ParseEntireSource(const std::vector<File>& files, TokenList& tokens, ParseMode mode) {
+    if (files.size() == 1) {
+        TraceSpan span{"parse", files[0].filename};
+        return ParseFile(files, 0, tokens, mode);
+    }
+
+    // Every file is tokenized and parsed into its own segment on a worker thread.
+    // Each segment has its own reserved null token, node and list,
+    // so a segment is a complete program by itself and can be parsed without knowing about the others.
+    struct Segment {
+        TokenList tokens;
+        AST ast;
+    };
+    // A file stops at its first error, the one of the earliest file (in command line order) is reported
+    // after all of them are done, whatever the number of threads
+    std::vector<Segment> segments(files.size());
+    std::vector<std::optional<CompileError>> errors(files.size());
+    ParallelFor(files.size(), [&](size_t i) {
+        TraceSpan span{"parse", files[i].filename};
+        ThrowCompileErrorsScope throwing;
+        try {
+            segments[i].ast = ParseFile(files, i, segments[i].tokens, mode);
+        }
+        catch (CompileError& error) {
+            errors[i] = std::move(error);
+        }
+    });
+    for (const std::optional<CompileError>& error : errors) {
+        if (error)
+            ExitWithCompileError(*error);
+    }
+
+    // Merge the segments in file order, skipping the reserved entries and rebasing indices
+    size_t numTokens = 1, numNodes = 1, numLists = 3, numPooled = 0, numStrings = 0;
+    for (const Segment& segment : segments) {
+        numTokens += segment.tokens.size() - 1;
+        numNodes += segment.ast.tree.size() - 1;
+        numLists += segment.ast.lists.size() - 1;
+        numPooled += segment.ast.listPool.size();
+        numStrings += segment.ast.strings.size();
+    }
+
+    AST ast;
+    tokens = TokenList{files};          // TokenIndex TOKEN_NULL
+    tokens.reserve(numTokens);
+    ast.tree.reserve(numNodes);
+    ast.lists.reserve(numLists);
+    ast.listPool.reserve(numPooled);
+    ast.strings.reserve(numStrings);
+    ast.tree.emplace_back().kind = ASTKind::PROGRAM; // ASTIndex AST_NULL
+    ast.lists.emplace_back();           // ASTList AST_EMPTY
+    ASTList allProcs = static_cast<ASTList>(ast.lists.size());
+    ast.lists.emplace_back();
+    ASTList allImports = static_cast<ASTList>(ast.lists.size());
+    ast.lists.emplace_back();
+    ArenaVector<ASTIndex> procs, imports;
+
+    for (Segment& segment : segments) {
+        auto tokenOffset = static_cast<TokenIndex>(tokens.size() - 1);
+        auto nodeOffset = static_cast<ASTIndex>(ast.tree.size() - 1);
+        auto listOffset = static_cast<ASTList>(ast.lists.size() - 1);
+        auto poolOffset = static_cast<uint32_t>(ast.listPool.size());
+        auto stringOffset = static_cast<uint32_t>(ast.strings.size());
+
+        tokens.AppendTokens(segment.tokens);
+        ast.strings.insert(ast.strings.end(), segment.ast.strings.begin(), segment.ast.strings.end());
+
+        for (size_t i = 1; i < segment.ast.tree.size(); ++i) {
+            ASTNode& node = ast.tree.emplace_back(segment.ast.tree[i]);
+            RebaseNode(node, tokenOffset, nodeOffset, listOffset, stringOffset);
+        }
+
+        for (ASTIndex procIdx : segment.ast.GetList(segment.ast.tree[0].program.procedures))
+            procs.push_back(procIdx + nodeOffset);
+        for (ASTIndex importIdx : segment.ast.GetList(segment.ast.tree[0].program.imports))
+            imports.push_back(importIdx + nodeOffset);
+
+        for (size_t i = 1; i < segment.ast.lists.size(); ++i) {
+            ASTSpan span = segment.ast.lists[i];
+            span.offset += poolOffset;
+            ast.lists.push_back(span);
+        }
+        for (ASTIndex idx : segment.ast.listPool)
+            ast.listPool.push_back(idx != AST_NULL ? idx + nodeOffset : AST_NULL); // For clauses may be null
+    }
+    ast.lists[allProcs] = { .offset = static_cast<uint32_t>(ast.listPool.size()), .length = static_cast<uint32_t>(procs.size()) };
+    ast.listPool.insert(ast.listPool.end(), procs.begin(), procs.end());
+    ast.tree[0].program.procedures = allProcs;
+    ast.lists[allImports] = { .offset = static_cast<uint32_t>(ast.listPool.size()), .length = static_cast<uint32_t>(imports.size()) };
+    ast.listPool.insert(ast.listPool.end(), imports.begin(), imports.end());
+    ast.tree[0].program.imports = allImports;
+
+    return ast;
+}
+
+void ParseDeferredBody(const TokenList& tokens, AST& ast, ASTIndex procIdx) {
+    Parser parser{tokens, ast};
+    parser.ParseDeferredBody(procIdx);
+}
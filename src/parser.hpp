@@ -4,13 +4,15 @@
 #include "tokenizer.hpp"
 
 #include <vector>
+#include <span>
 #include <stdint.h>
 
 // Language Grammar
 // TODO: bitwise operators, pointers, struct
 
-// Program             =  { Procedure }
-// Procedure           =  "proc" Identifier "(" [ VariableDefn { "," VariableDefn } ] ")" [ "->" Type ] Body
+// Program             =  { Import } { Procedure }
+// Import              =  "import" StringLiteral ";"
+// Procedure           =  "proc" [ "inline" ] Identifier "(" [ VariableDefn { "," VariableDefn } ] ")" [ "->" Type ] Body
 
 // Body                =  Block | Statement
 // Block               =  "{" { Statement } "}"
@@ -47,6 +49,7 @@ enum class ASTKind : uint8_t {
     UNINITIALIZED,
     PROGRAM,
     PROCEDURE,
+    IMPORT,
     IF_STATEMENT,
     FOR_STATEMENT,
     RETURN_STATEMENT,
@@ -96,7 +99,7 @@ const char* TypeKindName(TypeKind kind);
 // TODO: strong types
 using TokenIndex = uint32_t;
 using ASTIndex = uint32_t;
-using ASTList = uint32_t; // index into vector of vector of ASTList
+using ASTList = uint32_t; // index into AST::lists
 const TokenIndex TOKEN_NULL = 0;
 const ASTIndex AST_NULL = 0; // Null points to the root
 const ASTList AST_EMPTY = 0;
@@ -111,16 +114,13 @@ struct ASTNode {
 
     struct ASTProgram {
         ASTList procedures;
+        ASTList imports; // Path is the token of each import
     };
 
     struct ASTProcedure {
+        // Return type and annotations are in type and flags
         ASTList params;
         ASTList body;
-        TypeKind retType;
-        bool retIsArray;
-        bool isCdecl;
-        bool isExtern;
-        bool isPublic;
     };
 
     struct ASTUnaryOperator {
@@ -137,7 +137,7 @@ struct ASTNode {
             uint64_t i64;
             double f64;
             uint8_t u8;
-            StringView str; // largest member
+            uint32_t str; // Index into AST::strings
         };
     };
 
@@ -154,23 +154,20 @@ struct ASTNode {
     struct ASTIf {
         ASTIndex cond;
         ASTList body;
-        ASTList elsestmt; // Optional
+        // Optional else body is the list right after body (see flags.hasElse)
+        [[nodiscard]] ASTList ElseBody() const { return body + 1; }
     };
 
     struct ASTFor {
-        ASTIndex init;
-        ASTIndex cond;
-        ASTIndex incr;
+        ASTList clauses; // init, cond, incr (each optional)
         ASTList body;
     };
 
     struct ASTDefinition {
         // Access ident through token
+        // Type is in type, let/mut is in flags
         ASTIndex arraySize;
         ASTIndex initExpr; // Optional
-        // These variables should move to flags but the other structs in the union are bigger anyways
-        bool isConst; // let/mut
-        TypeKind type;
     };
 
     struct ASTAssign {
@@ -187,6 +184,17 @@ struct ASTNode {
         ASTList strings;
     };
 
+    struct Flags {
+        bool isConst : 1;    // Definition (let/mut)
+        bool retIsArray : 1; // Procedure
+        bool isCdecl : 1;    // Procedure
+        bool isExtern : 1;   // Procedure
+        bool isPublic : 1;   // Procedure
+        bool isInline : 1;   // Procedure
+        bool hasElse : 1;    // If statement
+        bool isDeferred : 1; // Procedure, the body is not parsed yet and procedure.body holds its first token
+    };
+
     union {
         ASTProgram program;
         ASTProcedure procedure;
@@ -203,36 +211,69 @@ struct ASTNode {
         ASTAsm asm_;
     };
 
-    // String literal is making the struct big, so these aren't useful
-    // If this struct becomes smaller, this would be helpful.
-    // Currently this space is just wasted padding anyways...
-//     uint8_t flags1;
-//     uint8_t flags2;
-//     uint8_t flags3;
-//     union {
-//         // TODO: flags ...
-//     };
     TokenIndex tokenIdx; // Optional. Used for identifiers
     ASTKind kind;
+    TypeKind type; // Definition type, procedure return type
+    Flags flags;
+};
+
+// A list is a run of contiguous indices in AST::listPool
+struct ASTSpan {
+    uint32_t offset;
+    uint32_t length;
 };
 
 struct AST {
-    std::vector<ASTNode> tree;
-    std::vector<std::vector<ASTIndex>> lists;
+    ArenaVector<ASTNode> tree;
+    ArenaVector<ASTSpan> lists;
+    ArenaVector<ASTIndex> listPool; // Every list, back to back
+    ArenaVector<ASTNode::StringView> strings; // String literals, kept out of line so nodes stay small
+
+    [[nodiscard]] std::span<const ASTIndex> GetList(ASTList list) const {
+        const ASTSpan& span = lists[list];
+        return { listPool.data() + span.offset, span.length };
+    }
+};
+
+enum class ParseMode {
+    EAGER,
+    DEFER_BODIES,  // Procedure bodies in braces are only skipped over (see ParseDeferredBody)
+    STREAM_TOKENS, // Tokens are pulled from a TokenStream, only those the AST refers to are kept
 };
 
 class Parser {
-    const std::vector<Token>& tokens;
-    TokenIndex tokenIdx{};
+    const TokenList& tokens; // When streaming, the pinned tokens (the ones nodes refer to)
+    TokenStream* stream;
+    TokenIndex tokenIdx{};   // When streaming, an index in the stream
     AST& ast;
+    bool deferBodies;
+    // Elements of the lists being built. Lists nest, so the innermost one is always on top
+    ArenaVector<ASTIndex> listScratch;
+
+    // Pending work of the expressions being parsed, see ParseExpression
+    struct ExprFrame {
+        enum : uint8_t { BINARY, UNARY, PAREN } kind;
+        uint8_t minPrecedence = 0;     // BINARY
+        TokenIndex op = TOKEN_NULL;    // Operator waiting for its operand, or the opening parenthesis
+        ASTIndex node = AST_NULL;      // Left operand so far, or the unary operator node
+    };
+    ArenaVector<ExprFrame> exprStack;
 
+    [[nodiscard]] bool AtEnd(TokenIndex idx) const;
+    [[nodiscard]] Token TokenAt(TokenIndex idx) const;
+    [[nodiscard]] TokenKind KindAt(TokenIndex idx) const;
+    TokenIndex PinToken(TokenIndex idx);
+    void RetireTokens();
     ASTIndex NewNode(ASTKind kind);
     ASTIndex NewNodeFromToken(TokenIndex tokIdx, ASTKind kind);
     ASTIndex NewNodeFromLastToken(ASTKind kind);
-    [[nodiscard]] const Token& PeekCurrentToken() const;
-    const Token& PollCurrentToken();
+    [[nodiscard]] Token PeekCurrentToken() const;
+    Token PollCurrentToken();
     ASTList NewASTList();
-    void AddToASTList(ASTList list, ASTIndex idx);
+    size_t BeginASTList();
+    void AddToASTList(ASTIndex idx);
+    void EndASTList(ASTList list, size_t begin);
+    uint32_t NewString(std::string_view text);
     ASTIndex ParseSubscript();
     std::pair<TypeKind, ASTIndex> ParseType();
     ASTIndex ParseVarDefn();
@@ -242,31 +283,37 @@ class Parser {
     ASTIndex ParseLValue();
     ASTIndex ParseAssignment();
     ASTIndex ParseFor();
-    ASTIndex ParseFactor();
-    ASTIndex ParseTerm();
-    ASTIndex ParseValue();
-    ASTIndex ParseComparison();
-    ASTIndex ParseLogicalFactor();
-    ASTIndex ParseLogicalTerm();
+    ASTIndex ParseOperand();
     ASTIndex ParseExpression();
     ASTIndex ParseStatement();
+    void ParseBody(ASTList body);
     ASTList ParseBody();
+    void SkipBlock();
     ASTIndex ParseProcedure();
+    ASTIndex ParseImport();
     void ParseProgram();
 
-
 public:
-    Parser(const std::vector<Token>& tokens_, AST& ast_)
-        : tokens{tokens_}, ast{ast_}
+    Parser(const TokenList& tokens_, AST& ast_, ParseMode mode = ParseMode::EAGER)
+        : tokens{tokens_}, stream{nullptr}, ast{ast_}, deferBodies{mode == ParseMode::DEFER_BODIES}
+    {}
+    // Pinned tokens are appended to pinnedTokens
+    Parser(TokenStream& stream_, const TokenList& pinnedTokens, AST& ast_)
+        : tokens{pinnedTokens}, stream{&stream_}, ast{ast_}, deferBodies{false}
     {}
 
     void ParseEntireProgram();
+    void ParseDeferredBody(ASTIndex procIdx);
     void PrintNode(ASTIndex rootIdx) const;
     void PrintAST(ASTIndex rootIdx, uint32_t depth) const;
 };
 
-AST ParseEntireProgram(const std::vector<Token>& tokens);
+AST ParseEntireProgram(const TokenList& tokens, ParseMode mode = ParseMode::EAGER);
+// Tokenizes and parses each file in parallel, then merges them into a single token vector and AST
+AST ParseEntireSource(const std::vector<File>& files, TokenList& tokens, ParseMode mode = ParseMode::EAGER);
+// Parses the body of a procedure that was skipped over, does nothing if it was parsed already
+void ParseDeferredBody(const TokenList& tokens, AST& ast, ASTIndex procIdx);
 
 static_assert(std::is_trivial_v<ASTNode>);
-static_assert(sizeof(ASTNode) == 24); // Ensure this struct doesn't accidentally get bigger
+static_assert(sizeof(ASTNode) == 16); // Ensure this struct doesn't accidentally get bigger
 
@@ -0,0 +1,627 @@
+#include "server.hpp"
+#include "compileerror.hpp"
+#include "tokenizer.hpp"
+#include "parser.hpp"
+#include "analyzer.hpp"
+#include "json.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <fmt/core.h>
+
+// How other declarations see a procedure
+struct Signature {
+    std::vector<Type> params;
+    Type returnType;
+
+    bool operator==(const Signature&) const = default;
+};
+
+// One top level declaration of a document, from its keyword ("proc" or "import") to the next one.
+// The first one also holds whatever comes before the first keyword.
+// Each is tokenized, parsed and verified by itself, so an edit only redoes the declarations it touches.
+// Tokens point into the declaration, so it must not move.
+struct Declaration {
+    std::string source;
+    std::vector<File> files; // Just this one
+    TokenList tokens;
+    AST ast;
+    size_t numParsedNodes{}; // Verifying appends nodes for the signatures it sees, they are dropped before verifying again
+    bool isParsed{};
+    bool needsVerifying{};
+    std::optional<CompileError> error; // The first one, positions are in source
+
+    std::string procName; // Empty unless this is a procedure
+    size_t procNameIdx{};
+    Signature signature;
+    std::string importPath; // Empty unless this is an import
+    size_t importPathIdx{};
+
+    Declaration(std::string_view filename, std::string_view source_)
+        : source{source_}
+    {
+        files.push_back(File{.filename=filename, .source=source, .lineStarts={}});
+        try {
+            tokens = TokenizeFile(files, 0);
+            ast = ParseEntireProgram(tokens);
+            isParsed = true;
+        }
+        catch (CompileError& parseError) {
+            error = std::move(parseError);
+            return;
+        }
+        numParsedNodes = ast.tree.size();
+
+        for (ASTIndex procIdx : ast.GetList(ast.tree[0].program.procedures)) {
+            const ASTNode& proc = ast.tree[procIdx];
+            Token name = tokens[proc.tokenIdx];
+            procName = name.text;
+            procNameIdx = static_cast<size_t>(name.text.data() - source.data());
+            for (ASTIndex paramIdx : ast.GetList(proc.procedure.params)) {
+                const ASTNode& param = ast.tree[paramIdx];
+                signature.params.push_back({ param.type, param.defn.arraySize == AST_NULL });
+            }
+            signature.returnType = { proc.type, !proc.flags.retIsArray };
+        }
+        for (ASTIndex importIdx : ast.GetList(ast.tree[0].program.imports)) {
+            Token path = tokens[ast.tree[importIdx].tokenIdx];
+            importPath = path.text;
+            importPathIdx = static_cast<size_t>(path.text.data() - source.data());
+        }
+    }
+    Declaration(const Declaration&) = delete;
+    Declaration& operator=(const Declaration&) = delete;
+};
+
+// A file named by an import, only the signatures of its public procedures are needed
+struct Module {
+    std::string source;
+    std::vector<File> files;
+    TokenList tokens;
+    AST ast;
+    ArenaVector<ImportedProcedure> interface;
+};
+
+// Whether the character can be part of an identifier or keyword, see the tokenizer
+static bool IsIdentifierChar(char ch) {
+    return (ch >= '0' && ch <= '9') || ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'z') || ch == '_';
+}
+
+// Finds the keywords that start declarations in text[begin, end), begin must not be inside a token.
+// Only comments and literals are told apart, the tokenizer reports everything else when the declaration is parsed.
+// Returns false if end is inside a token (or comment), then the declaration after end must be scanned along.
+static bool FindDeclarations(std::string_view text, size_t begin, size_t end, std::vector<size_t>& starts) {
+    size_t idx = begin;
+    while (idx < end) {
+        char ch = text[idx];
+        if (ch == '?') {
+            while (idx < text.size() && text[idx] != '\n')
+                ++idx;
+        }
+        else if (ch == '"' || ch == '\'') {
+            // Ends at the closing quote or, with an error, at the end of the line
+            for (++idx; idx < text.size() && text[idx] != ch && text[idx] != '\n'; ++idx) {
+                if (text[idx] == '\\')
+                    ++idx;
+            }
+            ++idx;
+        }
+        else if (ch >= '0' && ch <= '9') {
+            // Digits and letters are separate tokens, like the tokenizer does
+            while (idx < text.size() && text[idx] >= '0' && text[idx] <= '9')
+                ++idx;
+        }
+        else if (IsIdentifierChar(ch)) {
+            size_t wordStart = idx;
+            while (idx < text.size() && IsIdentifierChar(text[idx]))
+                ++idx;
+            std::string_view word = text.substr(wordStart, idx - wordStart);
+            if (word == "proc" || word == "import")
+                starts.push_back(wordStart);
+        }
+        else {
+            ++idx;
+        }
+    }
+    if (idx > end)
+        return false;
+    return end == text.size() || end == begin || !IsIdentifierChar(text[end - 1]) || !IsIdentifierChar(text[end]);
+}
+
+// LSP positions count UTF-16 code units within a line
+class LineTable {
+    std::string_view text;
+    std::vector<size_t> lineStarts;
+
+public:
+    explicit LineTable(std::string_view text_)
+        : text{text_}
+    {
+        lineStarts.push_back(0);
+        for (size_t idx = text.find('\n'); idx != std::string_view::npos; idx = text.find('\n', idx + 1))
+            lineStarts.push_back(idx + 1);
+    }
+
+    [[nodiscard]] Json Position(size_t offset) const {
+        offset = std::min(offset, text.size());
+        size_t line = static_cast<size_t>(std::upper_bound(lineStarts.begin(), lineStarts.end(), offset) - lineStarts.begin()) - 1;
+        size_t character = 0;
+        for (size_t idx = lineStarts[line]; idx < offset; ++idx) {
+            auto ch = static_cast<unsigned char>(text[idx]);
+            // Continuation bytes don't count, characters outside the basic plane take two units
+            character += (ch & 0xc0) == 0x80 ? 0 : ch >= 0xf0 ? 2 : 1;
+        }
+        Json position = Json::Object();
+        position.Set("line", line);
+        position.Set("character", character);
+        return position;
+    }
+
+    // Clamped to the end of the line or text
+    [[nodiscard]] size_t Offset(const Json& position) const {
+        auto line = static_cast<size_t>(std::max(0.0, position["line"].AsNumber()));
+        auto character = static_cast<size_t>(std::max(0.0, position["character"].AsNumber()));
+        if (line >= lineStarts.size())
+            return text.size();
+        size_t idx = lineStarts[line];
+        for (size_t units = 0; idx < text.size() && text[idx] != '\n' && units < character; ) {
+            auto ch = static_cast<unsigned char>(text[idx]);
+            units += ch >= 0xf0 ? 2 : 1;
+            for (++idx; idx < text.size() && (static_cast<unsigned char>(text[idx]) & 0xc0) == 0x80; ++idx) {}
+        }
+        return idx;
+    }
+};
+
+class Document {
+    std::string path;
+    std::string text;
+    std::vector<size_t> starts; // Offset of each declaration in text, the first is always 0
+    std::vector<std::unique_ptr<Declaration>> decls;
+    std::unordered_map<std::string, std::vector<const Declaration*>> definitions; // By procedure name, in no particular order
+    std::unordered_set<std::string> redefinedNames; // Procedures with more than one definition
+    std::unordered_map<std::string, std::vector<Declaration*>> mentions; // By identifier, the declarations that name it
+    std::vector<std::unique_ptr<Module>> modules;
+    std::unordered_map<std::string_view, const ImportedProcedure*> importedProcedures;
+
+    // The declaration that holds the character at offset (or the last one)
+    [[nodiscard]] size_t DeclarationAt(size_t offset) const {
+        return static_cast<size_t>(std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin()) - 1;
+    }
+
+    void Remember(Declaration& decl) {
+        if (!decl.procName.empty())
+            definitions[decl.procName].push_back(&decl);
+        const SymbolTable& symbols = decl.tokens.Symbols();
+        for (SymbolId id = 1; id < symbols.size(); ++id)
+            mentions[std::string{symbols.Name(id)}].push_back(&decl);
+    }
+
+    void Forget(const Declaration& decl) {
+        if (!decl.procName.empty())
+            std::erase(definitions[decl.procName], &decl);
+        const SymbolTable& symbols = decl.tokens.Symbols();
+        for (SymbolId id = 1; id < symbols.size(); ++id) {
+            auto it = mentions.find(std::string{symbols.Name(id)});
+            std::erase(it->second, &decl);
+            if (it->second.empty())
+                mentions.erase(it);
+        }
+    }
+
+    // The signature calls are verified against, if the procedure is defined
+    [[nodiscard]] std::optional<Signature> SignatureOf(const std::string& name) const {
+        auto it = definitions.find(name);
+        if (it == definitions.end() || it->second.empty())
+            return std::nullopt;
+        return it->second.front()->signature;
+    }
+
+    // Every procedure named in the declaration, other than itself and the builtins, as if it was imported
+    [[nodiscard]] ArenaVector<ImportedProcedure> ImportsOf(const Declaration& decl) const {
+        ArenaVector<ImportedProcedure> imports;
+        const SymbolTable& symbols = decl.tokens.Symbols();
+        for (SymbolId id = 1; id < symbols.size(); ++id) {
+            std::string_view name = symbols.Name(id);
+            if (IsBuiltinProcedure(name))
+                continue;
+            auto it = definitions.find(std::string{name});
+            bool isDefinedHere = it != definitions.end() && !it->second.empty();
+            if (isDefinedHere && name != decl.procName) {
+                const Declaration& defn = *it->second.front();
+                ImportedProcedure& imported = imports.emplace_back();
+                imported.name = Token{ &defn.files[0], std::string_view{defn.source}.substr(defn.procNameIdx, name.size()), TokenKind::IDENTIFIER };
+                imported.params.assign(defn.signature.params.begin(), defn.signature.params.end());
+                imported.returnType = defn.signature.returnType;
+            }
+            // Defining an imported procedure again is reported by the definition
+            else if (auto moduleIt = importedProcedures.find(name); moduleIt != importedProcedures.end() && (!isDefinedHere || name == decl.procName)) {
+                imports.push_back(*moduleIt->second);
+            }
+        }
+        return imports;
+    }
+
+    void Verify(Declaration& decl) const {
+        decl.needsVerifying = false;
+        if (!decl.isParsed || decl.procName.empty())
+            return;
+        decl.error.reset();
+        decl.ast.tree.resize(decl.numParsedNodes);
+        try {
+            VerifyProcedures(decl.tokens, decl.ast, ImportsOf(decl));
+        }
+        catch (CompileError& verifyError) {
+            decl.error = std::move(verifyError);
+        }
+    }
+
+    // Imported files are read again whenever the imports change
+    void LoadImports() {
+        importedProcedures.clear();
+        modules.clear();
+        std::unordered_set<std::string> loaded;
+        for (auto& decl : decls) {
+            if (decl->importPath.empty())
+                continue;
+            decl->error.reset();
+            std::filesystem::path importPath = std::filesystem::path{path}.parent_path() / decl->importPath;
+            std::error_code ec;
+            std::string canonicalPath = std::filesystem::weakly_canonical(importPath, ec).string();
+            std::ifstream stream{importPath, std::ios::in | std::ios::binary};
+            if (ec || !stream) {
+                decl->error = CompileError{ decl->importPathIdx,
+                    fmt::format("Could not open imported file \"{}\"", importPath.string()) };
+                continue;
+            }
+            if (!loaded.insert(canonicalPath).second)
+                continue;
+
+            auto& module = *modules.emplace_back(std::make_unique<Module>());
+            module.source.assign(std::istreambuf_iterator<char>{stream}, std::istreambuf_iterator<char>{});
+            module.files.push_back(File{.filename=decl->importPath, .source=module.source, .lineStarts={}});
+            try {
+                module.ast = ParseEntireSource(module.files, module.tokens, ParseMode::DEFER_BODIES);
+            }
+            catch (CompileError& moduleError) {
+                FileLocation pos = LocateInFile(module.files[0], moduleError.idx);
+                decl->error = CompileError{ decl->importPathIdx,
+                    fmt::format("Imported file \"{}\" has an error at {}:{}: {}", importPath.string(),
+                        pos.line, pos.col, moduleError.message) };
+                continue;
+            }
+            module.interface = ModuleInterface(module.tokens, module.ast);
+            for (const ImportedProcedure& imported : module.interface)
+                importedProcedures.try_emplace(imported.name.text, &imported);
+        }
+    }
+
+    // Replaces the declarations [first, last] with the ones starting at newStarts (up to regionEnd)
+    void ReplaceDeclarations(size_t first, size_t last, const std::vector<size_t>& newStarts, size_t regionEnd) {
+        std::vector<std::unique_ptr<Declaration>> newDecls;
+        for (size_t i = 0; i < newStarts.size(); ++i) {
+            size_t end = i + 1 < newStarts.size() ? newStarts[i + 1] : regionEnd;
+            newDecls.push_back(std::make_unique<Declaration>(path, std::string_view{text}.substr(newStarts[i], end - newStarts[i])));
+        }
+
+        // Declarations that name a procedure whose signature changes are verified again
+        std::map<std::string, std::optional<Signature>> touched;
+        bool importsChanged = false;
+        for (size_t i = first; i <= last && i < decls.size(); ++i) {
+            if (!decls[i]->procName.empty())
+                touched.try_emplace(decls[i]->procName, SignatureOf(decls[i]->procName));
+            importsChanged |= !decls[i]->importPath.empty();
+            Forget(*decls[i]);
+        }
+        for (auto& decl : newDecls) {
+            if (!decl->procName.empty())
+                touched.try_emplace(decl->procName, SignatureOf(decl->procName));
+            importsChanged |= !decl->importPath.empty();
+            Remember(*decl);
+        }
+
+        std::vector<Declaration*> pending;
+        auto NeedsVerifying = [&](Declaration& decl) {
+            if (!decl.needsVerifying)
+                pending.push_back(&decl);
+            decl.needsVerifying = true;
+        };
+        for (auto& decl : newDecls)
+            NeedsVerifying(*decl);
+        size_t numOld = std::min(last + 1, decls.size()) - first;
+        decls.erase(decls.begin() + static_cast<ptrdiff_t>(first), decls.begin() + static_cast<ptrdiff_t>(first + numOld));
+        decls.insert(decls.begin() + static_cast<ptrdiff_t>(first), std::make_move_iterator(newDecls.begin()), std::make_move_iterator(newDecls.end()));
+        starts.erase(starts.begin() + static_cast<ptrdiff_t>(first), starts.begin() + static_cast<ptrdiff_t>(first + numOld));
+        starts.insert(starts.begin() + static_cast<ptrdiff_t>(first), newStarts.begin(), newStarts.end());
+
+        if (importsChanged) {
+            LoadImports();
+            for (auto& decl : decls)
+                NeedsVerifying(*decl);
+        }
+        for (const auto& [name, oldSignature] : touched) {
+            auto it = definitions.find(name);
+            if (it != definitions.end() && it->second.size() > 1)
+                redefinedNames.insert(name);
+            else
+                redefinedNames.erase(name);
+            if (SignatureOf(name) == oldSignature)
+                continue;
+            if (auto mentionIt = mentions.find(name); mentionIt != mentions.end()) {
+                for (Declaration* decl : mentionIt->second)
+                    NeedsVerifying(*decl);
+            }
+        }
+        for (Declaration* decl : pending)
+            Verify(*decl);
+    }
+
+public:
+    Document(std::string path_, std::string text_)
+        : path{std::move(path_)}
+        , text{std::move(text_)}
+    {
+        std::vector<size_t> newStarts;
+        FindDeclarations(text, 0, text.size(), newStarts);
+        if (newStarts.empty() || newStarts.front() != 0)
+            newStarts.insert(newStarts.begin(), 0);
+        ReplaceDeclarations(0, 0, newStarts, text.size());
+    }
+    Document(const Document&) = delete;
+    Document& operator=(const Document&) = delete;
+
+    [[nodiscard]] const std::string& Text() const { return text; }
+
+    // Replaces text[begin, end)
+    void Edit(size_t begin, size_t end, std::string_view newText) {
+        end = std::clamp(end, begin, text.size());
+        size_t first = DeclarationAt(begin > 0 ? begin - 1 : 0);
+        size_t last = DeclarationAt(end);
+        text.replace(begin, end - begin, newText);
+        for (size_t i = last + 1; i < starts.size(); ++i)
+            starts[i] = starts[i] + newText.size() - (end - begin);
+
+        // The declarations around the edit are found again. The edit may have removed the keyword of the first one,
+        // or run into the one after the last one (say by opening a comment), then they are found again too.
+        std::vector<size_t> newStarts;
+        size_t regionEnd;
+        while (true) {
+            regionEnd = last + 1 < starts.size() ? starts[last + 1] : text.size();
+            newStarts.clear();
+            bool isClean = FindDeclarations(text, starts[first], regionEnd, newStarts);
+            if (first > 0 && (newStarts.empty() || newStarts.front() != starts[first])) {
+                --first;
+                continue;
+            }
+            if (!isClean && last + 1 < starts.size()) {
+                ++last;
+                continue;
+            }
+            break;
+        }
+        if (first == 0 && (newStarts.empty() || newStarts.front() != 0))
+            newStarts.insert(newStarts.begin(), 0);
+        ReplaceDeclarations(first, last, newStarts, regionEnd);
+    }
+
+    [[nodiscard]] Json Diagnostics() const {
+        LineTable lines{text};
+        Json diagnostics = Json::Array();
+        auto AddDiagnostic = [&](size_t offset, std::string_view message) {
+            // Spans the identifier or keyword at the error, if there is one
+            size_t end = offset;
+            while (end < text.size() && IsIdentifierChar(text[end]))
+                ++end;
+            Json range = Json::Object();
+            range.Set("start", lines.Position(offset));
+            range.Set("end", lines.Position(std::max(end, std::min(offset + 1, text.size()))));
+            Json& diagnostic = diagnostics.Push(Json::Object());
+            diagnostic.Set("range", std::move(range));
+            diagnostic.Set("severity", 1); // Error
+            diagnostic.Set("source", "trashc");
+            diagnostic.Set("message", message);
+        };
+
+        // Every definition after the first is reported, like the compiler reports the second
+        std::unordered_set<std::string_view> defined;
+        bool hasProcedure = false;
+        for (size_t i = 0; i < decls.size(); ++i) {
+            const Declaration& decl = *decls[i];
+            if (decl.error)
+                AddDiagnostic(starts[i] + decl.error->idx, decl.error->message);
+            if (!decl.procName.empty()) {
+                if (!redefinedNames.empty() && redefinedNames.contains(decl.procName) && !defined.insert(decl.procName).second)
+                    AddDiagnostic(starts[i] + decl.procNameIdx, fmt::format("Redefinition of procedure '{}'", decl.procName));
+                hasProcedure = true;
+            }
+            if (!decl.importPath.empty() && hasProcedure)
+                AddDiagnostic(starts[i] + decl.importPathIdx, "Imports must come before every procedure");
+        }
+        return diagnostics;
+    }
+};
+
+// Message framing is a Content-Length header, a blank line and the JSON body
+static bool ReadMessage(std::string& message) {
+    size_t length = 0;
+    bool hasLength = false;
+    std::string header;
+    for (int ch; (ch = std::getchar()) != EOF; ) {
+        if (ch != '\n') {
+            header += static_cast<char>(ch);
+            continue;
+        }
+        if (!header.empty() && header.back() == '\r')
+            header.pop_back();
+        if (header.empty()) {
+            if (!hasLength)
+                continue;
+            message.resize(length);
+            return std::fread(message.data(), 1, length, stdin) == length;
+        }
+        constexpr std::string_view CONTENT_LENGTH = "Content-Length:";
+        if (header.starts_with(CONTENT_LENGTH)) {
+            length = std::strtoull(header.c_str() + CONTENT_LENGTH.size(), nullptr, 10);
+            hasLength = true;
+        }
+        header.clear();
+    }
+    return false;
+}
+
+static void WriteMessage(const Json& message) {
+    std::string body = message.Dump();
+    fmt::print(stdout, "Content-Length: {}\r\n\r\n{}", body.size(), body);
+    std::fflush(stdout);
+}
+
+static void Respond(const Json& id, Json result) {
+    Json response = Json::Object();
+    response.Set("jsonrpc", "2.0");
+    response.Set("id", id);
+    response.Set("result", std::move(result));
+    WriteMessage(response);
+}
+
+static void RespondError(const Json& id, int code, std::string_view message) {
+    Json error = Json::Object();
+    error.Set("code", code);
+    error.Set("message", message);
+    Json response = Json::Object();
+    response.Set("jsonrpc", "2.0");
+    response.Set("id", id);
+    response.Set("error", std::move(error));
+    WriteMessage(response);
+}
+
+// Document uris are file:// urls, percent encoded
+static std::string UriToPath(std::string_view uri) {
+    constexpr std::string_view FILE_SCHEME = "file://";
+    if (uri.starts_with(FILE_SCHEME))
+        uri.remove_prefix(FILE_SCHEME.size());
+    std::string path;
+    for (size_t i = 0; i < uri.size(); ++i) {
+        if (uri[i] == '%' && i + 2 < uri.size()) {
+            path += static_cast<char>(std::stoi(std::string{uri.substr(i + 1, 2)}, nullptr, 16));
+            i += 2;
+        }
+        else {
+            path += uri[i];
+        }
+    }
+    return path;
+}
+
+class LanguageServer {
+    std::unordered_map<std::string, std::unique_ptr<Document>> documents; // By uri
+    bool isShutDown = false;
+
+    static void PublishDiagnostics(std::string_view uri, Json diagnostics) {
+        Json params = Json::Object();
+        params.Set("uri", uri);
+        params.Set("diagnostics", std::move(diagnostics));
+        Json notification = Json::Object();
+        notification.Set("jsonrpc", "2.0");
+        notification.Set("method", "textDocument/publishDiagnostics");
+        notification.Set("params", std::move(params));
+        WriteMessage(notification);
+    }
+
+    static Json Capabilities() {
+        Json sync = Json::Object();
+        sync.Set("openClose", true);
+        sync.Set("change", 2); // Incremental
+        Json capabilities = Json::Object();
+        capabilities.Set("textDocumentSync", std::move(sync));
+        Json serverInfo = Json::Object();
+        serverInfo.Set("name", "trashc");
+        Json result = Json::Object();
+        result.Set("capabilities", std::move(capabilities));
+        result.Set("serverInfo", std::move(serverInfo));
+        return result;
+    }
+
+    void DidChange(const Json& params) {
+        std::string uri{params["textDocument"]["uri"].AsString()};
+        auto it = documents.find(uri);
+        if (it == documents.end())
+            return;
+        for (const Json& change : params["contentChanges"].Elements()) {
+            const Json& range = change["range"];
+            if (range.IsNull()) {
+                it->second = std::make_unique<Document>(UriToPath(uri), std::string{change["text"].AsString()});
+                continue;
+            }
+            Document& document = *it->second;
+            LineTable lines{document.Text()};
+            size_t begin = lines.Offset(range["start"]);
+            size_t end = lines.Offset(range["end"]);
+            document.Edit(begin, std::max(begin, end), change["text"].AsString());
+        }
+        PublishDiagnostics(uri, it->second->Diagnostics());
+    }
+
+public:
+    void Handle(const Json& message) {
+        std::string_view method = message["method"].AsString();
+        const Json& id = message["id"];
+        const Json& params = message["params"];
+
+        if (method == "initialize") {
+            Respond(id, Capabilities());
+        }
+        else if (method == "shutdown") {
+            isShutDown = true;
+            Respond(id, nullptr);
+        }
+        else if (method == "exit") {
+            exit(isShutDown ? 0 : 1);
+        }
+        else if (method == "textDocument/didOpen") {
+            const Json& document = params["textDocument"];
+            std::string uri{document["uri"].AsString()};
+            auto& opened = documents[uri] = std::make_unique<Document>(UriToPath(uri), std::string{document["text"].AsString()});
+            PublishDiagnostics(uri, opened->Diagnostics());
+        }
+        else if (method == "textDocument/didChange") {
+            DidChange(params);
+        }
+        else if (method == "textDocument/didClose") {
+            std::string uri{params["textDocument"]["uri"].AsString()};
+            documents.erase(uri);
+            PublishDiagnostics(uri, Json::Array());
+        }
+        else if (!id.IsNull()) {
+            RespondError(id, -32601, fmt::format("Unsupported method \"{}\"", method));
+        }
+        // Other notifications are ignored
+    }
+};
+
+void RunLanguageServer() {
+    // Errors become diagnostics, and nothing is kept for longer than the documents it belongs to (no arena)
+    ThrowCompileErrors() = true;
+    ArenaScope noArena{nullptr};
+
+    LanguageServer server;
+    std::string message;
+    while (ReadMessage(message)) {
+        std::optional<Json> parsed = Json::Parse(message);
+        if (parsed)
+            server.Handle(*parsed);
+        else
+            RespondError(nullptr, -32700, "Message is not valid JSON");
+    }
+}
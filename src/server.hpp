@@ -0,0 +1,5 @@
+#pragma once
+
+// Language server protocol over stdin and stdout (see -lsp), reports diagnostics as documents are edited
+// Returns when the client closes stdin
+void RunLanguageServer();
@@ -0,0 +1,99 @@
+#include "timereport.hpp"
+#include "json.hpp"
+
+#include <sys/resource.h>
+#include <fmt/core.h>
+#include <fmt/os.h>
+
+static uint64_t CpuTimeNs(const rusage& usage) {
+    auto ToNs = [](const timeval& time) {
+        return static_cast<uint64_t>(time.tv_sec) * 1'000'000'000 + static_cast<uint64_t>(time.tv_usec) * 1'000;
+    };
+    return ToNs(usage.ru_utime) + ToNs(usage.ru_stime);
+}
+
+static rusage ResourceUsage() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage;
+}
+
+TimeReport::TimeReport()
+    : epoch{std::chrono::steady_clock::now()}
+    , phaseStartCpuNs{CpuTimeNs(ResourceUsage())}
+{}
+
+void TimeReport::EndPhase(const char* name, Arena& arena) {
+    rusage usage = ResourceUsage();
+    uint64_t now = NowNs();
+    uint64_t cpuNs = CpuTimeNs(usage);
+    // ru_maxrss is in kilobytes
+    phases.push_back({ name, phaseStartNs, now, cpuNs - phaseStartCpuNs, arena.GetStats(),
+        static_cast<size_t>(usage.ru_maxrss) * 1024 });
+    phaseStartNs = now;
+    phaseStartCpuNs = cpuNs;
+}
+
+TimeReport::ThreadSpans& TimeReport::SpansOfThisThread() {
+    // Workers come and go with each parallel loop, a new one registers on its first span
+    thread_local TimeReport* owner = nullptr;
+    thread_local ThreadSpans* spans = nullptr;
+    if (owner != this) {
+        std::lock_guard lock{threadsMutex};
+        auto threadId = static_cast<uint32_t>(threads.size() + 1); // 0 shows the phases
+        spans = threads.emplace_back(std::make_unique<ThreadSpans>(ThreadSpans{ threadId, {} })).get();
+        owner = this;
+    }
+    return *spans;
+}
+
+void TimeReport::AddSpan(const Span& span) {
+    SpansOfThisThread().spans.push_back(span);
+}
+
+void TimeReport::PrintSummary() const {
+    fmt::print(stderr, "{:<10} {:>10} {:>10} {:>14} {:>12} {:>10}\n",
+        "phase", "wall ms", "cpu ms", "arena bytes", "allocations", "peak MB");
+    Arena::Stats prev{};
+    uint64_t totalCpuNs = 0;
+    for (const Phase& phase : phases) {
+        fmt::print(stderr, "{:<10} {:>10.2f} {:>10.2f} {:>14} {:>12} {:>10.1f}\n", phase.name,
+            static_cast<double>(phase.endNs - phase.startNs) / 1e6, static_cast<double>(phase.cpuNs) / 1e6,
+            phase.arenaStats.bytesUsed - prev.bytesUsed, phase.arenaStats.numAllocations - prev.numAllocations,
+            static_cast<double>(phase.peakRssBytes) / (1024 * 1024));
+        prev = phase.arenaStats;
+        totalCpuNs += phase.cpuNs;
+    }
+    if (!phases.empty()) {
+        fmt::print(stderr, "{:<10} {:>10.2f} {:>10.2f} {:>14} {:>12} {:>10.1f}\n", "total",
+            static_cast<double>(phases.back().endNs) / 1e6, static_cast<double>(totalCpuNs) / 1e6,
+            prev.bytesUsed, prev.numAllocations, static_cast<double>(phases.back().peakRssBytes) / (1024 * 1024));
+    }
+}
+
+bool TimeReport::WriteTrace(const std::string& filename) {
+    try {
+        fmt::ostream out = fmt::output_file(filename);
+        // Timestamps are in microseconds
+        auto PrintEvent = [&](std::string_view name, std::string_view category, uint32_t threadId, uint64_t startNs, uint64_t endNs) {
+            out.print(",\n{{\"name\":{},\"cat\":\"{}\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}}}",
+                Json{name}.Dump(), category, threadId,
+                static_cast<double>(startNs) / 1e3, static_cast<double>(endNs - startNs) / 1e3);
+        };
+        out.print("{{\"traceEvents\":[\n"
+            "{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{{\"name\":\"phases\"}}}}");
+        for (const Phase& phase : phases)
+            PrintEvent(phase.name, "phase", 0, phase.startNs, phase.endNs);
+        std::lock_guard lock{threadsMutex};
+        for (const auto& thread : threads) {
+            for (const Span& span : thread->spans)
+                PrintEvent(span.name, span.category, thread->threadId, span.startNs, span.endNs);
+        }
+        out.print("\n]}}\n");
+        out.close();
+        return true;
+    }
+    catch (const std::system_error&) {
+        return false;
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "arena.hpp"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+
+// Wall time, cpu time and memory of each phase of compilation (see -time-report),
+// and optionally every procedure's verification and codegen as spans of a Chrome trace (see -trace).
+// Phases are marked from the main thread, spans can be recorded from any thread.
+class TimeReport {
+public:
+    struct Span {
+        const char* category;
+        std::string_view name; // Must outlive the report (procedure names point into the source)
+        uint64_t startNs, endNs;
+    };
+
+private:
+    struct Phase {
+        const char* name;
+        uint64_t startNs, endNs;
+        uint64_t cpuNs; // All threads
+        Arena::Stats arenaStats; // Cumulative
+        size_t peakRssBytes;
+    };
+
+    // Each thread appends to its own, so recording a span takes no lock
+    struct ThreadSpans {
+        uint32_t threadId;
+        std::vector<Span> spans;
+    };
+
+    std::chrono::steady_clock::time_point epoch;
+    std::vector<Phase> phases;
+    uint64_t phaseStartNs{}, phaseStartCpuNs{};
+    std::mutex threadsMutex;
+    std::vector<std::unique_ptr<ThreadSpans>> threads;
+
+    ThreadSpans& SpansOfThisThread();
+
+public:
+    TimeReport();
+    TimeReport(const TimeReport&) = delete;
+    TimeReport& operator=(const TimeReport&) = delete;
+
+    // The report spans are recorded into (nullptr when not tracing)
+    static TimeReport*& Current() {
+        static TimeReport* current = nullptr;
+        return current;
+    }
+
+    [[nodiscard]] uint64_t NowNs() const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - epoch).count());
+    }
+
+    // Ends the current phase (the first one starts with the report)
+    void EndPhase(const char* name, Arena& arena);
+    void AddSpan(const Span& span);
+
+    void PrintSummary() const;
+    // Chrome trace event format, false if the file can't be written
+    bool WriteTrace(const std::string& filename);
+};
+
+// Times one piece of work (a file, a procedure) for the trace,
+// does nothing unless spans are being recorded
+class TraceSpan {
+    TimeReport* report;
+    TimeReport::Span span{};
+
+public:
+    explicit TraceSpan(const char* category, std::string_view name = {})
+        : report{TimeReport::Current()}
+    {
+        if (report != nullptr)
+            span = { category, name, report->NowNs(), 0 };
+    }
+    ~TraceSpan() {
+        if (report != nullptr) {
+            span.endNs = report->NowNs();
+            report->AddSpan(span);
+        }
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    // For work whose name is only known once it's done
+    void SetName(std::string_view name) { span.name = name; }
+};
@@ -1,13 +1,14 @@
 #include "tokenizer.hpp"
 #include "compileerror.hpp"
+#include "parallel.hpp"
 
 #include <cassert>
 #include <algorithm>
 #include <array>
-#include <functional>
+#include <bit>
 
 const char* TokenKindName(TokenKind kind) {
-    static_assert(static_cast<uint32_t>(TokenKind::TOKEN_COUNT) == 47, "Exhaustive check of token kinds failed");
+    static_assert(static_cast<uint32_t>(TokenKind::TOKEN_COUNT) == 49, "Exhaustive check of token kinds failed");
     const std::array<const char*, static_cast<uint32_t>(TokenKind::TOKEN_COUNT)> TokenKindNames{
         "NONE",
         "COMMENT",
@@ -20,6 +21,8 @@ const char* TokenKindName(TokenKind kind) {
         "CDECL",
         "EXTERN",
         "PUBLIC",
+        "INLINE",
+        "IMPORT",
         "LET",
         "MUT",
         "RETURN",
@@ -60,33 +63,203 @@ const char* TokenKindName(TokenKind kind) {
     return TokenKindNames[static_cast<uint32_t>(kind)];
 }
 
-static bool IsWhitespace(char ch) {
-    return ch == ' ' || ch == '\r' || ch == '\n' || ch == '\t';
+// Character classes the scanner skips over in bulk
+enum class CharClass {
+    WHITESPACE,
+    NEWLINE,
+    IDENTIFIER,
+    DIGIT,
+};
+
+template<CharClass cls>
+static bool IsInClass(char ch) {
+    if constexpr (cls == CharClass::WHITESPACE) return ch == ' ' || ch == '\r' || ch == '\n' || ch == '\t';
+    if constexpr (cls == CharClass::NEWLINE)    return ch == '\n';
+    if constexpr (cls == CharClass::IDENTIFIER) return (ch >= '0' && ch <= '9') || ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'z') || ch == '_';
+    if constexpr (cls == CharClass::DIGIT)      return ch >= '0' && ch <= '9';
 }
 
-static void LeftTrim(std::string_view source, size_t& sourceIdx, size_t* outLineNo = nullptr, size_t* outColNo = nullptr) {
-    for (;
-        sourceIdx < source.size();
-        ++sourceIdx)
-    {
-        char ch = source[sourceIdx];
-        if (!IsWhitespace(ch)) {
-            break;
+// Vectorized classification of 32 bytes at a time
+// ClassifyBlock<cls>(p) returns a mask where bit i is set if p[i] is in the class
+// Bytes >= 0x80 are negative as signed chars, so they never fall into a range below
+#if defined(__AVX2__) || defined(__SSE2__)
+#define TOKENIZER_SIMD 1
+#include <immintrin.h>
+
+#if defined(__AVX2__)
+using Vec = __m256i;
+static Vec VecLoad(const char* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+static Vec VecSet(char ch) { return _mm256_set1_epi8(ch); }
+static Vec VecEq(Vec a, Vec b) { return _mm256_cmpeq_epi8(a, b); }
+static Vec VecGt(Vec a, Vec b) { return _mm256_cmpgt_epi8(a, b); }
+static Vec VecOr(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+static Vec VecAnd(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+static uint32_t VecMask(Vec v) { return static_cast<uint32_t>(_mm256_movemask_epi8(v)); }
+static constexpr size_t VEC_WIDTH = 32;
+#else
+using Vec = __m128i;
+static Vec VecLoad(const char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+static Vec VecSet(char ch) { return _mm_set1_epi8(ch); }
+static Vec VecEq(Vec a, Vec b) { return _mm_cmpeq_epi8(a, b); }
+static Vec VecGt(Vec a, Vec b) { return _mm_cmpgt_epi8(a, b); }
+static Vec VecOr(Vec a, Vec b) { return _mm_or_si128(a, b); }
+static Vec VecAnd(Vec a, Vec b) { return _mm_and_si128(a, b); }
+static uint32_t VecMask(Vec v) { return static_cast<uint32_t>(_mm_movemask_epi8(v)); }
+static constexpr size_t VEC_WIDTH = 16;
+#endif
+
+// lo <= v <= hi
+static Vec VecInRange(Vec v, char lo, char hi) {
+    return VecAnd(VecGt(v, VecSet(static_cast<char>(lo - 1))), VecGt(VecSet(static_cast<char>(hi + 1)), v));
+}
+
+template<CharClass cls>
+static uint32_t ClassifyVec(const char* p) {
+    Vec v = VecLoad(p);
+    if constexpr (cls == CharClass::WHITESPACE) {
+        return VecMask(VecOr(VecOr(VecEq(v, VecSet(' ')), VecEq(v, VecSet('\n'))),
+                             VecOr(VecEq(v, VecSet('\r')), VecEq(v, VecSet('\t')))));
+    }
+    if constexpr (cls == CharClass::NEWLINE) {
+        return VecMask(VecEq(v, VecSet('\n')));
+    }
+    if constexpr (cls == CharClass::IDENTIFIER) {
+        Vec alpha = VecInRange(VecOr(v, VecSet(0x20)), 'a', 'z');
+        return VecMask(VecOr(VecOr(alpha, VecInRange(v, '0', '9')), VecEq(v, VecSet('_'))));
+    }
+    if constexpr (cls == CharClass::DIGIT) {
+        return VecMask(VecInRange(v, '0', '9'));
+    }
+}
+
+static constexpr size_t BLOCK_WIDTH = 32;
+
+template<CharClass cls>
+static uint32_t ClassifyBlock(const char* p) {
+    if constexpr (VEC_WIDTH == 32) {
+        return ClassifyVec<cls>(p);
+    }
+    else {
+        return ClassifyVec<cls>(p) | (ClassifyVec<cls>(p + 16) << 16);
+    }
+}
+#else
+#define TOKENIZER_SIMD 0
+#endif
+
+// Returns the index of the first character at or after idx that is not in the class
+template<CharClass cls>
+static size_t SkipClass(std::string_view source, size_t idx) {
+#if TOKENIZER_SIMD
+    for (; idx + BLOCK_WIDTH <= source.size(); idx += BLOCK_WIDTH) {
+        uint32_t outside = ~ClassifyBlock<cls>(source.data() + idx);
+        if (outside != 0) {
+            return idx + static_cast<size_t>(std::countr_zero(outside));
         }
-        if (outLineNo != nullptr) {
-            if (ch == '\n') {
-                ++*outLineNo;
-            }
+    }
+#endif
+    while (idx < source.size() && IsInClass<cls>(source[idx])) {
+        ++idx;
+    }
+    return idx;
+}
+
+// Returns the index of the first character at or after idx that is in the class, or source.size()
+template<CharClass cls>
+static size_t FindClass(std::string_view source, size_t idx) {
+#if TOKENIZER_SIMD
+    for (; idx + BLOCK_WIDTH <= source.size(); idx += BLOCK_WIDTH) {
+        uint32_t inside = ClassifyBlock<cls>(source.data() + idx);
+        if (inside != 0) {
+            return idx + static_cast<size_t>(std::countr_zero(inside));
         }
-        if (outColNo != nullptr) {
-            if (ch == '\n') {
-                *outColNo = 0;
-            }
-            else {
-                ++*outColNo;
+    }
+#endif
+    while (idx < source.size() && !IsInClass<cls>(source[idx])) {
+        ++idx;
+    }
+    return idx;
+}
+
+// Keywords are recognized with a perfect hash generated at compile time from this list.
+// Adding a keyword only requires adding it here (and to TokenKind).
+struct Keyword {
+    std::string_view text;
+    TokenKind kind;
+};
+
+static constexpr std::array KEYWORDS{
+    Keyword{ "if",       TokenKind::IF },
+    Keyword{ "else",     TokenKind::ELSE },
+    Keyword{ "for",      TokenKind::FOR },
+    Keyword{ "proc",     TokenKind::PROC },
+    Keyword{ "cdecl",    TokenKind::CDECL },
+    Keyword{ "extern",   TokenKind::EXTERN },
+    Keyword{ "public",   TokenKind::PUBLIC },
+    Keyword{ "inline",   TokenKind::INLINE },
+    Keyword{ "import",   TokenKind::IMPORT },
+    Keyword{ "let",      TokenKind::LET },
+    Keyword{ "mut",      TokenKind::MUT },
+    Keyword{ "return",   TokenKind::RETURN },
+    Keyword{ "break",    TokenKind::BREAK },
+    Keyword{ "continue", TokenKind::CONTINUE },
+    Keyword{ "asm",      TokenKind::ASM },
+    Keyword{ "u8",       TokenKind::U8 },
+    Keyword{ "i64",      TokenKind::I64 },
+    Keyword{ "f64",      TokenKind::F64 },
+};
+
+static constexpr size_t KEYWORD_MIN_LENGTH = std::ranges::min(KEYWORDS, {}, [](const Keyword& kw) { return kw.text.size(); }).text.size();
+static constexpr size_t KEYWORD_MAX_LENGTH = std::ranges::max(KEYWORDS, {}, [](const Keyword& kw) { return kw.text.size(); }).text.size();
+static_assert(KEYWORD_MIN_LENGTH >= 2, "Keyword hash reads the first two characters");
+
+static constexpr uint32_t KEYWORD_HASH_BITS = 6;
+static constexpr size_t KEYWORD_TABLE_SIZE = size_t{1} << KEYWORD_HASH_BITS;
+
+// Multiplicative hash of the first two characters, the last character and the length
+// Only valid for KEYWORD_MIN_LENGTH <= text.size() <= KEYWORD_MAX_LENGTH
+static constexpr uint32_t KeywordHash(std::string_view text, uint32_t seed) {
+    uint32_t key = static_cast<uint32_t>(static_cast<uint8_t>(text[0])) |
+                   static_cast<uint32_t>(static_cast<uint8_t>(text[1])) << 8 |
+                   static_cast<uint32_t>(static_cast<uint8_t>(text.back())) << 16 |
+                   static_cast<uint32_t>(text.size()) << 24;
+    return (key * seed) >> (32 - KEYWORD_HASH_BITS);
+}
+
+// Finds the smallest odd seed that maps every keyword to a distinct slot
+static constexpr uint32_t KEYWORD_HASH_SEED = []() {
+    for (uint32_t seed = 1; seed < (1u << 20); seed += 2) {
+        uint64_t occupied = 0;
+        bool isPerfect = true;
+        for (const Keyword& kw : KEYWORDS) {
+            uint64_t slot = uint64_t{1} << KeywordHash(kw.text, seed);
+            if ((occupied & slot) != 0) {
+                isPerfect = false;
+                break;
             }
+            occupied |= slot;
         }
+        if (isPerfect) return seed;
     }
+    return 0u;
+}();
+static_assert(KEYWORD_HASH_SEED != 0, "No perfect hash found for keywords, increase KEYWORD_HASH_BITS");
+
+static constexpr std::array<Keyword, KEYWORD_TABLE_SIZE> KEYWORD_TABLE = []() {
+    std::array<Keyword, KEYWORD_TABLE_SIZE> table{};
+    for (Keyword& slot : table)
+        slot = Keyword{ "", TokenKind::IDENTIFIER };
+    for (const Keyword& kw : KEYWORDS)
+        table[KeywordHash(kw.text, KEYWORD_HASH_SEED)] = kw;
+    return table;
+}();
+
+// One hash and one compare
+static TokenKind LookupKeyword(std::string_view text) {
+    if (text.size() < KEYWORD_MIN_LENGTH || text.size() > KEYWORD_MAX_LENGTH)
+        return TokenKind::IDENTIFIER;
+    const Keyword& kw = KEYWORD_TABLE[KeywordHash(text, KEYWORD_HASH_SEED)];
+    return kw.text == text ? kw.kind : TokenKind::IDENTIFIER;
 }
 
 static std::string_view LeftChop(std::string_view source, size_t& sourceIdx, size_t n) {
@@ -95,12 +268,42 @@ static std::string_view LeftChop(std::string_view source, size_t& sourceIdx, siz
     return view;
 }
 
-static std::string_view LeftChopWhile(std::string_view source, size_t& sourceIdx, auto&& predicate) {
-    // FIXME: narrowing conversion?
-    const auto* begin = source.cbegin() + sourceIdx;
-    const auto* end = std::find_if(begin, source.cend(), std::not_fn(predicate));
-    sourceIdx += static_cast<size_t> (end - begin);
-    return std::string_view{begin, end};
+template<CharClass cls>
+static std::string_view LeftChopClass(std::string_view source, size_t& sourceIdx) {
+    size_t begin = sourceIdx;
+    sourceIdx = SkipClass<cls>(source, sourceIdx);
+    return source.substr(begin, sourceIdx - begin);
+}
+
+// Line starts are found with the same block scan as the tokenizer, one bit per newline
+static void BuildLineStarts(const File& file) {
+    std::vector<uint32_t>& lineStarts = file.lineStarts;
+    lineStarts.push_back(0);
+    size_t idx = 0;
+#if TOKENIZER_SIMD
+    for (; idx + BLOCK_WIDTH <= file.source.size(); idx += BLOCK_WIDTH) {
+        for (uint32_t newlines = ClassifyBlock<CharClass::NEWLINE>(file.source.data() + idx);
+            newlines != 0;
+            newlines &= newlines - 1)
+        {
+            lineStarts.push_back(static_cast<uint32_t>(idx + static_cast<size_t>(std::countr_zero(newlines)) + 1));
+        }
+    }
+#endif
+    for (idx = FindClass<CharClass::NEWLINE>(file.source, idx);
+        idx < file.source.size();
+        idx = FindClass<CharClass::NEWLINE>(file.source, idx + 1))
+    {
+        lineStarts.push_back(static_cast<uint32_t>(idx + 1));
+    }
+}
+
+FileLocation LocateInFile(const File& file, size_t idx) {
+    if (file.lineStarts.empty())
+        BuildLineStarts(file);
+    auto lineIt = std::upper_bound(file.lineStarts.begin(), file.lineStarts.end(), idx) - 1;
+    size_t line = static_cast<size_t>(lineIt - file.lineStarts.begin());
+    return { .line = line + 1, .col = idx - *lineIt + 1, .idx = idx };
 }
 
 bool Tokenizer::PollTokenWithComments() {
@@ -108,163 +311,132 @@ bool Tokenizer::PollTokenWithComments() {
         return true;
     }
 
-    size_t lineDiff = 0, colDiff = 0;
-    do {
-        // whitespace
-        size_t linesBefore = curPos.line;
-        size_t colsBefore = curPos.col;
-        LeftTrim(file.source, curPos.idx, &curPos.line, &curPos.col);
-
-        // line comment beginning with '?'
-        if (curPos.idx >= file.source.size()) {
-            break;
-        }
-        char curChar = file.source[curPos.idx];
-        if (curChar == '?') {
-            // it is a comment
-            curToken.kind = TokenKind::COMMENT;
-            size_t commentEnd = file.source.find_first_of('\n', curPos.idx);
-            if (commentEnd == std::string::npos) {
-                // no newline implies end of file
-                curToken.text = std::string_view{&file.source[curPos.idx]};
-                curToken.pos.idx = curPos.idx;
-                curPos.idx = file.source.size();
-
-                curToken.pos.line = curPos.line + 1;
-                curToken.pos.col = curPos.col + 1;
-                curPos.col += curToken.text.size();
-                return true;
-            }
-            curToken.pos.idx = curPos.idx;
-            curToken.text = LeftChop(file.source, curPos.idx, commentEnd-curPos.idx);
-            curToken.pos.line = curPos.line + 1;
-            curToken.pos.col = curPos.col + 1;
-            curPos.col += curToken.text.size();
-            return true;
-        }
-
-        lineDiff = curPos.line - linesBefore;
-        colDiff = curPos.col - colsBefore;
-    } while (lineDiff != 0 || colDiff != 0);
-
-    if (curPos.idx >= file.source.size()) {
+    curIdx = SkipClass<CharClass::WHITESPACE>(file.source, curIdx);
+    if (curIdx >= file.source.size()) {
         return false;
     }
 
+    // line comment beginning with '?'
+    if (file.source[curIdx] == '?') {
+        // it is a comment, no newline implies end of file
+        curToken.kind = TokenKind::COMMENT;
+        size_t commentEnd = FindClass<CharClass::NEWLINE>(file.source, curIdx);
+        curToken.text = LeftChop(file.source, curIdx, commentEnd-curIdx);
+        return true;
+    }
+
     auto TokenUnimplemnted = [&](std::string_view tokName) -> bool {
-        FileLocation pos{ curPos.line + 1, curPos.col + 1, curPos.idx };
-        CompileErrorAtLocation(file, pos, "\"{}\" is not implemented yet", tokName);
+        CompileErrorAtOffset(file, curIdx, "\"{}\" is not implemented yet", tokName);
         return false; // Unreachable
     };
 
-    curToken.pos.idx = curPos.idx;
-    char curChar = file.source[curPos.idx];
+    char curChar = file.source[curIdx];
     switch (curChar) {
         case ';': {
             curToken.kind = TokenKind::SEMICOLON;
-            curToken.text = LeftChop(file.source, curPos.idx, 1);
+            curToken.text = LeftChop(file.source, curIdx, 1);
         } break;
 
         case '(': {
             curToken.kind = TokenKind::LPAREN;
-            curToken.text = LeftChop(file.source, curPos.idx, 1);
+            curToken.text = LeftChop(file.source, curIdx, 1);
         } break;
 
         case ')': {
             curToken.kind = TokenKind::RPAREN;
-            curToken.text = LeftChop(file.source, curPos.idx, 1);
+            curToken.text = LeftChop(file.source, curIdx, 1);
         } break;
 
         case '{': {
             curToken.kind = TokenKind::LCURLY;
-            curToken.text = LeftChop(file.source, curPos.idx, 1);
+            curToken.text = LeftChop(file.source, curIdx, 1);
         } break;
 
         case '}': {
             curToken.kind = TokenKind::RCURLY;
-            curToken.text = LeftChop(file.source, curPos.idx, 1);
+            curToken.text = LeftChop(file.source, curIdx, 1);
         } break;
 
         case '[': {
             curToken.kind = TokenKind::LSQUARE;
-            curToken.text = LeftChop(file.source, curPos.idx, 1);
+            curToken.text = LeftChop(file.source, curIdx, 1);
         } break;
 
         case ']': {
             curToken.kind = TokenKind::RSQUARE;
-            curToken.text = LeftChop(file.source, curPos.idx, 1);
+            curToken.text = LeftChop(file.source, curIdx, 1);
         } break;
 
         case '+': {
             curToken.kind = TokenKind::OPERATOR_POS;
-            curToken.text = LeftChop(file.source, curPos.idx, 1);
+            curToken.text = LeftChop(file.source, curIdx, 1);
         } break;
 
         case '-': {
-            if (curPos.idx + 1 < file.source.size() &&
-                file.source[curPos.idx + 1] == '>')
+            if (curIdx + 1 < file.source.size() &&
+                file.source[curIdx + 1] == '>')
             {
                 curToken.kind = TokenKind::ARROW;
-                curToken.text = LeftChop(file.source, curPos.idx, 2);
+                curToken.text = LeftChop(file.source, curIdx, 2);
             }
             else {
                 curToken.kind = TokenKind::OPERATOR_NEG;
-                curToken.text = LeftChop(file.source, curPos.idx, 1);
+                curToken.text = LeftChop(file.source, curIdx, 1);
             }
         } break;
 
         case '*': {
             curToken.kind = TokenKind::OPERATOR_MUL;
-            curToken.text = LeftChop(file.source, curPos.idx, 1);
+            curToken.text = LeftChop(file.source, curIdx, 1);
         } break;
 
         case '/': {
             curToken.kind = TokenKind::OPERATOR_DIV;
-            curToken.text = LeftChop(file.source, curPos.idx, 1);
+            curToken.text = LeftChop(file.source, curIdx, 1);
         } break;
 
         case '%': {
             curToken.kind = TokenKind::OPERATOR_MOD;
-            curToken.text = LeftChop(file.source, curPos.idx, 1);
+            curToken.text = LeftChop(file.source, curIdx, 1);
         } break;
 
         case ',': {
             curToken.kind = TokenKind::OPERATOR_COMMA;
-            curToken.text = LeftChop(file.source, curPos.idx, 1);
+            curToken.text = LeftChop(file.source, curIdx, 1);
         } break;
 
         case '=': {
-            if (curPos.idx + 1 < file.source.size() &&
-                file.source[curPos.idx + 1] == '=')
+            if (curIdx + 1 < file.source.size() &&
+                file.source[curIdx + 1] == '=')
             {
                 curToken.kind = TokenKind::OPERATOR_EQ;
-                curToken.text = LeftChop(file.source, curPos.idx, 2);
+                curToken.text = LeftChop(file.source, curIdx, 2);
             }
             else {
                 curToken.kind = TokenKind::OPERATOR_ASSIGN;
-                curToken.text = LeftChop(file.source, curPos.idx, 1);
+                curToken.text = LeftChop(file.source, curIdx, 1);
             }
         } break;
 
         case '!': {
-            if (curPos.idx + 1 < file.source.size() &&
-                file.source[curPos.idx + 1] == '=')
+            if (curIdx + 1 < file.source.size() &&
+                file.source[curIdx + 1] == '=')
             {
                 curToken.kind = TokenKind::OPERATOR_NE;
-                curToken.text = LeftChop(file.source, curPos.idx, 2);
+                curToken.text = LeftChop(file.source, curIdx, 2);
             }
             else {
                 curToken.kind = TokenKind::OPERATOR_NOT;
-                curToken.text = LeftChop(file.source, curPos.idx, 1);
+                curToken.text = LeftChop(file.source, curIdx, 1);
             }
         } break;
 
         case '&': {
-            if (curPos.idx + 1 < file.source.size() &&
-                file.source[curPos.idx + 1] == '&')
+            if (curIdx + 1 < file.source.size() &&
+                file.source[curIdx + 1] == '&')
             {
                 curToken.kind = TokenKind::OPERATOR_AND;
-                curToken.text = LeftChop(file.source, curPos.idx, 2);
+                curToken.text = LeftChop(file.source, curIdx, 2);
             }
             else {
                 // TODO: bitwise and
@@ -273,11 +445,11 @@ bool Tokenizer::PollTokenWithComments() {
         } break;
 
         case '|': {
-            if (curPos.idx + 1 < file.source.size() &&
-                file.source[curPos.idx + 1] == '|')
+            if (curIdx + 1 < file.source.size() &&
+                file.source[curIdx + 1] == '|')
             {
                 curToken.kind = TokenKind::OPERATOR_OR;
-                curToken.text = LeftChop(file.source, curPos.idx, 2);
+                curToken.text = LeftChop(file.source, curIdx, 2);
             }
             else {
                 // TODO: bitwise or
@@ -287,38 +459,38 @@ bool Tokenizer::PollTokenWithComments() {
 
         case '>': {
             // TODO: right shift
-            if (curPos.idx + 1 < file.source.size() &&
-                file.source[curPos.idx + 1] == '=')
+            if (curIdx + 1 < file.source.size() &&
+                file.source[curIdx + 1] == '=')
             {
                 curToken.kind = TokenKind::OPERATOR_GE;
-                curToken.text = LeftChop(file.source, curPos.idx, 2);
+                curToken.text = LeftChop(file.source, curIdx, 2);
             }
             else {
                 curToken.kind = TokenKind::OPERATOR_GT;
-                curToken.text = LeftChop(file.source, curPos.idx, 1);
+                curToken.text = LeftChop(file.source, curIdx, 1);
             }
         } break;
 
         case '<': {
             // TODO: left shift
-            if (curPos.idx + 1 < file.source.size() &&
-                file.source[curPos.idx + 1] == '=')
+            if (curIdx + 1 < file.source.size() &&
+                file.source[curIdx + 1] == '=')
             {
                 curToken.kind = TokenKind::OPERATOR_LE;
-                curToken.text = LeftChop(file.source, curPos.idx, 2);
+                curToken.text = LeftChop(file.source, curIdx, 2);
             }
             else {
                 curToken.kind = TokenKind::OPERATOR_LT;
-                curToken.text = LeftChop(file.source, curPos.idx, 1);
+                curToken.text = LeftChop(file.source, curIdx, 1);
             }
         } break;
 
         case '\'':
         case '"': {
-            char delim = LeftChop(file.source, curPos.idx, 1)[0];
+            size_t strStartIdx = curIdx;
+            char delim = LeftChop(file.source, curIdx, 1)[0];
             size_t idx = 0;
-            FileLocation strStart = { .line = curPos.line + 1, .col = curPos.col + 1, .idx = curPos.idx };
-            for (idx = curPos.idx;
+            for (idx = curIdx;
                 idx < file.source.size();
                 ++idx)
             {
@@ -326,7 +498,7 @@ bool Tokenizer::PollTokenWithComments() {
                     break;
                 }
                 if (file.source[idx] == '\n') {
-                    CompileErrorAtLocation(file, strStart, "Unexpected end of line in string literal");
+                    CompileErrorAtOffset(file, strStartIdx, "Unexpected end of line in string literal");
                     return false;
                 }
                 if (file.source[idx] == '\\') {
@@ -337,32 +509,27 @@ bool Tokenizer::PollTokenWithComments() {
                     if (escapeChar != delim && escapeChar != '\n' &&
                         escapeChar != 'n' && escapeChar != 't' && escapeChar != '\\')
                     {
-                        FileLocation pos{
-                            .line = curPos.line + 1,
-                            .col = curPos.col + idx - curPos.idx + 1,
-                            .idx = curPos.idx
-                        };
-                        CompileErrorAtLocation(file, pos, "Invalid escape character \"\\{}\"", escapeChar);
+                        CompileErrorAtOffset(file, idx, "Invalid escape character \"\\{}\"", escapeChar);
                         return false;
                     }
                 }
             }
             if (idx >= file.source.size()) {
-                CompileErrorAtLocation(file, strStart, "Unexpected end of file in string literal");
+                CompileErrorAtOffset(file, strStartIdx, "Unexpected end of file in string literal");
                 return false;
             }
-            curPos.col += 2; // quotes are not included in string literal token
+            // quotes are not included in string literal token
             curToken.kind = delim == '"' ? TokenKind::STRING_LITERAL : TokenKind::CHAR_LITERAL;
-            curToken.text = LeftChop(file.source, curPos.idx, idx-curPos.idx);
+            curToken.text = LeftChop(file.source, curIdx, idx-curIdx);
             if (curToken.kind == TokenKind::CHAR_LITERAL) {
                 if ((curToken.text.size() == 2 && curToken.text[0] != '\\') ||
                     curToken.text.size() > 2)
                 {
-                    CompileErrorAtLocation(file, strStart, "Max length of character literal exceeded");
+                    CompileErrorAtOffset(file, strStartIdx, "Max length of character literal exceeded");
                     return false;
                 }
             }
-            ++curPos.idx;
+            ++curIdx;
         } break;
 
         case '\\': return TokenUnimplemnted("\\");
@@ -371,39 +538,20 @@ bool Tokenizer::PollTokenWithComments() {
         // TODO: pointers
 
         default: {
-            auto IsIdentifier = [](char c) { return (isalnum(c) != 0) || c == '_'; };
-            auto IsNumeric = [](char c) { return isdigit(c) != 0; };
-
-            if ((isalpha(curChar) != 0) || curChar == '_') {
+            if (IsInClass<CharClass::IDENTIFIER>(curChar) && !IsInClass<CharClass::DIGIT>(curChar)) {
                 // identifier or keyword
-                curToken.text = LeftChopWhile(file.source, curPos.idx, IsIdentifier);
-                if      (curToken.text == "if")       curToken.kind = TokenKind::IF;
-                else if (curToken.text == "else")     curToken.kind = TokenKind::ELSE;
-                else if (curToken.text == "for")      curToken.kind = TokenKind::FOR;
-                else if (curToken.text == "u8")       curToken.kind = TokenKind::U8;
-                else if (curToken.text == "i64")      curToken.kind = TokenKind::I64;
-                else if (curToken.text == "f64")      curToken.kind = TokenKind::F64;
-                else if (curToken.text == "proc")     curToken.kind = TokenKind::PROC;
-                else if (curToken.text == "cdecl")    curToken.kind = TokenKind::CDECL;
-                else if (curToken.text == "extern")   curToken.kind = TokenKind::EXTERN;
-                else if (curToken.text == "public")   curToken.kind = TokenKind::PUBLIC;
-                else if (curToken.text == "let")      curToken.kind = TokenKind::LET;
-                else if (curToken.text == "mut")      curToken.kind = TokenKind::MUT;
-                else if (curToken.text == "return")   curToken.kind = TokenKind::RETURN;
-                else if (curToken.text == "break")    curToken.kind = TokenKind::BREAK;
-                else if (curToken.text == "continue") curToken.kind = TokenKind::CONTINUE;
-                else if (curToken.text == "asm")      curToken.kind = TokenKind::ASM;
-                else                                  curToken.kind = TokenKind::IDENTIFIER;
+                curToken.text = LeftChopClass<CharClass::IDENTIFIER>(file.source, curIdx);
+                curToken.kind = LookupKeyword(curToken.text);
             }
-            else if (IsNumeric(curChar)) {
+            else if (IsInClass<CharClass::DIGIT>(curChar)) {
                 // integer literal
                 curToken.kind = TokenKind::INTEGER_LITERAL;
-                curToken.text = LeftChopWhile(file.source, curPos.idx, IsNumeric);
+                curToken.text = LeftChopClass<CharClass::DIGIT>(file.source, curIdx);
                 // float literal
-                if (curPos.idx < file.source.size() && file.source[curPos.idx] == '.') {
+                if (curIdx < file.source.size() && file.source[curIdx] == '.') {
                     curToken.kind = TokenKind::FLOAT_LITERAL;
-                    ++curPos.idx;
-                    std::string_view mantissa = LeftChopWhile(file.source, curPos.idx, IsNumeric);
+                    ++curIdx;
+                    std::string_view mantissa = LeftChopClass<CharClass::DIGIT>(file.source, curIdx);
                     curToken.text = std::string_view{curToken.text.data(), curToken.text.size() + mantissa.size() + 1};
                 }
             }
@@ -414,9 +562,6 @@ bool Tokenizer::PollTokenWithComments() {
     }
 
     assert(curToken.kind != TokenKind::NONE);
-    curToken.pos.line = curPos.line + 1;
-    curToken.pos.col = curPos.col + 1;
-    curPos.col += curToken.text.size();
 
     return true;
 }
@@ -436,22 +581,127 @@ void Tokenizer::ConsumeToken() {
     curToken.kind = TokenKind::NONE;
 }
 
-std::vector<Token> TokenizeEntireSource(const std::vector<File>& files) {
+// Token offsets and file ids are stored in 32 and 16 bits
+static void AssertFileFitsTokens(const std::vector<File>& files, size_t fileId) {
+    const File& file = files[fileId];
+    if (file.source.size() > UINT32_MAX || fileId > UINT16_MAX) {
+        fmt::print(stderr, "Cannot compile {}: sources are limited to {} files of {} bytes\n",
+            file.filename, UINT16_MAX + 1, UINT32_MAX);
+        exit(1);
+    }
+}
+
+TokenStream::TokenStream(const std::vector<File>& files, size_t fileId_, TokenList& pinnedTokens_)
+    : file{files[fileId_]}
+    , fileId{static_cast<uint16_t>(fileId_)}
+    , pinnedTokens{pinnedTokens_}
+    , tokenizer{files[fileId_]}
+    , window(MIN_WINDOW_SIZE)
+{
+    AssertFileFitsTokens(files, fileId_);
+    assert(pinnedTokens.size() == 1);
+    pinnedTokens.reserve(file.source.size() / 4); // Same guess as TokenizeFile, most tokens become nodes
+    At(end++) = { TokenKind::NONE, 0, 0, 0 }; // Reserved empty token
+}
+
+bool TokenStream::Has(size_t idx) {
+    while (idx >= end) {
+        if (exhausted || !tokenizer.PollToken()) {
+            exhausted = true;
+            return false;
+        }
+
+        if (end - begin == window.size()) {
+            // Everything in the window is still needed, double it
+            ArenaVector<Entry> bigger(window.size() * 2);
+            for (size_t i = begin; i < end; ++i)
+                bigger[i & (bigger.size() - 1)] = At(i);
+            window = std::move(bigger);
+        }
+
+        lastToken = tokenizer.curToken;
+        At(end++) = {
+            lastToken.kind,
+            static_cast<uint32_t>(lastToken.text.data() - file.source.data()),
+            static_cast<uint32_t>(lastToken.text.size()),
+            0,
+        };
+        maxWindow = std::max(maxWindow, end - begin);
+        tokenizer.ConsumeToken();
+    }
+    return true;
+}
+
+TokenKind TokenStream::Kind(size_t idx) {
+    assert(idx >= begin && idx < end);
+    return At(idx).kind;
+}
+
+Token TokenStream::operator[](size_t idx) {
+    assert(idx >= begin && idx < end);
+    const Entry& entry = At(idx);
+    return Token{ &file, file.source.substr(entry.offset, entry.length), entry.kind };
+}
+
+uint32_t TokenStream::Pin(size_t idx) {
+    if (idx == 0)
+        return 0;
+    assert(idx >= begin && idx < end);
+    Entry& entry = At(idx);
+    if (entry.pinned == 0) {
+        entry.pinned = static_cast<uint32_t>(pinnedTokens.size());
+        pinnedTokens.push_back(entry.kind, fileId, entry.offset, entry.length);
+    }
+    return entry.pinned;
+}
+
+void TokenStream::Retire(size_t idx) {
+    assert(idx <= end);
+    begin = std::max(begin, idx);
+}
+
+TokenList TokenizeFile(const std::vector<File>& files, size_t fileId) {
+    const File& file = files[fileId];
+    AssertFileFitsTokens(files, fileId);
+
+    TokenList tokens{files};
+    tokens.reserve(file.source.size() / 4); // Rough guess, most tokens are short and separated by whitespace
+
+    for (Tokenizer tokenizer{file};
+        tokenizer.PollToken();
+        tokenizer.ConsumeToken())
+    {
+        const Token& tok = tokenizer.curToken;
+        tokens.push_back(tok.kind, static_cast<uint16_t>(fileId),
+            static_cast<uint32_t>(tok.text.data() - file.source.data()),
+            static_cast<uint32_t>(tok.text.size()));
+    }
+
+    return tokens;
+}
+
+TokenList TokenizeEntireSource(const std::vector<File>& files) {
     // It's debatable if it's better to tokenize the entire source and then parse all tokens,
     // or interleave tokenizing with parsing.
     // Notably, storing tokens contiguously and referring to them by pointer reduces the size of each AST node.
     // Also, constant context switching probably isn't good for the CPU.
-    std::vector<Token> tokens;
-    tokens.emplace_back(); // Reserved empty token
-
-    for (const File& file : files) {
-        for (Tokenizer tokenizer{file};
-            tokenizer.PollToken();
-            tokenizer.ConsumeToken())
-        {
-            tokens.push_back(tokenizer.curToken);
-        }
-    }
+    if (files.size() == 1)
+        return TokenizeFile(files, 0);
+
+    // Files don't depend on each other, tokenize them on separate workers and concatenate in order
+    std::vector<TokenList> fileTokens(files.size());
+    ParallelFor(files.size(), [&](size_t i) {
+        fileTokens[i] = TokenizeFile(files, i);
+    });
+
+    size_t numTokens = 1;
+    for (const auto& segment : fileTokens)
+        numTokens += segment.size() - 1;
+
+    TokenList tokens{files};
+    tokens.reserve(numTokens);
+    for (const auto& segment : fileTokens)
+        tokens.AppendTokens(segment);
 
     return tokens;
 }
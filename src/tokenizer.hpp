@@ -1,6 +1,7 @@
 #pragma once
 
 #include "compileerror.hpp"
+#include "arena.hpp"
 
 #include <string>
 #include <string_view>
@@ -19,6 +20,8 @@ enum class TokenKind : uint8_t {
     CDECL,
     EXTERN,
     PUBLIC,
+    INLINE,
+    IMPORT,
     LET,
     MUT,
     RETURN,
@@ -60,18 +63,24 @@ enum class TokenKind : uint8_t {
 };
 const char* TokenKindName(TokenKind kind);
 
-struct FileLocation {
-    size_t line, col, idx;
-};
-
-// TODO: use bitfield to eliminate wasted 7 bytes after kind
+// A view of a single token
+// Tokens are not stored like this (see TokenList), the location is only recovered when it's needed
 struct Token {
     const File* file;
     std::string_view text;
-    FileLocation pos;
     TokenKind kind;
 
-    friend struct fmt::formatter<Token>;
+    [[nodiscard]] size_t Offset() const {
+        size_t idx = static_cast<size_t>(text.data() - file->source.data());
+        // Quotes are not included in literal text, point at the opening quote
+        if (kind == TokenKind::STRING_LITERAL || kind == TokenKind::CHAR_LITERAL)
+            --idx;
+        return idx;
+    }
+
+    [[nodiscard]] FileLocation Location() const {
+        return LocateInFile(*file, Offset());
+    }
 };
 
 template<>
@@ -83,18 +92,115 @@ struct fmt::formatter<Token> {
 
     template<typename FormatContext>
     auto format(const Token& token, FormatContext& ctx) {
+        FileLocation pos = token.Location();
         return fmt::format_to(ctx.out(), "{}:{}:{}:\"{}\"",
             TokenKindName(token.kind),
-            token.pos.line,
-            token.pos.col,
+            pos.line,
+            pos.col,
             token.text);
     }
 };
 
+using SymbolId = uint32_t;
+static constexpr SymbolId SYMBOL_NONE = 0;
+
+// Interns identifier spellings as dense ids starting at 1,
+// so later passes can index arrays by name instead of hashing strings
+class SymbolTable {
+    ArenaVector<std::string_view> names;
+    ArenaMap<std::string_view, SymbolId> ids;
+
+public:
+    SymbolTable() {
+        names.emplace_back(); // SYMBOL_NONE
+    }
+
+    SymbolId Intern(std::string_view name) {
+        auto [it, inserted] = ids.try_emplace(name, static_cast<SymbolId>(names.size()));
+        if (inserted)
+            names.push_back(name);
+        return it->second;
+    }
+
+    // SYMBOL_NONE if the name never appeared
+    [[nodiscard]] SymbolId Find(std::string_view name) const {
+        auto it = ids.find(name);
+        return it != ids.end() ? it->second : SYMBOL_NONE;
+    }
+
+    [[nodiscard]] std::string_view Name(SymbolId id) const { return names[id]; }
+    [[nodiscard]] size_t size() const { return names.size(); }
+};
+
+// Tokens stored as parallel arrays, about 15 bytes per token
+// The first token is always the reserved empty token (TOKEN_NULL)
+class TokenList {
+    const std::vector<File>* files{};
+    ArenaVector<TokenKind> kinds;
+    ArenaVector<uint32_t> offsets;
+    ArenaVector<uint32_t> lengths;
+    ArenaVector<uint16_t> fileIds;
+    ArenaVector<SymbolId> symbolIds; // SYMBOL_NONE unless the token is an identifier
+    SymbolTable symbols;
+
+public:
+    TokenList() = default;
+    explicit TokenList(const std::vector<File>& files_)
+        : files{&files_}
+    {
+        push_back(TokenKind::NONE, 0, 0, 0); // Reserved empty token
+    }
+
+    [[nodiscard]] size_t size() const { return kinds.size(); }
+    [[nodiscard]] bool empty() const { return kinds.empty(); }
+    [[nodiscard]] TokenKind Kind(size_t idx) const { return kinds[idx]; }
+    [[nodiscard]] SymbolId Symbol(size_t idx) const { return symbolIds[idx]; }
+    [[nodiscard]] const SymbolTable& Symbols() const { return symbols; }
+    [[nodiscard]] Token operator[](size_t idx) const {
+        const File& file = (*files)[fileIds[idx]];
+        return Token{ &file, file.source.substr(offsets[idx], lengths[idx]), kinds[idx] };
+    }
+    [[nodiscard]] Token back() const { return (*this)[size() - 1]; }
+
+    void reserve(size_t n) {
+        kinds.reserve(n);
+        offsets.reserve(n);
+        lengths.reserve(n);
+        fileIds.reserve(n);
+        symbolIds.reserve(n);
+    }
+
+    void push_back(TokenKind kind, uint16_t fileId, uint32_t offset, uint32_t length) {
+        kinds.push_back(kind);
+        fileIds.push_back(fileId);
+        offsets.push_back(offset);
+        lengths.push_back(length);
+        symbolIds.push_back(kind == TokenKind::IDENTIFIER ?
+            symbols.Intern((*files)[fileId].source.substr(offset, length)) :
+            SYMBOL_NONE);
+    }
+
+    // Appends every token of other except its reserved empty token
+    // Symbols of other are interned into this list, so only each distinct name is hashed again
+    void AppendTokens(const TokenList& other) {
+        kinds.insert(kinds.end(), other.kinds.begin() + 1, other.kinds.end());
+        offsets.insert(offsets.end(), other.offsets.begin() + 1, other.offsets.end());
+        lengths.insert(lengths.end(), other.lengths.begin() + 1, other.lengths.end());
+        fileIds.insert(fileIds.end(), other.fileIds.begin() + 1, other.fileIds.end());
+
+        ArenaVector<SymbolId> remap(other.symbols.size());
+        for (SymbolId id = 1; id < other.symbols.size(); ++id)
+            remap[id] = symbols.Intern(other.symbols.Name(id));
+        for (size_t i = 1; i < other.symbolIds.size(); ++i)
+            symbolIds.push_back(remap[other.symbolIds[i]]);
+    }
+};
+
 
 class Tokenizer {
     const File& file;
-    FileLocation curPos{};
+    size_t curIdx{};
+
 public:
     Token curToken{};
 
@@ -112,5 +218,51 @@ public:
     void ConsumeToken();
 };
 
-std::vector<Token> TokenizeEntireSource(const std::vector<File>& files);
+// Tokens of one file, tokenized only as far as the parser has looked ahead.
+// Only a window of tokens is kept. The parser retires the tokens it won't go back to,
+// and pins the ones the AST refers to, which copies them to a token list that outlives the stream.
+// Indices are the same as if the whole file was tokenized into a TokenList.
+class TokenStream {
+    struct Entry {
+        TokenKind kind;
+        uint32_t offset;
+        uint32_t length;
+        uint32_t pinned; // Index in the pinned token list, 0 until pinned
+    };
+
+    const File& file;
+    uint16_t fileId;
+    TokenList& pinnedTokens;
+    Tokenizer tokenizer;
+    ArenaVector<Entry> window; // Ring buffer, the size is always a power of two
+    size_t begin{}, end{};     // The window holds the tokens in [begin, end)
+    size_t maxWindow{};
+    Token lastToken{};
+    bool exhausted{};
+
+    Entry& At(size_t idx) { return window[idx & (window.size() - 1)]; }
+
+public:
+    static constexpr size_t MIN_WINDOW_SIZE = 256;
+
+    // pinnedTokens must only hold its reserved empty token
+    TokenStream(const std::vector<File>& files, size_t fileId, TokenList& pinnedTokens);
+
+    // Tokenizes up to idx, false if the file ends before it
+    bool Has(size_t idx);
+    // Only tokens that Has returned true for and that are not retired can be looked at
+    [[nodiscard]] TokenKind Kind(size_t idx);
+    [[nodiscard]] Token operator[](size_t idx);
+    // Only valid once Has returned false
+    [[nodiscard]] Token Last() const { return lastToken; }
+
+    // Returns the index of the token in the pinned token list
+    uint32_t Pin(size_t idx);
+    // Tokens before idx will never be looked at again
+    void Retire(size_t idx);
+    // Most tokens that were held at once
+    [[nodiscard]] size_t MaxWindow() const { return maxWindow; }
+};
 
+TokenList TokenizeFile(const std::vector<File>& files, size_t fileId);
+TokenList TokenizeEntireSource(const std::vector<File>& files);
@@ -0,0 +1,124 @@
+// Inline asm test: compiles procedures whose asm reads the slots of their variables
+// and checks the variables are stored there, even when the compiler knows their values.
+// Runs the code when nasm is available, otherwise checks the emitted assembly.
+// Run with make test, see PrintUsage for options
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fmt/core.h>
+
+namespace fs = std::filesystem;
+
+// Exits right away, the emitted code doesn't keep callee saved registers for main
+static constexpr const char* NATIVE_DRIVER =
+    "#include <stdlib.h>\n"
+    "extern long entry(void);\n"
+    "int main(void) { exit(entry() == 42 ? 0 : 1); }\n";
+
+struct Case {
+    const char* name;
+    std::string source; // entry returns 42 when the asm read the right value
+    std::string store; // Emitted before the asm when nothing can be run
+};
+
+static const std::vector<Case> CASES{
+    // The let is propagated as a constant, its slot (0) must still be written
+    { "let", R"(proc public entry() -> i64 {
+    let i64 x = 42;
+    mut i64 y = 0;
+    asm "mov rax, QWORD [rbp-8]" "mov QWORD [rbp-16], rax";
+    return y;
+}
+)", "mov QWORD [rbp-0-8], rax" },
+    // The store looks dead, nothing reads x but the asm
+    { "mut", R"(proc public entry() -> i64 {
+    mut i64 x = 40 + 2;
+    mut i64 y = 0;
+    asm "mov rax, QWORD [rbp-8]" "mov QWORD [rbp-16], rax";
+    return y;
+}
+)", "mov QWORD [rbp-0-8], rax" },
+};
+
+static std::string ReadFile(const fs::path& path) {
+    std::ifstream file{path, std::ios::binary};
+    std::stringstream text;
+    text << file.rdbuf();
+    return text.str();
+}
+
+static void PrintUsage() {
+    fmt::print(stderr,
+        "Usage: asmtest [options]\n"
+        "-trashc <file>   The compiler to test (defaults to bin/trashc).\n"
+        "-work <dir>      Where the programs, assembly and binaries go (defaults to a temporary directory).\n"
+        "-h               Displays this information\n"
+    );
+}
+
+int main(int argc, char** argv) {
+    fs::path trashc = "bin/trashc";
+    fs::path workDir = fs::temp_directory_path() / "trash-asmtest";
+
+    std::vector<std::string> args(argv + 1, argv + argc);
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        if (arg == "-h") {
+            PrintUsage();
+            return 0;
+        }
+        if ((arg != "-trashc" && arg != "-work") || i + 1 == args.size()) {
+            PrintUsage();
+            return 1;
+        }
+        (arg == "-trashc" ? trashc : workDir) = args[++i];
+    }
+    fs::create_directories(workDir);
+
+    bool canAssemble = std::system("command -v nasm >/dev/null 2>&1") == 0;
+    if (!canAssemble)
+        fmt::print(stderr, "nasm was not found, only the emitted assembly is checked\n");
+    fs::path driverFn = workDir / "driver.c";
+    std::ofstream{driverFn} << NATIVE_DRIVER;
+
+    bool isAnyFailed = false;
+    for (const Case& test : CASES) {
+        fs::path sourceFn = workDir / fmt::format("{}.trash", test.name);
+        fs::path asmFn = workDir / fmt::format("{}.asm", test.name);
+        fs::path objFn = workDir / fmt::format("{}.o", test.name);
+        fs::path binFn = workDir / test.name;
+        std::ofstream{sourceFn, std::ios::binary} << test.source;
+
+        bool isFailed = false;
+        std::string compile = fmt::format("'{}' -i '{}' -o '{}' >/dev/null 2>&1", trashc.string(), sourceFn.string(), asmFn.string());
+        if (std::system(compile.c_str()) != 0) {
+            fmt::print(stderr, "{}: could not compile\n", test.name);
+            isFailed = true;
+        }
+        else if (canAssemble) {
+            std::string build = fmt::format("nasm -f elf64 '{}' -o '{}' && cc -no-pie '{}' '{}' -o '{}'",
+                asmFn.string(), objFn.string(), driverFn.string(), objFn.string(), binFn.string());
+            if (std::system(build.c_str()) != 0 || std::system(fmt::format("'{}'", binFn.string()).c_str()) != 0) {
+                fmt::print(stderr, "{}: the asm did not read 42\n", test.name);
+                isFailed = true;
+            }
+        }
+        else {
+            std::string text = ReadFile(asmFn);
+            size_t entry = text.find("trash_entry:");
+            size_t asmStart = text.find("mov rax, QWORD [rbp-8]\n", entry);
+            size_t store = text.find(test.store, entry);
+            if (entry == std::string::npos || asmStart == std::string::npos || store == std::string::npos || store > asmStart) {
+                fmt::print(stderr, "{}: expected \"{}\" before the asm in {}\n", test.name, test.store, asmFn.string());
+                isFailed = true;
+            }
+        }
+        fmt::print(stderr, "{:<12} {}\n", test.name, isFailed ? "FAILED" : "ok");
+        isAnyFailed = isAnyFailed || isFailed;
+    }
+    return isAnyFailed ? 1 : 0;
+}
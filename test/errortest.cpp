@@ -0,0 +1,145 @@
+// Error determinism test: compiles programs with more than one error at several thread counts (-j)
+// and checks trashc reports the same first error every time, the one a single thread finds
+// Run with make test, see PrintUsage for options
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fmt/core.h>
+
+namespace fs = std::filesystem;
+
+static constexpr size_t THREAD_COUNTS[] = { 1, 2, 4, 8, 32 };
+
+struct SourceFile {
+    std::string filename;
+    std::string source;
+};
+
+struct Case {
+    const char* name;
+    std::vector<SourceFile> files;
+    std::string expected; // Part of the first error
+};
+
+// Procedures before the first error are slow to verify, so later workers get to theirs first
+static std::string SlowProcedure(size_t i) {
+    std::string body = "x";
+    for (size_t k = 1; k < 200; ++k)
+        body += fmt::format(" + x * {}", k);
+    return fmt::format("proc p{}(let i64 x) -> i64 {{ return {}; }}\n", i, body);
+}
+
+static Case VerifyErrors() {
+    std::string source = "proc entry() -> i64 { return 0; }\n";
+    for (size_t i = 1; i < 20000; ++i) {
+        if (i == 600) source += fmt::format("proc p{}() -> i64 {{ return undefined1; }}\n", i);
+        else if (i == 630) source += fmt::format("proc p{}() -> i64 {{ return undefined2; }}\n", i);
+        else if (i < 600) source += SlowProcedure(i);
+        else source += fmt::format("proc p{}() -> i64 {{ return {}; }}\n", i, i);
+    }
+    return { "verify", { { "verify.trash", source } }, "verify.trash:601:29" };
+}
+
+// Every batch fails at once, their errors are in the same file (run under -fsanitize=thread as well)
+static Case ManyVerifyErrors() {
+    std::string source = "proc entry() -> i64 { return 0; }\n";
+    for (size_t i = 1; i <= 4000; ++i)
+        source += fmt::format("proc p{}() -> i64 {{ return undefined{}; }}\n", i, i);
+    return { "many", { { "many.trash", source } }, "many.trash:2:27" };
+}
+
+// The first file is long, so the second is parsed first
+static Case ParseErrors() {
+    std::string first = "proc entry() -> i64 { return 0; }\n";
+    for (size_t i = 1; i < 20000; ++i)
+        first += SlowProcedure(i);
+    first += "proc late() { mut i64 x = ; }\n";
+    return { "parse", { { "fa.trash", first }, { "fb.trash", "proc early() { 1 +; }\n" } }, "fa.trash:20001:" };
+}
+
+static std::string ReadFile(const fs::path& path) {
+    std::ifstream file{path, std::ios::binary};
+    std::stringstream text;
+    text << file.rdbuf();
+    return text.str();
+}
+
+// Drops the escape sequences that color the diagnostic
+static std::string Unstyled(const std::string& text) {
+    std::string plain;
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '\x1b')
+            i = text.find('m', i);
+        else
+            plain += text[i];
+    }
+    return plain;
+}
+
+static void PrintUsage() {
+    fmt::print(stderr,
+        "Usage: errortest [options]\n"
+        "-trashc <file>   The compiler to test (defaults to bin/trashc).\n"
+        "-work <dir>      Where the programs and outputs go (defaults to a temporary directory).\n"
+        "-h               Displays this information\n"
+    );
+}
+
+int main(int argc, char** argv) {
+    fs::path trashc = "bin/trashc";
+    fs::path workDir = fs::temp_directory_path() / "trash-errortest";
+
+    std::vector<std::string> args(argv + 1, argv + argc);
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        if (arg == "-h") {
+            PrintUsage();
+            return 0;
+        }
+        if ((arg != "-trashc" && arg != "-work") || i + 1 == args.size()) {
+            PrintUsage();
+            return 1;
+        }
+        (arg == "-trashc" ? trashc : workDir) = args[++i];
+    }
+    fs::create_directories(workDir);
+
+    bool isAnyFailed = false;
+    for (const Case& test : { VerifyErrors(), ManyVerifyErrors(), ParseErrors() }) {
+        std::string inputs;
+        for (const SourceFile& file : test.files) {
+            fs::path path = workDir / file.filename;
+            std::ofstream{path, std::ios::binary} << file.source;
+            inputs += fmt::format(" '{}'", path.string());
+        }
+
+        bool isFailed = false;
+        std::string first;
+        for (size_t numThreads : THREAD_COUNTS) {
+            fs::path outFn = workDir / fmt::format("{}.{}.txt", test.name, numThreads);
+            std::string command = fmt::format("'{}' -j {} -i{} >/dev/null 2>'{}'",
+                trashc.string(), numThreads, inputs, outFn.string());
+            int status = std::system(command.c_str());
+            std::string output = Unstyled(ReadFile(outFn));
+            std::string line = output.substr(0, output.find('\n'));
+            if (status == 0 || line.find(test.expected) == std::string::npos) {
+                fmt::print(stderr, "{} -j {}: expected an error at {}, got:\n{}\n", test.name, numThreads, test.expected, output);
+                isFailed = true;
+            }
+            if (first.empty())
+                first = output;
+            else if (output != first) {
+                fmt::print(stderr, "{} -j {}: the error differs from -j {}:\n{}\n", test.name, numThreads, THREAD_COUNTS[0], output);
+                isFailed = true;
+            }
+        }
+        fmt::print(stderr, "{:<12} {}\n", test.name, isFailed ? "FAILED" : "ok");
+        isAnyFailed = isAnyFailed || isFailed;
+    }
+    return isAnyFailed ? 1 : 0;
+}